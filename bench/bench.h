@@ -0,0 +1,66 @@
+/*
+    bench.h - helpers shared by the cShell benchmark programs
+
+    Each benchmark program is a single source file that includes this header once, after
+    its system headers or after "../src/cshell.c".  Defining BENCH_COUNT_ALLOCATIONS first
+    replaces malloc, calloc and realloc with versions that count their calls in
+    allocations, except under AddressSanitizer or libFuzzer, which bring their own
+    allocators.
+*/
+
+#ifndef CSHELL_BENCH_H
+#define CSHELL_BENCH_H
+
+#include <stdlib.h>
+#include <time.h>
+
+/* Function prototypes */
+    int compare_doubles(const void *, const void *);
+    double now(void);
+
+/* Global variables */
+    unsigned long allocations = 0;  /* heap allocations, counted with BENCH_COUNT_ALLOCATIONS */
+    int first_result = 1;       /* true until the first result has been written as JSON */
+
+/* Count heap allocations. */
+#if defined(BENCH_COUNT_ALLOCATIONS) && !defined(__SANITIZE_ADDRESS__) && !defined(CSHELL_LIBFUZZER)
+extern void * __libc_malloc(size_t);
+extern void * __libc_calloc(size_t, size_t);
+extern void * __libc_realloc(void *, size_t);
+
+void * malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t count, size_t size)
+{
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+void * realloc(void * ptr, size_t size)
+{
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+/* Compare two doubles for qsort. */
+int compare_doubles(const void * a, const void * b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Return the current time in seconds. */
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#endif
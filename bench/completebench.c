@@ -0,0 +1,132 @@
+/*
+    completebench - tab completion benchmarks for cShell
+
+    usage:
+
+        completebench [files] [binaries] > results.json
+
+    cShell is compiled into this program as a library (CSHELL_LIBRARY) and complete_line(),
+    the function behind the Tab key, is called directly.  A temporary directory holding a
+    large number of files and a PATH of 50 directories holding the given number of
+    executables between them are created first.  Each case reports the time of the first
+    completion, which reads the directories, and the median of later completions, which are
+    served from the caches.  The last case creates a file between completions so that every
+    completion has to reread the directory after inotify reports the change.
+*/
+
+#define CSHELL_LIBRARY
+#include "../src/cshell.c"
+#include "bench.h"
+
+#define PATH_DIR_COUNT 50
+#define REPEATS 200
+
+/* Function prototypes */
+    void create_files(const char *, int, const char *, mode_t);
+    void time_completion(const char *, const char *, int);
+
+/* Main function */
+int main(int argc, char ** argv)
+{
+    int files = argc > 1 ? atoi(argv[1]) : 200000;
+    int binaries = argc > 2 ? atoi(argv[2]) : 5000;
+    char root[] = "/tmp/completebench.XXXXXX";
+    char dir[256];
+    buffer path = {NULL, 0, 0};
+
+    if (!mkdtemp(root))
+    {
+        perror("completebench");
+        return 1;
+    }
+    snprintf(dir, sizeof(dir), "%s/files", root);
+    mkdir(dir, 0700);
+    create_files(dir, files, "file", 0600);
+    for (int i = 0; i < PATH_DIR_COUNT; i++)
+    {
+        char prefix[32];
+        snprintf(dir, sizeof(dir), "%s/bin%d", root, i);
+        mkdir(dir, 0700);
+        snprintf(prefix, sizeof(prefix), "tool%d-", i);
+        create_files(dir, binaries / PATH_DIR_COUNT, prefix, 0700);
+        if (i)
+        {
+            buffer_append(&path, ":", 1);
+        }
+        buffer_append(&path, dir, strlen(dir));
+    }
+    var_set("PATH", path.data, 1);
+    snprintf(dir, sizeof(dir), "%s/files", root);
+    var_set("PWD", dir, 1);
+    chdir(dir);
+    fprintf(stderr, "completebench: %d files, %d executables in %d PATH directories\n",
+        files, binaries, PATH_DIR_COUNT);
+
+    printf("{\n  \"files\": %d,\n  \"binaries\": %d,\n  \"results\": {", files, binaries);
+    time_completion("command", "tool4", 0);
+    time_completion("command_unique", "tool42-1", 0);
+    time_completion("file", "ls file1999", 0);
+    time_completion("file_all", "ls ", 0);
+    time_completion("file_changed", "ls file1999", 1);
+    printf("\n  }\n}\n");
+
+    chdir("/");
+    snprintf(dir, sizeof(dir), "rm -rf %s", root);
+    system(dir);
+    free(path.data);
+    return 0;
+}
+
+/* Create count empty files named prefix followed by a number in a directory. */
+void create_files(const char * dir, int count, const char * prefix, mode_t mode)
+{
+    int dir_fd = open(dir, O_RDONLY|O_DIRECTORY);
+    char name[64];
+
+    for (int i = 0; i < count; i++)
+    {
+        snprintf(name, sizeof(name), "%s%d", prefix, i);
+        close(openat(dir_fd, name, O_WRONLY|O_CREAT, mode));
+    }
+    close(dir_fd);
+}
+
+/* Time completing the end of a line, first against empty caches and then repeatedly. */
+/* If touch is true, a file is created before each repeat to invalidate the cache. */
+void time_completion(const char * name, const char * line, int touch)
+{
+    double samples[REPEATS];
+    double first = 0;
+    size_t matches = 0;
+    size_t start;
+
+    for (int i = 0; i <= REPEATS; i++)
+    {
+        double begin;
+
+        if (touch)
+        {
+            char file[32];
+            snprintf(file, sizeof(file), "new%d", i);
+            close(open(file, O_WRONLY|O_CREAT, 0600));
+        }
+        begin = now();
+        matches = complete_line(line, strlen(line), &start);
+        if (i == 0)
+        {
+            first = now() - begin;
+        }
+        else
+        {
+            samples[i - 1] = now() - begin;
+        }
+    }
+    qsort(samples, REPEATS, sizeof(double), compare_doubles);
+
+    printf("%s\n    \"%s\": {\"matches\": %zu, \"first_ms\": %.3f, \"median_ms\": %.3f, \"p99_ms\": %.3f}",
+        first_result ? "" : ",", name, matches, first * 1e3, samples[REPEATS / 2] * 1e3,
+        samples[(REPEATS * 99) / 100] * 1e3);
+    first_result = 0;
+    fprintf(stderr, "    %-14s %7zu matches  first %8.3fms  median %8.3fms  p99 %8.3fms\n", name, matches,
+        first * 1e3, samples[REPEATS / 2] * 1e3, samples[(REPEATS * 99) / 100] * 1e3);
+}
@@ -0,0 +1,111 @@
+/*
+    globbench - glob expansion benchmarks for cShell
+
+    usage:
+
+        globbench [directories] [files-per-directory] > results.json
+
+    cShell is compiled into this program as a library (CSHELL_LIBRARY) and glob_expand(),
+    the function behind glob patterns in arguments, is compared with glibc's glob() on a
+    temporary tree of directories each holding the same number of files (1000 x 1000 by
+    default, for a million files).  glibc's glob() has no ** so the recursive case is
+    compared with the equivalent single level pattern, which matches the same files in
+    this tree.  Each pattern is expanded a few times and the fastest run is reported.
+*/
+
+#define CSHELL_LIBRARY
+#include "../src/cshell.c"
+
+#include <glob.h>
+#include "bench.h"
+
+#define RUNS 3
+
+/* Function prototypes */
+    void time_pattern(const char *, const char *, const char *);
+
+/* Main function */
+int main(int argc, char ** argv)
+{
+    int directories = argc > 1 ? atoi(argv[1]) : 1000;
+    int files = argc > 2 ? atoi(argv[2]) : 1000;
+    char root[] = "/tmp/globbench.XXXXXX";
+    char command[64];
+    double start;
+
+    if (!mkdtemp(root) || chdir(root) < 0)
+    {
+        perror("globbench");
+        return 1;
+    }
+    start = now();
+    for (int i = 0; i < directories; i++)
+    {
+        char name[32];
+        int dir_fd;
+
+        snprintf(name, sizeof(name), "dir%d", i);
+        mkdir(name, 0700);
+        dir_fd = open(name, O_RDONLY|O_DIRECTORY);
+        for (int n = 0; n < files; n++)
+        {
+            snprintf(name, sizeof(name), "file%d", n);
+            close(openat(dir_fd, name, O_WRONLY|O_CREAT, 0600));
+        }
+        close(dir_fd);
+    }
+    fprintf(stderr, "globbench: created %d directories of %d files in %.1fs\n",
+        directories, files, now() - start);
+
+    printf("{\n  \"directories\": %d,\n  \"files_per_directory\": %d,\n  \"results\": {", directories, files);
+    time_pattern("prefix", "*/file1*", "*/file1*");
+    time_pattern("all", "*/*", "*/*");
+    time_pattern("bracket", "dir[0-4]*/file[!0-8]", "dir[0-4]*/file[!0-8]");
+    time_pattern("recursive", "**/file99*", "*/file99*");
+    printf("\n  }\n}\n");
+
+    chdir("/");
+    snprintf(command, sizeof(command), "rm -rf %s", root);
+    system(command);
+    return 0;
+}
+
+/* Time expanding a pattern with glob_expand() and the equivalent pattern with glob(). */
+void time_pattern(const char * name, const char * pattern, const char * glibc_pattern)
+{
+    double best = 0, glibc_best = 0;
+    size_t count = 0, glibc_count = 0;
+
+    for (int run = 0; run < RUNS; run++)
+    {
+        char ** matches;
+        glob_t g;
+        double start = now();
+        double seconds;
+
+        count = glob_expand(pattern, &matches);
+        seconds = now() - start;
+        best = run == 0 || seconds < best ? seconds : best;
+        for (size_t i = 0; i < count; i++)
+        {
+            free(matches[i]);
+        }
+        free(matches);
+
+        start = now();
+        glibc_count = glob(glibc_pattern, 0, NULL, &g) == 0 ? g.gl_pathc : 0;
+        seconds = now() - start;
+        glibc_best = run == 0 || seconds < glibc_best ? seconds : glibc_best;
+        globfree(&g);
+    }
+    if (count != glibc_count)
+    {
+        fprintf(stderr, "globbench: %s matched %zu paths but glob() matched %zu\n", pattern, count, glibc_count);
+    }
+
+    printf("%s\n    \"%s\": {\"pattern\": \"%s\", \"matches\": %zu, \"ms\": %.3f, \"glob_ms\": %.3f, \"speedup\": %.2f}",
+        first_result ? "" : ",", name, pattern, count, best * 1e3, glibc_best * 1e3, glibc_best / best);
+    first_result = 0;
+    fprintf(stderr, "    %-22s %8zu matches  %9.3fms  glob() %9.3fms  %5.2fx\n", pattern, count,
+        best * 1e3, glibc_best * 1e3, glibc_best / best);
+}
@@ -0,0 +1,103 @@
+/*
+    heredocbench - here-document benchmarks for cShell
+
+    usage:
+
+        heredocbench [iterations] > results.json
+
+    cShell is compiled into this program as a library (CSHELL_LIBRARY).  Each iteration
+    opens a here-document with heredoc_open(), as launch_job() does for a process's
+    standard input, and reads it back to the end, as the process would.  A small body of
+    64 bytes goes through a pipe.  A body of 1MB is timed when its text differs on every
+    iteration, so that a new memfd is written and sealed each time, when the same text is
+    repeated, as in a loop, so that the memfd is reused, and for comparison when it is
+    written to a temporary file in /tmp that is unlinked and read back.  Results are
+    microseconds per iteration.
+*/
+
+#define CSHELL_LIBRARY
+#include "../src/cshell.c"
+#include "bench.h"
+
+/* Function prototypes */
+    void read_all(int);
+    void report(const char *, double, long);
+    int temp_file(const char *, size_t);
+
+/* Main function */
+int main(int argc, char ** argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 1000;
+    size_t large = 1 << 20;
+    char * text = (char *)malloc(large);
+    double begin;
+
+    memset(text, 'x', large);
+    printf("{\n  \"iterations\": %ld,\n  \"results\": {", iterations);
+
+    begin = now();
+    for (long i = 0; i < iterations; i++)
+    {
+        read_all(heredoc_open(text, 64));
+    }
+    report("pipe_64b", now() - begin, iterations);
+
+    begin = now();
+    for (long i = 0; i < iterations; i++)
+    {
+        //Changing the text makes every body a new one.
+        memcpy(text, &i, sizeof(i));
+        read_all(heredoc_open(text, large));
+    }
+    report("memfd_1mb_new", now() - begin, iterations);
+
+    begin = now();
+    for (long i = 0; i < iterations; i++)
+    {
+        read_all(heredoc_open(text, large));
+    }
+    report("memfd_1mb_reused", now() - begin, iterations);
+
+    begin = now();
+    for (long i = 0; i < iterations; i++)
+    {
+        read_all(temp_file(text, large));
+    }
+    report("tmpfile_1mb", now() - begin, iterations);
+
+    printf("\n  }\n}\n");
+    free(text);
+    return 0;
+}
+
+/* Read a descriptor to the end and close it. */
+void read_all(int fd)
+{
+    char data[65536];
+
+    while (read(fd, data, sizeof(data)) > 0)
+    {
+    }
+    close(fd);
+}
+
+/* Print the time per iteration in microseconds, as JSON and to the terminal. */
+void report(const char * name, double seconds, long iterations)
+{
+    printf("%s\n    \"%s\": {\"us_per_iteration\": %.2f}", first_result ? "" : ",",
+        name, seconds * 1e6 / iterations);
+    first_result = 0;
+    fprintf(stderr, "    %-18s %9.2f us/iteration\n", name, seconds * 1e6 / iterations);
+}
+
+/* Write text to an unlinked temporary file and return a descriptor reading it from the start. */
+int temp_file(const char * text, size_t length)
+{
+    char path[] = "/tmp/heredocbench.XXXXXX";
+    int fd = mkstemp(path);
+
+    write(fd, text, length);
+    lseek(fd, 0, SEEK_SET);
+    unlink(path);
+    return fd;
+}
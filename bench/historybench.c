@@ -0,0 +1,151 @@
+/*
+    historybench - history search benchmarks for cShell
+
+    usage:
+
+        historybench [entries] [searches] > results.json
+
+    cShell is compiled into this program as a library (CSHELL_LIBRARY).  A temporary
+    history file of the given number of generated commands (1,000,000 by default) is
+    opened with history_init(), as the shell does at startup, and history_search(), the
+    function behind Ctrl-R, is called directly with substrings of random entries and with
+    queries that match nothing.  Searches are timed before any of the history has been
+    indexed, as for a Ctrl-R straight after startup, and once the whole history has been
+    indexed by the batches of HISTORY_INDEX_BATCH entries that the shell adds while it
+    waits for a key.  The longest batch is also reported, as it is the most a keystroke can
+    be delayed by indexing.
+*/
+
+#define CSHELL_LIBRARY
+#include "../src/cshell.c"
+#include "bench.h"
+
+/* Function prototypes */
+    void make_queries(char (*)[16], int);
+    void time_searches(const char *, char (*)[16], int);
+    void write_history(const char *, long);
+
+/* Main function */
+int main(int argc, char ** argv)
+{
+    long entries = argc > 1 ? atol(argv[1]) : 1000000;
+    int searches = argc > 2 ? atoi(argv[2]) : 1000;
+    char path[] = "/tmp/historybench.XXXXXX";
+    char (*queries)[16] = (char (*)[16])malloc(sizeof(*queries) * searches);
+    double begin;
+    double opened;
+    double batch_max = 0;
+    double index_total = 0;
+    int batches = 0;
+
+    close(mkstemp(path));
+    write_history(path, entries);
+    var_init();
+    var_set("CSHELL_HISTFILE", path, 0);
+    srand(2);
+    make_queries(queries, searches);
+
+    printf("{\n  \"entries\": %ld,\n  \"searches\": %d,\n  \"results\": {", entries, searches);
+    begin = now();
+    history_init();
+    opened = now() - begin;
+    printf("\n    \"open\": {\"ms\": %.3f}", opened * 1e3);
+    first_result = 0;
+    fprintf(stderr, "    %-18s %9.3fms\n", "open", opened * 1e3);
+
+    time_searches("search_unindexed", queries, searches);
+
+    while (history_indexed < history_count)
+    {
+        double took;
+
+        begin = now();
+        history_index(HISTORY_INDEX_BATCH);
+        took = now() - begin;
+        index_total += took;
+        batch_max = took > batch_max ? took : batch_max;
+        batches++;
+    }
+    printf(",\n    \"index\": {\"batches\": %d, \"total_ms\": %.3f, \"max_batch_ms\": %.3f}",
+        batches, index_total * 1e3, batch_max * 1e3);
+    fprintf(stderr, "    %-18s %9.3fms  in %d batches of at most %.3fms\n", "index",
+        index_total * 1e3, batches, batch_max * 1e3);
+
+    time_searches("search_indexed", queries, searches);
+    printf("\n  }\n}\n");
+
+    unlink(path);
+    free(queries);
+    return 0;
+}
+
+/* Fill queries with six byte substrings of random history entries, every tenth of them */
+/* replaced by a query that is in no entry. */
+void make_queries(char (*queries)[16], int count)
+{
+    history_init();
+    for (int i = 0; i < count; i++)
+    {
+        history_entry * e = &history_entries[rand() % history_count];
+        size_t offset = e->length > 6 ? rand() % (e->length - 6) : 0;
+
+        if (i % 10 == 9)
+        {
+            snprintf(queries[i], sizeof(queries[i]), "zq%04dx", i % 10000);
+            continue;
+        }
+        snprintf(queries[i], sizeof(queries[i]), "%.*s", 6, history_map + e->offset + offset);
+    }
+    //The history is opened again, from scratch, for the timings.
+    munmap(history_map, history_mapped);
+    close(history_fd);
+    history_map = NULL;
+    history_mapped = history_scanned = history_count = 0;
+    history_fd = -1;
+}
+
+/* Time searching the whole history for each query, as the first Ctrl-R would. */
+void time_searches(const char * name, char (*queries)[16], int count)
+{
+    double * samples = (double *)malloc(sizeof(double) * count);
+    int found = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        double begin = now();
+
+        found += history_search(queries[i], strlen(queries[i]), history_count) >= 0;
+        samples[i] = now() - begin;
+    }
+    qsort(samples, count, sizeof(double), compare_doubles);
+
+    printf("%s\n    \"%s\": {\"found\": %d, \"median_ms\": %.4f, \"p99_ms\": %.4f, \"max_ms\": %.4f}",
+        first_result ? "" : ",", name, found, samples[count / 2] * 1e3,
+        samples[(count * 99) / 100] * 1e3, samples[count - 1] * 1e3);
+    first_result = 0;
+    fprintf(stderr, "    %-18s %5d found  median %8.4fms  p99 %8.4fms  max %8.4fms\n", name, found,
+        samples[count / 2] * 1e3, samples[(count * 99) / 100] * 1e3, samples[count - 1] * 1e3);
+    free(samples);
+}
+
+/* Write a history file of generated commands, one per line. */
+void write_history(const char * path, long entries)
+{
+    static const char * commands[] = {"git commit -m", "make -j8", "grep -rn", "ls -l", "cd",
+        "vim", "ssh", "docker run", "kubectl get pods -n", "python3", "cat", "tail -f"};
+    static const char * words[] = {"src", "build", "test", "main", "server", "config",
+        "release", "deploy", "cache", "notes", "report", "debug"};
+    FILE * f = fopen(path, "w");
+
+    srand(1);
+    for (long i = 0; i < entries; i++)
+    {
+        fprintf(f, "%s", commands[rand() % 12]);
+        for (int w = rand() % 4; w >= 0; w--)
+        {
+            fprintf(f, " %s%d/%s_%d", words[rand() % 12], rand() % 1000, words[rand() % 12], rand() % 100000);
+        }
+        fputc('\n', f);
+    }
+    fclose(f);
+}
@@ -0,0 +1,99 @@
+/*
+    loopbench - compound command benchmarks for cShell
+
+    usage:
+
+        loopbench [outer] [inner] > results.json
+
+    cShell is compiled into this program as a library (CSHELL_LIBRARY) and execute_line() is
+    called directly.  A pair of nested for loops of outer and inner iterations (1000 each by
+    default, so a million in all) runs the set builtin with an expanded argument.  This is
+    timed once as a single command line, whose AST is parsed once and then evaluated on
+    every iteration, and once by passing the loop body to execute_line() as text on every
+    iteration, so that it is tokenized and parsed each time as a line typed in a loop
+    would be.  A third case calls a function from the loop.  Results are nanoseconds and
+    heap allocations per iteration.
+*/
+
+#define CSHELL_LIBRARY
+#include "../src/cshell.c"
+#define BENCH_COUNT_ALLOCATIONS
+#include "bench.h"
+
+/* Function prototypes */
+    void report(const char *, double, unsigned long, long);
+    char * word_list(long);
+
+/* Main function */
+int main(int argc, char ** argv)
+{
+    long outer = argc > 1 ? atol(argv[1]) : 1000;
+    long inner = argc > 2 ? atol(argv[2]) : 1000;
+    char * outer_words = word_list(outer);
+    char * inner_words = word_list(inner);
+    char * line;
+    char number[32];
+    unsigned long before;
+    double begin;
+
+    var_init();
+    printf("{\n  \"iterations\": %ld,\n  \"results\": {", outer * inner);
+
+    asprintf(&line, "for i in %s ; do for j in %s ; do set x $i.$j ; done ; done", outer_words, inner_words);
+    before = allocations;
+    begin = now();
+    execute_line(line);
+    report("cached_ast", now() - begin, allocations - before, outer * inner);
+    free(line);
+
+    //The same loop with its body handed to execute_line() as text on every iteration.
+    before = allocations;
+    begin = now();
+    for (long i = 0; i < outer; i++)
+    {
+        snprintf(number, sizeof(number), "%ld", i);
+        var_set("i", number, 0);
+        for (long j = 0; j < inner; j++)
+        {
+            char body[] = "set x $i.$j";
+            snprintf(number, sizeof(number), "%ld", j);
+            var_set("j", number, 0);
+            execute_line(body);
+        }
+    }
+    report("reparsed_text", now() - begin, allocations - before, outer * inner);
+
+    execute_line("function f { set x $1 ; }");
+    asprintf(&line, "for i in %s ; do for j in %s ; do f $i.$j ; done ; done", outer_words, inner_words);
+    before = allocations;
+    begin = now();
+    execute_line(line);
+    report("function_call", now() - begin, allocations - before, outer * inner);
+    free(line);
+
+    printf("\n  }\n}\n");
+    return 0;
+}
+
+/* Print the cost per iteration as JSON and to the terminal. */
+void report(const char * name, double seconds, unsigned long allocs, long iterations)
+{
+    printf("%s\n    \"%s\": {\"ns_per_iteration\": %.1f, \"allocations_per_iteration\": %.2f}",
+        first_result ? "" : ",", name, seconds * 1e9 / iterations, (double)allocs / iterations);
+    first_result = 0;
+    fprintf(stderr, "    %-14s %8.1f ns/iteration  %6.2f allocations/iteration\n", name,
+        seconds * 1e9 / iterations, (double)allocs / iterations);
+}
+
+/* Return the numbers from 0 to count - 1 separated by spaces. */
+char * word_list(long count)
+{
+    buffer list = {NULL, 0, 0};
+    char number[32];
+
+    for (long i = 0; i < count; i++)
+    {
+        buffer_append(&list, number, snprintf(number, sizeof(number), i ? " %ld" : "%ld", i));
+    }
+    return list.data;
+}
@@ -0,0 +1,151 @@
+/*
+    notifybench - job notification benchmarks for cShell
+
+    usage:
+
+        notifybench [jobs] [rounds] > results.json
+
+    cShell is compiled into this program as a library (CSHELL_LIBRARY), with its standard
+    error on a pseudo-terminal that a thread reads and discards as a terminal emulator
+    would.  Each round adds the given number of completed jobs (10,000 by default, one in
+    ten of them failed) to the job list and times do_job_notification() reporting them,
+    followed by notify_flush() writing the queue, with CSHELL_NOTIFY set to "all" and to
+    "summary".  For comparison the same notifications are also written with one unbuffered
+    fprintf each, as they were before they were queued.  The number of write system calls
+    is read from /proc/self/io.
+*/
+
+#define CSHELL_LIBRARY
+#include "../src/cshell.c"
+#include <pty.h>
+#include "bench.h"
+
+/* Function prototypes */
+    void add_completed_jobs(int);
+    void * drain(void *);
+    void report(const char *, double, unsigned long long, int);
+    unsigned long long write_calls(void);
+
+/* Global variables */
+    FILE * terminal = NULL;     /* the original stderr, as stderr itself is the pty */
+
+/* Main function */
+int main(int argc, char ** argv)
+{
+    int jobs = argc > 1 ? atoi(argv[1]) : 10000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    double times[3] = {0, 0, 0};
+    unsigned long long writes[3] = {0, 0, 0};
+    int master, slave;
+    pthread_t thread;
+
+    if (openpty(&master, &slave, NULL, NULL, NULL) < 0)
+    {
+        perror("openpty");
+        exit(EXIT_FAILURE);
+    }
+    pthread_create(&thread, NULL, drain, &master);
+    terminal = fdopen(dup(STDERR_FILENO), "w");
+    dup2(slave, STDERR_FILENO);
+    shell_is_interactive = 1;
+    var_init();
+
+    for (int round = 0; round < rounds; round++)
+    {
+        unsigned long long before;
+        double begin;
+
+        add_completed_jobs(jobs);
+        before = write_calls();
+        begin = now();
+        for (job * j = job_list; j; j = j->next)
+        {
+            fprintf(stderr, "%ld (%s): %s\n", (long)j->pgid, "completed", j->command);
+        }
+        times[0] += now() - begin;
+        writes[0] += write_calls() - before;
+        while (job_list)
+        {
+            free_job(job_list);
+        }
+
+        for (int mode = 1; mode <= 2; mode++)
+        {
+            var_set("CSHELL_NOTIFY", mode == 1 ? "all" : "summary", 0);
+            add_completed_jobs(jobs);
+            before = write_calls();
+            begin = now();
+            do_job_notification();
+            notify_flush();
+            times[mode] += now() - begin;
+            writes[mode] += write_calls() - before;
+        }
+    }
+
+    printf("{\n  \"jobs\": %d,\n  \"rounds\": %d,\n  \"results\": {", jobs, rounds);
+    report("fprintf_per_event", times[0] / rounds, writes[0] / rounds, jobs);
+    report("queued_all", times[1] / rounds, writes[1] / rounds, jobs);
+    report("queued_summary", times[2] / rounds, writes[2] / rounds, jobs);
+    printf("\n  }\n}\n");
+    return 0;
+}
+
+/* Add jobs whose processes have all completed to the job list, one in ten of them failed. */
+void add_completed_jobs(int count)
+{
+    char * args[] = {"true", NULL};
+
+    for (int i = 0; i < count; i++)
+    {
+        job * j = add_job(args[0]);
+
+        cmd_parser(args, j);
+        j->pgid = 100000 + i;
+        j->first_process->pid = 100000 + i;
+        j->first_process->completed = 1;
+        j->first_process->status = i % 10 ? 0 : 1 << 8;
+    }
+}
+
+/* Read and discard everything written to the pty. */
+void * drain(void * arg)
+{
+    int master = *(int *)arg;
+    char data[65536];
+
+    while (read(master, data, sizeof(data)) > 0)
+    {
+    }
+    return NULL;
+}
+
+/* Print the time and write system calls taken to report the jobs, as JSON and to the terminal. */
+void report(const char * name, double seconds, unsigned long long calls, int jobs)
+{
+    printf("%s\n    \"%s\": {\"ms\": %.3f, \"ns_per_job\": %.1f, \"write_calls\": %llu}",
+        first_result ? "" : ",", name, seconds * 1e3, seconds * 1e9 / jobs, calls);
+    first_result = 0;
+    fprintf(terminal, "    %-18s %9.3fms  %8.1f ns/job  %6llu write calls\n", name,
+        seconds * 1e3, seconds * 1e9 / jobs, calls);
+}
+
+/* Return the number of write system calls this process has made. */
+unsigned long long write_calls(void)
+{
+    char data[1024];
+    char * field;
+    int fd = open("/proc/self/io", O_RDONLY);
+    ssize_t length = fd >= 0 ? read(fd, data, sizeof(data) - 1) : -1;
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (length <= 0)
+    {
+        return 0;
+    }
+    data[length] = '\0';
+    field = strstr(data, "syscw:");
+    return field ? strtoull(field + 6, NULL, 10) : 0;
+}
@@ -0,0 +1,350 @@
+/*
+    parsebench - parser and dispatch microbenchmarks and fuzz target for cShell
+
+    usage:
+
+        parsebench [commands-per-corpus] > results.json
+        parsebench --fuzz iterations [seed]
+
+    cShell is compiled into this program as a library (CSHELL_LIBRARY), so tokenize_line(),
+    cmd_parser() and run_command() are called directly without init_shell() taking over a
+    terminal.  Each corpus is generated up front and then parsed, reporting nanoseconds and
+    heap allocations per command.  In fuzz mode random command lines are parsed, both as
+    jobs and as compound commands, and the results are checked; build with -fsanitize=address to catch memory errors.
+    Defining CSHELL_LIBFUZZER instead provides a libFuzzer entry point.
+*/
+
+#define CSHELL_LIBRARY
+#include "../src/cshell.c"
+
+#include <stdint.h>
+#define BENCH_COUNT_ALLOCATIONS
+#include "bench.h"
+
+typedef struct corpus /* A generated set of command lines */
+    {
+    const char * name;
+    char ** lines;
+    size_t count;
+    } corpus;
+
+/* Function prototypes */
+    void bench_corpus(corpus *, int);
+    int check_line(const char *);
+    corpus * generate_corpus(const char *, size_t, void (*)(char *, size_t));
+    void generate_dispatch(char *, size_t);
+    void generate_fuzz(char *, size_t);
+    void generate_long_args(char *, size_t);
+    void generate_operators(char *, size_t);
+    void generate_pipeline(char *, size_t);
+    void random_word(char *, size_t *, size_t, int);
+
+/* Global variables */
+    FILE * results;
+
+#ifdef CSHELL_LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size)
+{
+    char * line = (char *)malloc(size + 1);
+    memcpy(line, data, size);
+    line[size] = '\0';
+    check_line(line);
+    free(line);
+    return 0;
+}
+#else
+int main(int argc, char ** argv)
+{
+    size_t count = 20000;
+
+    results = fdopen(dup(STDOUT_FILENO), "w");
+    if (argc > 1 && !strcmp(argv[1], "--fuzz"))
+    {
+        long iterations = argc > 2 ? atol(argv[2]) : 100000;
+        char line[8192];
+
+        srand(argc > 3 ? atoi(argv[3]) : (int)time(NULL));
+        //Syntax errors in compound commands are reported on stdout.
+        freopen("/dev/null", "w", stdout);
+        for (long i = 0; i < iterations; i++)
+        {
+            generate_fuzz(line, sizeof(line));
+            if (check_line(line) < 0)
+            {
+                fprintf(stderr, "parsebench: invariant violated by: %s\n", line);
+                return 1;
+            }
+        }
+        fprintf(stderr, "parsebench: %ld random command lines parsed\n", iterations);
+        return 0;
+    }
+    if (argc > 1)
+    {
+        count = atol(argv[1]);
+    }
+    srand(1);
+
+    //Builtins such as print write to stdout, which is kept for the results.
+    freopen("/dev/null", "w", stdout);
+
+    fprintf(results, "{\n  \"commands_per_corpus\": %zu,\n  \"results\": {", count);
+    bench_corpus(generate_corpus("pipelines", count, generate_pipeline), 0);
+    bench_corpus(generate_corpus("long_args", count / 10, generate_long_args), 0);
+    bench_corpus(generate_corpus("operators", count, generate_operators), 0);
+    bench_corpus(generate_corpus("dispatch", count, generate_dispatch), 1);
+    fprintf(results, "\n  }\n}\n");
+    fclose(results);
+    return 0;
+}
+#endif
+
+/* Parse every line of a corpus, or dispatch it through run_command() if dispatch is true. */
+void bench_corpus(corpus * c, int dispatch)
+{
+    char line[65536];
+    unsigned long before = allocations;
+    double total = 0;
+
+    for (size_t i = 0; i < c->count; i++)
+    {
+        double start;
+        char ** cmd_args;
+
+        //Tokenizing modifies the line, so work on a copy outside the timed region.
+        strcpy(line, c->lines[i]);
+        start = now();
+        cmd_args = tokenize_line(line);
+        if (dispatch)
+        {
+            run_command(cmd_args);
+        }
+        else if (cmd_args[0])
+        {
+            job * j = add_job(cmd_args[0]);
+            cmd_parser(cmd_args, j);
+            free_job(j);
+        }
+        free(cmd_args);
+        total += now() - start;
+    }
+
+    fprintf(results, "%s\n    \"%s\": {\"commands\": %zu, \"ns_per_command\": %.1f, \"allocations_per_command\": %.2f}",
+        first_result ? "" : ",", c->name, c->count, total * 1e9 / c->count,
+        (double)(allocations - before) / c->count);
+    first_result = 0;
+    fprintf(stderr, "    %-10s %9.1f ns/command  %7.2f allocations/command\n", c->name,
+        total * 1e9 / c->count, (double)(allocations - before) / c->count);
+
+    for (size_t i = 0; i < c->count; i++)
+    {
+        free(c->lines[i]);
+    }
+    free(c->lines);
+    free(c);
+}
+
+/* Parse a line and check the job it produces against the tokens it was built from, */
+/* then parse the tokens as compound commands. */
+/* Return 0 if the job is consistent, -1 otherwise. */
+int check_line(const char * text)
+{
+    char * line = strdup(text);
+    char ** cmd_args = tokenize_line(line);
+    size_t words = 0;
+    size_t pipes = 0;
+    size_t processes = 0;
+    size_t arguments = 0;
+    int result = 0;
+
+    if (cmd_args[0])
+    {
+        job * j = add_job(cmd_args[0]);
+
+        for (char ** argp = cmd_args; *argp; argp++)
+        {
+            if (!strcmp(*argp, "|"))
+            {
+                pipes++;
+            }
+            //Here-strings and here-documents become input, not arguments.
+            else if (heredoc_body(*argp))
+            {
+                continue;
+            }
+            else if (!strcmp(*argp, "<<<") && argp[1] && strcmp(argp[1], "|") && strcmp(argp[1], "&"))
+            {
+                argp++;
+            }
+            else if (strcmp(*argp, "&") || argp[1])
+            {
+                words++;
+            }
+        }
+        if (cmd_parser(cmd_args, j) >= 0)
+        {
+            for (process * p = j->first_process; p; p = p->next)
+            {
+                //The processes of process substitutions are in the job but not the pipeline.
+                if (p->consumer)
+                {
+                    continue;
+                }
+                if (!p->argv[0])
+                {
+                    result = -1;
+                }
+                for (char ** argvp = p->argv; *argvp; argvp++)
+                {
+                    arguments++;
+                }
+                processes++;
+            }
+            if (processes != pipes + 1 || arguments != words)
+            {
+                result = -1;
+            }
+        }
+        free_job(j);
+    }
+
+    //The same tokens are parsed as compound commands, which must not lose a command.
+    {
+        arena_block * arena = NULL;
+        ast_node * list;
+
+        if (ast_parse(cmd_args, &arena, &list) == 0 && cmd_args[0] && strcmp(cmd_args[0], ";") && !list)
+        {
+            result = -1;
+        }
+        arena_free(arena);
+        //The line is also parsed as a script, which gathers the bodies of here-documents.
+        arena = NULL;
+        script_parse(text, &arena, &list);
+        arena_free(arena);
+    }
+    free(cmd_args);
+    free(line);
+    return result;
+}
+
+/* Generate a corpus of count lines using a line generator. */
+corpus * generate_corpus(const char * name, size_t count, void (*generate)(char *, size_t))
+{
+    corpus * c = (corpus *)malloc(sizeof(corpus));
+    char line[65536];
+
+    c->name = name;
+    c->count = count;
+    c->lines = (char **)malloc(sizeof(char *) * count);
+    for (size_t i = 0; i < count; i++)
+    {
+        generate(line, sizeof(line));
+        c->lines[i] = strdup(line);
+    }
+    return c;
+}
+
+/* Generate a print builtin with a few arguments. */
+void generate_dispatch(char * line, size_t size)
+{
+    size_t length = 0;
+
+    strcpy(line, "print");
+    length = strlen(line);
+    for (int i = rand() % 8; i >= 0; i--)
+    {
+        line[length++] = ' ';
+        random_word(line, &length, size, 12);
+    }
+    line[length] = '\0';
+}
+
+/* Generate a random line biased towards whitespace, pipes and ampersands. */
+void generate_fuzz(char * line, size_t size)
+{
+    static const char alphabet[] = "||&&  \t\tabcxyz-_./*?$(){}<>;'\"\\\n";
+    size_t length = rand() % 64 == 0 ? (size_t)rand() % (size - 1) : (size_t)rand() % 128;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        line[i] = rand() % 16 ? alphabet[rand() % (sizeof(alphabet) - 1)] : (char)(rand() % 255 + 1);
+    }
+    line[length] = '\0';
+}
+
+/* Generate one command with hundreds of arguments. */
+void generate_long_args(char * line, size_t size)
+{
+    size_t length = 0;
+    int count = 200 + rand() % 800;
+
+    for (int i = 0; i < count && length + 64 < size; i++)
+    {
+        if (i)
+        {
+            line[length++] = ' ';
+        }
+        random_word(line, &length, size, 24);
+    }
+    line[length] = '\0';
+}
+
+/* Generate short commands separated by many pipes and ampersands, some of them malformed. */
+void generate_operators(char * line, size_t size)
+{
+    size_t length = 0;
+    int count = 1 + rand() % 32;
+
+    for (int i = 0; i < count && length + 64 < size; i++)
+    {
+        if (i)
+        {
+            strcpy(line + length, rand() % 4 ? " | " : " & ");
+            length += 3;
+        }
+        random_word(line, &length, size, 6);
+    }
+    if (rand() % 2)
+    {
+        strcpy(line + length, " &");
+        length += 2;
+    }
+    line[length] = '\0';
+}
+
+/* Generate a pipeline of 1 to 8 commands, optionally in the background. */
+void generate_pipeline(char * line, size_t size)
+{
+    size_t length = 0;
+    int commands = 1 + rand() % 8;
+
+    for (int i = 0; i < commands; i++)
+    {
+        if (i)
+        {
+            strcpy(line + length, " | ");
+            length += 3;
+        }
+        for (int words = 1 + rand() % 6; words > 0; words--)
+        {
+            random_word(line, &length, size, 20);
+            line[length++] = ' ';
+        }
+    }
+    if (rand() % 4 == 0)
+    {
+        line[length++] = '&';
+    }
+    line[length] = '\0';
+}
+
+/* Append a random word of up to max characters to a line. */
+void random_word(char * line, size_t * length, size_t size, int max)
+{
+    int count = 1 + rand() % max;
+
+    for (int i = 0; i < count && *length + 1 < size; i++)
+    {
+        line[(*length)++] = "abcdefghijklmnopqrstuvwxyz0123456789-_./"[rand() % 40];
+    }
+}
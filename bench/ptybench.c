@@ -0,0 +1,643 @@
+/*
+    ptybench - end-to-end benchmarks for cShell driven through a pseudo-terminal
+
+    usage:
+
+        ptybench path/to/cshell [iterations] > results.json
+
+    Each benchmark starts a fresh shell on a new pty, types commands into it exactly as a
+    user would and times how long it takes for the shell's prompt to come back.  Results
+    are written to stdout as JSON; progress and a summary are written to stderr.
+
+    The shells are started with CSHELL_RC=/dev/null so that the user's startup file does
+    not affect the results, except by the startup benchmark, which times how long a shell
+    takes to print its first prompt with a generated 10,000 line startup file.
+*/
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define MAX_OUTPUT (1 << 20)
+#define TIMEOUT 30.0
+
+typedef struct shell /* A cShell running on the master side of a pty */
+    {
+    pid_t pid;                  /* process ID of the shell */
+    int master;                 /* master side of the pty */
+    char prompt[512];           /* prompt printed by the shell */
+    char output[MAX_OUTPUT];    /* output since the last call to shell_send */
+    size_t length;              /* number of bytes in output */
+    } shell;
+
+typedef struct benchmark /* A named benchmark case */
+    {
+    const char * name;
+    void (*run)(const char *);
+    } benchmark;
+
+/* Function prototypes */
+    void bench_background_reap(const char *);
+    void bench_job_switch(const char *);
+    void bench_joblog(const char *);
+    void bench_keystroke(const char *);
+    void bench_keystroke_loaded(const char *);
+    void bench_pipeline(const char *);
+    void bench_startup(const char *);
+    void bench_true(const char *);
+    int count_matches(shell *, const char *);
+    void empty_dir(const char *);
+    long launched_pgid(shell *);
+    void report_samples(const char *, double *, int);
+    int shell_expect(shell *, const char *, int);
+    int shell_expect_tail(shell *, const char *);
+    void shell_quit(shell *);
+    void shell_send(shell *, const char *);
+    shell * shell_start(const char *);
+
+/* Global variables */
+    int iterations = 200;
+    benchmark benchmarks[] = {
+        {"keystroke_to_prompt", bench_keystroke},
+        {"keystroke_echo_loaded", bench_keystroke_loaded},
+        {"true_roundtrip", bench_true},
+        {"pipeline", bench_pipeline},
+        {"background_reap", bench_background_reap},
+        {"job_switch", bench_job_switch},
+        {"joblog", bench_joblog},
+        {"startup", bench_startup},
+    };
+
+/* Main function */
+int main(int argc, char ** argv)
+{
+    char cwd[512];
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s path/to/cshell [iterations]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (argc > 2)
+    {
+        iterations = atoi(argv[2]);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    //The shell prints $PWD in its prompt, so make sure it is accurate.
+    if (getcwd(cwd, sizeof(cwd)))
+    {
+        setenv("PWD", cwd, 1);
+    }
+    setenv("CSHELL_RC", "/dev/null", 1);
+
+    printf("{\n  \"shell\": \"%s\",\n  \"iterations\": %d,\n  \"timestamp\": %ld,\n  \"results\": {",
+        argv[1], iterations, (long)time(NULL));
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++)
+    {
+        fprintf(stderr, "ptybench: %s\n", benchmarks[i].name);
+        benchmarks[i].run(argv[1]);
+        fflush(stdout);
+    }
+    printf("\n  }\n}\n");
+    return 0;
+}
+
+/* Launch background jobs and measure how quickly the shell reaps and reports them. */
+void bench_background_reap(const char * path)
+{
+    shell * sh = shell_start(path);
+    int jobs = iterations;
+    int completed = 0;
+    double start = now();
+    double elapsed;
+
+    for (int i = 0; i < jobs; i++)
+    {
+        shell_send(sh, "true &\n");
+        shell_expect(sh, sh->prompt, 1);
+        completed += count_matches(sh, "(completed)");
+    }
+    //Completed jobs are reported as they finish, without waiting for a key.
+    if (completed < jobs)
+    {
+        int before = count_matches(sh, "(completed)");
+        shell_expect(sh, "(completed)", before + jobs - completed);
+        completed += count_matches(sh, "(completed)") - before;
+    }
+    elapsed = now() - start;
+    printf("%s\n    \"background_reap\": {\"jobs\": %d, \"completed\": %d, \"seconds\": %.6f, \"jobs_per_s\": %.1f}",
+        first_result ? "" : ",", jobs, completed, elapsed, completed / elapsed);
+    first_result = 0;
+    fprintf(stderr, "    %d background jobs reaped at %.1f jobs/s\n", completed, completed / elapsed);
+    shell_quit(sh);
+}
+
+/* Measure how long it takes to move a stopped job to the foreground, suspend it and resume it in the background. */
+void bench_job_switch(const char * path)
+{
+    shell * sh = shell_start(path);
+    int count = iterations / 4 > 0 ? iterations / 4 : 1;
+    double * rfg = (double *)malloc(sizeof(double) * count);
+    double * suspend = (double *)malloc(sizeof(double) * count);
+    double * rbg = (double *)malloc(sizeof(double) * count);
+    char line[64];
+    long pgid;
+    int n;
+
+    shell_send(sh, "sleep 1000 &\n");
+    shell_expect(sh, sh->prompt, 1);
+    pgid = launched_pgid(sh);
+
+    for (n = 0; n < count; n++)
+    {
+        double start;
+
+        //The job owns the terminal once the shell has called tcsetpgrp.
+        snprintf(line, sizeof(line), "rfg %ld\n", pgid);
+        start = now();
+        shell_send(sh, line);
+        while (tcgetpgrp(sh->master) != pgid && now() - start < TIMEOUT);
+        rfg[n] = now() - start;
+
+        start = now();
+        shell_send(sh, "\x1a");
+        if (!shell_expect(sh, sh->prompt, 1))
+        {
+            break;
+        }
+        suspend[n] = now() - start;
+
+        snprintf(line, sizeof(line), "rbg %ld\n", pgid);
+        start = now();
+        shell_send(sh, line);
+        shell_expect(sh, sh->prompt, 1);
+        rbg[n] = now() - start;
+    }
+    kill(-pgid, SIGKILL);
+    report_samples("rfg_us", rfg, n);
+    report_samples("suspend_us", suspend, n);
+    report_samples("rbg_us", rbg, n);
+    free(rfg);
+    free(suspend);
+    free(rbg);
+    shell_quit(sh);
+}
+
+/* Measure the throughput of a job writing 60MB to the terminal, which is read and */
+/* discarded here as a terminal emulator would, and of a background job writing the same */
+/* to a job log.  Both are timed by the shell with the time builtin. */
+void bench_joblog(const char * path)
+{
+    shell * sh = shell_start(path);
+    const char * command = "time seq 1 8000000";
+    const double megabytes = 62888896 / 1048576.0;
+    char line[128];
+    double tty = 0, logged = 0;
+    char * real;
+
+    snprintf(line, sizeof(line), "%s\n", command);
+    shell_send(sh, line);
+    if (shell_expect_tail(sh, "real ") && shell_expect(sh, "s  user", 1) && (real = strstr(sh->output, "real ")))
+    {
+        tty = atof(real + 5);
+    }
+
+    shell_send(sh, "set CSHELL_JOBLOG 1M\n");
+    shell_expect(sh, sh->prompt, 1);
+    snprintf(line, sizeof(line), "%s &\n", command);
+    shell_send(sh, line);
+    shell_expect(sh, sh->prompt, 1);
+    //The time report is printed at the next command after the job completes.
+    for (double start = now(); !strstr(sh->output, "s  user") && now() - start < TIMEOUT;)
+    {
+        usleep(100000);
+        shell_send(sh, "\n");
+        shell_expect(sh, sh->prompt, 1);
+    }
+    if ((real = strstr(sh->output, "real ")))
+    {
+        logged = atof(real + 5);
+    }
+
+    printf("%s\n    \"joblog\": {\"bytes\": %d, \"tty_mb_per_s\": %.1f, \"joblog_mb_per_s\": %.1f}",
+        first_result ? "" : ",", 62888896, tty > 0 ? megabytes / tty : 0, logged > 0 ? megabytes / logged : 0);
+    first_result = 0;
+    fprintf(stderr, "    %.0fMB to the terminal at %.1f MB/s, to a job log at %.1f MB/s\n", megabytes,
+        tty > 0 ? megabytes / tty : 0, logged > 0 ? megabytes / logged : 0);
+    shell_quit(sh);
+}
+
+/* Measure the time from pressing enter on an empty line to the next prompt. */
+void bench_keystroke(const char * path)
+{
+    shell * sh = shell_start(path);
+    double * samples = (double *)malloc(sizeof(double) * iterations);
+
+    for (int i = 0; i < iterations; i++)
+    {
+        double start = now();
+        shell_send(sh, "\n");
+        shell_expect(sh, sh->prompt, 1);
+        samples[i] = now() - start;
+    }
+    report_samples("keystroke_to_prompt_us", samples, iterations);
+    free(samples);
+    shell_quit(sh);
+}
+
+/* Measure the time from typing a key to the shell echoing it, with 1,000 background */
+/* jobs running.  The line is cleared with Ctrl-U every 40 keys so that it never scrolls. */
+void bench_keystroke_loaded(const char * path)
+{
+    shell * sh = shell_start(path);
+    int jobs = 1000;
+    long * pgids = (long *)malloc(sizeof(long) * jobs);
+    double * samples = (double *)malloc(sizeof(double) * iterations);
+    size_t prompt_length = strlen(sh->prompt) - strlen("\033[K");
+    char expected[sizeof(sh->prompt) + 64];
+
+    for (int i = 0; i < jobs; i++)
+    {
+        shell_send(sh, "sleep 1000 &\n");
+        shell_expect(sh, sh->prompt, 1);
+        pgids[i] = launched_pgid(sh);
+    }
+
+    memcpy(expected, sh->prompt, prompt_length);
+    for (int i = 0; i < iterations; i++)
+    {
+        char key[2] = {'a' + i % 26, '\0'};
+        double start;
+
+        if (i % 40 == 0)
+        {
+            shell_send(sh, "\025");
+            shell_expect(sh, sh->prompt, 1);
+        }
+        expected[prompt_length + i % 40] = key[0];
+        expected[prompt_length + i % 40 + 1] = '\0';
+        start = now();
+        shell_send(sh, key);
+        shell_expect(sh, expected, 1);
+        samples[i] = now() - start;
+    }
+    report_samples("keystroke_echo_1000_jobs_us", samples, iterations);
+
+    shell_send(sh, "\025");
+    for (int i = 0; i < jobs; i++)
+    {
+        kill(-pgids[i], SIGKILL);
+    }
+    free(pgids);
+    free(samples);
+    shell_quit(sh);
+}
+
+/* Measure the launch latency of pipelines of true of increasing length. */
+void bench_pipeline(const char * path)
+{
+    shell * sh = shell_start(path);
+    int count = iterations / 4 > 0 ? iterations / 4 : 1;
+    double * samples = (double *)malloc(sizeof(double) * count);
+    char line[256];
+    char name[64];
+
+    for (int length = 1; length <= 16; length *= 2)
+    {
+        line[0] = '\0';
+        for (int i = 0; i < length; i++)
+        {
+            strcat(line, i ? " | true" : "true");
+        }
+        strcat(line, "\n");
+        for (int i = 0; i < count; i++)
+        {
+            double start = now();
+            shell_send(sh, line);
+            shell_expect(sh, sh->prompt, 1);
+            samples[i] = now() - start;
+        }
+        snprintf(name, sizeof(name), "pipeline_%d_us", length);
+        report_samples(name, samples, count);
+    }
+    free(samples);
+    shell_quit(sh);
+}
+
+/* Measure the time from starting a shell to its first prompt, with no startup file and */
+/* with a 10,000 line one, both when its AST has to be parsed and cached (cold) and when */
+/* it is read from the cache (warm). */
+void bench_startup(const char * path)
+{
+    int count = iterations / 4 > 0 ? iterations / 4 : 1;
+    double * samples = (double *)malloc(sizeof(double) * count);
+    char rc_path[] = "/tmp/ptybench-rc-XXXXXX";
+    char cache_path[] = "/tmp/ptybench-cache-XXXXXX";
+    char scripts_path[64];
+    FILE * rc;
+
+    rc = fdopen(mkstemp(rc_path), "w");
+    for (int i = 0; i < 1000; i++)
+    {
+        fprintf(rc, "# settings group %d\n", i);
+        fprintf(rc, "set name_%d value_%d\n", i, i);
+        fprintf(rc, "export EXPORTED_%d $name_%d\n", i, i);
+        fprintf(rc, "function fn_%d {\n    set last $1\n", i);
+        fprintf(rc, "    for w in a b c ; do\n        set word $w\n    done\n}\n");
+        fprintf(rc, "if cd . ; then set ok_%d 1 ; fi\n\n", i);
+    }
+    fclose(rc);
+    mkdtemp(cache_path);
+    snprintf(scripts_path, sizeof(scripts_path), "%s/scripts", cache_path);
+    setenv("CSHELL_CACHE_DIR", cache_path, 1);
+
+    for (int i = 0; i < count; i++)
+    {
+        double start = now();
+        shell * sh = shell_start(path);
+        samples[i] = now() - start;
+        shell_quit(sh);
+    }
+    report_samples("startup_no_rc_us", samples, count);
+
+    setenv("CSHELL_RC", rc_path, 1);
+    for (int i = 0; i < count; i++)
+    {
+        double start;
+        shell * sh;
+
+        empty_dir(scripts_path);
+        start = now();
+        sh = shell_start(path);
+        samples[i] = now() - start;
+        shell_quit(sh);
+    }
+    report_samples("startup_rc_10k_cold_us", samples, count);
+
+    for (int i = 0; i < count; i++)
+    {
+        double start = now();
+        shell * sh = shell_start(path);
+        samples[i] = now() - start;
+        shell_quit(sh);
+    }
+    report_samples("startup_rc_10k_warm_us", samples, count);
+
+    setenv("CSHELL_RC", "/dev/null", 1);
+    unsetenv("CSHELL_CACHE_DIR");
+    empty_dir(scripts_path);
+    rmdir(scripts_path);
+    empty_dir(cache_path);
+    rmdir(cache_path);
+    unlink(rc_path);
+    free(samples);
+}
+
+/* Measure the round trip of running true in the foreground. */
+void bench_true(const char * path)
+{
+    shell * sh = shell_start(path);
+    double * samples = (double *)malloc(sizeof(double) * iterations);
+
+    for (int i = 0; i < iterations; i++)
+    {
+        double start = now();
+        shell_send(sh, "true\n");
+        shell_expect(sh, sh->prompt, 1);
+        samples[i] = now() - start;
+    }
+    report_samples("true_roundtrip_us", samples, iterations);
+    free(samples);
+    shell_quit(sh);
+}
+
+/* Return the number of times needle appears in the output since the last command. */
+int count_matches(shell * sh, const char * needle)
+{
+    int count = 0;
+
+    for (char * c = sh->output; (c = strstr(c, needle)); c += strlen(needle))
+    {
+        count++;
+    }
+    return count;
+}
+
+/* Delete the files in a directory, along with any empty directories in it. */
+void empty_dir(const char * path)
+{
+    DIR * dir = opendir(path);
+    struct dirent * entry;
+    char name[512];
+
+    while (dir && (entry = readdir(dir)))
+    {
+        if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+        {
+            snprintf(name, sizeof(name), "%s/%s", path, entry->d_name);
+            if (unlink(name) < 0)
+            {
+                rmdir(name);
+            }
+        }
+    }
+    if (dir)
+    {
+        closedir(dir);
+    }
+}
+
+/* Return the PGID of the job the last command launched, from its "(launched)" message. */
+long launched_pgid(shell * sh)
+{
+    char * launched = strstr(sh->output, " (launched)");
+    char * start = launched;
+    long pgid;
+
+    //The line may begin with the escape sequence that clears the line being edited.
+    while (start && start > sh->output && start[-1] >= '0' && start[-1] <= '9')
+    {
+        start--;
+    }
+    if (!launched || start == launched || sscanf(start, "%ld", &pgid) != 1)
+    {
+        fprintf(stderr, "ptybench: unable to find the PGID of the background job\n");
+        exit(EXIT_FAILURE);
+    }
+    return pgid;
+}
+
+/* Write the median, 99th percentile and mean of a set of samples, in microseconds. */
+void report_samples(const char * name, double * samples, int count)
+{
+    double sum = 0;
+
+    if (count == 0)
+    {
+        return;
+    }
+    qsort(samples, count, sizeof(double), compare_doubles);
+    for (int i = 0; i < count; i++)
+    {
+        sum += samples[i];
+    }
+    printf("%s\n    \"%s\": {\"samples\": %d, \"median\": %.1f, \"p99\": %.1f, \"mean\": %.1f, \"min\": %.1f}",
+        first_result ? "" : ",", name, count, samples[count / 2] * 1e6,
+        samples[(count * 99) / 100] * 1e6, sum / count * 1e6, samples[0] * 1e6);
+    first_result = 0;
+    fprintf(stderr, "    %-28s median %8.1fus  p99 %8.1fus\n", name,
+        samples[count / 2] * 1e6, samples[(count * 99) / 100] * 1e6);
+}
+
+/* Read output from the shell until needle has appeared count times since the last command. */
+/* Return 1 if it did, 0 on timeout or if the shell exited. */
+int shell_expect(shell * sh, const char * needle, int count)
+{
+    double deadline = now() + TIMEOUT;
+
+    while (count_matches(sh, needle) < count)
+    {
+        fd_set fds;
+        struct timeval tv = {0, 100000};
+        ssize_t n;
+
+        if (now() > deadline)
+        {
+            fprintf(stderr, "ptybench: timed out waiting for \"%s\"\n", needle);
+            return 0;
+        }
+        FD_ZERO(&fds);
+        FD_SET(sh->master, &fds);
+        if (select(sh->master + 1, &fds, NULL, NULL, &tv) <= 0)
+        {
+            continue;
+        }
+        n = read(sh->master, sh->output + sh->length, MAX_OUTPUT - 1 - sh->length);
+        if (n <= 0)
+        {
+            return 0;
+        }
+        sh->length += n;
+        sh->output[sh->length] = '\0';
+        if (sh->length >= MAX_OUTPUT - 1)
+        {
+            //Keep the tail so a prompt split across reads is still found.
+            memmove(sh->output, sh->output + sh->length - 4096, 4096);
+            sh->length = 4096;
+            sh->output[sh->length] = '\0';
+        }
+    }
+    return 1;
+}
+
+/* Read output from the shell until needle appears, keeping only the end of the output. */
+/* Unlike shell_expect this stays fast when the shell prints a large amount of output. */
+/* Return 1 if needle appeared, 0 on timeout or if the shell exited. */
+int shell_expect_tail(shell * sh, const char * needle)
+{
+    double deadline = now() + TIMEOUT;
+    size_t overlap = strlen(needle);
+
+    while (!strstr(sh->length > 65536 + overlap ? sh->output + sh->length - 65536 - overlap : sh->output, needle))
+    {
+        ssize_t n;
+
+        if (now() > deadline)
+        {
+            fprintf(stderr, "ptybench: timed out waiting for \"%s\"\n", needle);
+            return 0;
+        }
+        if (sh->length > MAX_OUTPUT / 2)
+        {
+            memmove(sh->output, sh->output + sh->length - overlap, overlap);
+            sh->length = overlap;
+        }
+        n = read(sh->master, sh->output + sh->length, 65536);
+        if (n <= 0)
+        {
+            return 0;
+        }
+        sh->length += n;
+        sh->output[sh->length] = '\0';
+    }
+    return 1;
+}
+
+/* Exit the shell and wait for it, reading its output until it does. */
+void shell_quit(shell * sh)
+{
+    char data[4096];
+
+    shell_send(sh, "exit\n");
+    //Jobs may still be reported, so keep reading lest the shell block writing to the pty.
+    while (waitpid(sh->pid, NULL, WNOHANG) == 0)
+    {
+        fd_set fds;
+        struct timeval tv = {0, 10000};
+
+        FD_ZERO(&fds);
+        FD_SET(sh->master, &fds);
+        if (select(sh->master + 1, &fds, NULL, NULL, &tv) > 0 && read(sh->master, data, sizeof(data)) <= 0)
+        {
+            waitpid(sh->pid, NULL, 0);
+            break;
+        }
+    }
+    close(sh->master);
+    free(sh);
+}
+
+/* Type text into the shell, discarding any output seen so far. */
+void shell_send(shell * sh, const char * text)
+{
+    sh->length = 0;
+    sh->output[0] = '\0';
+    if (write(sh->master, text, strlen(text)) < 0)
+    {
+        perror("ptybench");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Start a shell on a new pty and wait for its first prompt. */
+shell * shell_start(const char * path)
+{
+    shell * sh = (shell *)calloc(1, sizeof(shell));
+    char * cwd = getenv("PWD");
+
+    //The line editor redraws the prompt as each key is typed, so only a prompt followed
+    //directly by the clear-to-end-of-line sequence is waiting on an empty line.
+    snprintf(sh->prompt, sizeof(sh->prompt), "%s ==> \033[K", cwd ? cwd : "(null)");
+    sh->pid = forkpty(&sh->master, NULL, NULL, NULL);
+    if (sh->pid < 0)
+    {
+        perror("forkpty");
+        exit(EXIT_FAILURE);
+    }
+    if (sh->pid == 0)
+    {
+        execl(path, path, (char *)NULL);
+        perror(path);
+        _exit(EXIT_FAILURE);
+    }
+    if (!shell_expect(sh, sh->prompt, 1))
+    {
+        fprintf(stderr, "ptybench: %s did not print a prompt\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return sh;
+}
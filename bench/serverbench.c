@@ -0,0 +1,173 @@
+/*
+    serverbench - job server benchmarks for cShell
+
+    usage:
+
+        serverbench ./build/cshell [jobs] [clients] > results.json
+
+    Starts cShell as a job server on a temporary socket, connects the given number of
+    clients (4 by default) and has them submit "true", split evenly between them and with up
+    to 32 command lines outstanding per client, until the given number of jobs (10000 by
+    default) have completed.  It reports the number of jobs completed per second and the
+    median and 99th percentile time from sending a command line to receiving its exit
+    status, which includes the time spent queued for a free job slot.  For
+    comparison the same number of jobs are run by starting "/bin/sh -c true" for each one.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define MAX_CLIENTS 64
+#define WINDOW 32
+
+extern char ** environ;
+
+/* Main function */
+int main(int argc, char ** argv)
+{
+    int jobs = argc > 2 ? atoi(argv[2]) : 10000;
+    int clients = argc > 3 ? atoi(argv[3]) : 4;
+    char path[64];
+    struct sockaddr_un address;
+    struct pollfd fds[MAX_CLIENTS];
+    double * sent = NULL;
+    double * samples = NULL;
+    int submitted[MAX_CLIENTS] = {0};
+    int done[MAX_CLIENTS] = {0};
+    char pending[MAX_CLIENTS][256];
+    size_t pending_length[MAX_CLIENTS] = {0};
+    int completed = 0;
+    int share;
+    double start, seconds, shell_seconds;
+    pid_t server;
+
+    if (argc < 2 || clients < 1 || clients > MAX_CLIENTS)
+    {
+        fprintf(stderr, "usage: serverbench cshell [jobs] [clients]\n");
+        return 1;
+    }
+    share = jobs / clients;
+    jobs = share * clients;
+    sent = (double *)calloc(jobs, sizeof(double));
+    samples = (double *)calloc(jobs, sizeof(double));
+
+    snprintf(path, sizeof(path), "/tmp/serverbench.%d.sock", (int)getpid());
+    server = fork();
+    if (server == 0)
+    {
+        execl(argv[1], argv[1], "--server", path, (char *)NULL);
+        perror(argv[1]);
+        _exit(1);
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    for (int i = 0; i < clients; i++)
+    {
+        fds[i].fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        fds[i].events = POLLIN;
+        for (int tries = 0; connect(fds[i].fd, (struct sockaddr *)&address, sizeof(address)) < 0; tries++)
+        {
+            if (tries == 500)
+            {
+                perror("serverbench: connect");
+                kill(server, SIGTERM);
+                return 1;
+            }
+            usleep(10000);
+        }
+    }
+
+    //Each client keeps a window of command lines outstanding so the server is never idle.
+    start = now();
+    while (completed < jobs)
+    {
+        for (int i = 0; i < clients; i++)
+        {
+            while (submitted[i] < share && submitted[i] - done[i] < WINDOW)
+            {
+                sent[i * share + submitted[i]++] = now();
+                write(fds[i].fd, "true\n", 5);
+            }
+        }
+        if (poll(fds, clients, -1) < 0)
+        {
+            continue;
+        }
+        for (int i = 0; i < clients; i++)
+        {
+            ssize_t n;
+            char * line;
+            char * end;
+
+            if (!(fds[i].revents & POLLIN))
+            {
+                continue;
+            }
+            n = read(fds[i].fd, pending[i] + pending_length[i], sizeof(pending[i]) - pending_length[i] - 1);
+            if (n <= 0)
+            {
+                fprintf(stderr, "serverbench: the server closed the connection\n");
+                kill(server, SIGTERM);
+                return 1;
+            }
+            pending_length[i] += n;
+            pending[i][pending_length[i]] = '\0';
+            for (line = pending[i]; (end = strchr(line, '\n')); line = end + 1)
+            {
+                unsigned long id;
+                char status[16];
+
+                *end = '\0';
+                if (sscanf(line, "%lu %15s", &id, status) == 2 && !strcmp(status, "completed"))
+                {
+                    samples[completed++] = now() - sent[i * share + id - 1];
+                    done[i]++;
+                }
+            }
+            pending_length[i] -= line - pending[i];
+            memmove(pending[i], line, pending_length[i]);
+        }
+    }
+    seconds = now() - start;
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    qsort(samples, jobs, sizeof(double), compare_doubles);
+
+    start = now();
+    for (int i = 0; i < jobs; i++)
+    {
+        char * shell_argv[] = {"/bin/sh", "-c", "true", NULL};
+        pid_t pid;
+
+        if (posix_spawn(&pid, "/bin/sh", NULL, NULL, shell_argv, environ) == 0)
+        {
+            waitpid(pid, NULL, 0);
+        }
+    }
+    shell_seconds = now() - start;
+
+    fprintf(stderr, "    job server  %8.1f jobs/s  median %8.1fus  p99 %8.1fus\n", jobs / seconds,
+        samples[jobs / 2] * 1e6, samples[(jobs * 99) / 100] * 1e6);
+    fprintf(stderr, "    sh -c       %8.1f jobs/s\n", jobs / shell_seconds);
+    printf("{\n  \"jobs\": %d,\n  \"clients\": %d,\n  \"results\": {\n"
+        "    \"server\": {\"jobs_per_s\": %.1f, \"median_us\": %.1f, \"p99_us\": %.1f},\n"
+        "    \"sh_c\": {\"jobs_per_s\": %.1f}\n  }\n}\n",
+        jobs, clients, jobs / seconds, samples[jobs / 2] * 1e6, samples[(jobs * 99) / 100] * 1e6,
+        jobs / shell_seconds);
+    return 0;
+}
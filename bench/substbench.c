@@ -0,0 +1,53 @@
+/*
+    substbench - command substitution benchmarks for cShell
+
+    usage:
+
+        substbench [substitutions] [megabytes] > results.json
+
+    cShell is compiled into this program as a library (CSHELL_LIBRARY) and capture_output(),
+    the function behind $(...), is called directly.  The first benchmark measures how many
+    substitutions of "true" can be run per second; the second measures the throughput of
+    capturing a large amount of output into memory.
+*/
+
+#define CSHELL_LIBRARY
+#include "../src/cshell.c"
+#include "bench.h"
+
+/* Main function */
+int main(int argc, char ** argv)
+{
+    int substitutions = argc > 1 ? atoi(argv[1]) : 2000;
+    long megabytes = argc > 2 ? atol(argv[2]) : 100;
+    char command[128];
+    buffer output = {NULL, 0, 0};
+    double start, rate, seconds;
+
+    start = now();
+    for (int i = 0; i < substitutions; i++)
+    {
+        output.length = 0;
+        capture_output("true", &output);
+    }
+    rate = substitutions / (now() - start);
+    fprintf(stderr, "    %d substitutions of true at %.1f/s\n", substitutions, rate);
+
+    snprintf(command, sizeof(command), "head -c %ld /dev/zero", megabytes << 20);
+    output.length = 0;
+    start = now();
+    capture_output(command, &output);
+    seconds = now() - start;
+    if (output.length != (size_t)(megabytes << 20))
+    {
+        fprintf(stderr, "substbench: captured %zu bytes, expected %ld\n", output.length, megabytes << 20);
+        return 1;
+    }
+    fprintf(stderr, "    captured %ldMB in %.3fs (%.1f MB/s)\n", megabytes, seconds, megabytes / seconds);
+
+    printf("{\n  \"results\": {\n    \"substitutions\": {\"count\": %d, \"per_second\": %.1f},\n"
+        "    \"capture\": {\"megabytes\": %ld, \"seconds\": %.6f, \"megabytes_per_s\": %.1f}\n  }\n}\n",
+        substitutions, rate, megabytes, seconds, megabytes / seconds);
+    free(output.data);
+    return 0;
+}
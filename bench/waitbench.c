@@ -0,0 +1,161 @@
+/*
+    waitbench - wait builtin benchmarks for cShell
+
+    usage:
+
+        waitbench [jobs] [rounds] > results.json
+
+    cShell is compiled into this program as a library (CSHELL_LIBRARY).  Each round forks the
+    given number of background jobs (1000 by default), each a process in its own process
+    group blocked reading a pipe, and adds them to the shell's job list.  Closing the pipe
+    makes every job exit at once, and the time until the shell has reaped them all is
+    measured, once with the wait builtin, which polls a pidfd for each process, and once by
+    calling wait_for_job() on each job in turn, as waiting on a job did before.  The latency
+    of "wait -n" is measured by killing one job while the rest keep running, and the CPU
+    time used by "wait -t 1" while none of the jobs finish shows that waiting does not spin.
+*/
+
+#define CSHELL_LIBRARY
+#include "../src/cshell.c"
+#include "bench.h"
+
+/* Function prototypes */
+    double cpu_time(void);
+    void report(const char *, double *, int);
+    job ** start_jobs(int, int *);
+
+/* Global variables */
+    FILE * terminal = NULL;     /* the original stderr, as stderr itself is sent to /dev/null */
+
+/* Main function */
+int main(int argc, char ** argv)
+{
+    int jobs = argc > 1 ? atoi(argv[1]) : 1000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    double * pidfd_all = (double *)malloc(sizeof(double) * rounds);
+    double * waitpid_all = (double *)malloc(sizeof(double) * rounds);
+    double * pidfd_any = (double *)malloc(sizeof(double) * rounds);
+    double * idle_cpu = (double *)malloc(sizeof(double) * rounds);
+    char * wait_all[] = {"wait", NULL};
+    char * wait_any[] = {"wait", "-n", NULL};
+    char * wait_idle[] = {"wait", "-t", "1", NULL};
+    int null_fd = open("/dev/null", O_WRONLY);
+    struct rlimit rl;
+
+    //Every process waited for holds a pidfd open.
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    //Killed jobs are reported on stderr.
+    terminal = fdopen(dup(STDERR_FILENO), "w");
+    dup2(null_fd, STDERR_FILENO);
+
+    for (int round = 0; round < rounds; round++)
+    {
+        int release;
+        job ** list;
+        double begin;
+
+        list = start_jobs(jobs, &release);
+        begin = now();
+        close(release);
+        wait_func(wait_all);
+        pidfd_all[round] = now() - begin;
+        for (int i = 0; i < jobs; i++)
+        {
+            free_job(list[i]);
+        }
+        free(list);
+
+        list = start_jobs(jobs, &release);
+        begin = now();
+        close(release);
+        for (int i = 0; i < jobs; i++)
+        {
+            wait_for_job(list[i]);
+        }
+        waitpid_all[round] = now() - begin;
+        for (int i = 0; i < jobs; i++)
+        {
+            free_job(list[i]);
+        }
+        free(list);
+
+        list = start_jobs(jobs, &release);
+        begin = cpu_time();
+        wait_func(wait_idle);
+        idle_cpu[round] = cpu_time() - begin;
+        begin = now();
+        kill(list[jobs / 2]->first_process->pid, SIGKILL);
+        wait_func(wait_any);
+        pidfd_any[round] = now() - begin;
+        close(release);
+        wait_func(wait_all);
+        for (int i = 0; i < jobs; i++)
+        {
+            free_job(list[i]);
+        }
+        free(list);
+    }
+
+    printf("{\n  \"jobs\": %d,\n  \"rounds\": %d,\n  \"results\": {", jobs, rounds);
+    report("wait_all_pidfd", pidfd_all, rounds);
+    report("wait_all_waitpid", waitpid_all, rounds);
+    report("wait_n_one_of_all", pidfd_any, rounds);
+    report("wait_idle_1s_cpu", idle_cpu, rounds);
+    printf("\n  }\n}\n");
+    return 0;
+}
+
+/* Return the CPU time used by this process in seconds. */
+double cpu_time(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* Print the median and maximum of the samples in milliseconds, as JSON and to the terminal. */
+void report(const char * name, double * samples, int count)
+{
+    qsort(samples, count, sizeof(double), compare_doubles);
+    printf("%s\n    \"%s_ms\": {\"median\": %.3f, \"max\": %.3f}", first_result ? "" : ",",
+        name, samples[count / 2] * 1e3, samples[count - 1] * 1e3);
+    first_result = 0;
+    fprintf(terminal, "    %-20s median %9.3fms  max %9.3fms\n", name,
+        samples[count / 2] * 1e3, samples[count - 1] * 1e3);
+}
+
+/* Fork the given number of jobs, each blocked reading a pipe until the write end whose */
+/* descriptor is stored in release is closed, and add them to the job list. */
+job ** start_jobs(int count, int * release)
+{
+    job ** list = (job **)malloc(sizeof(job *) * count);
+    char * args[] = {"child", NULL};
+    int fds[2];
+
+    pipe(fds);
+    for (int i = 0; i < count; i++)
+    {
+        job * j = add_job(args[0]);
+        pid_t pid;
+
+        cmd_parser(args, j);
+        pid = fork();
+        if (pid == 0)
+        {
+            char c;
+            close(fds[1]);
+            read(fds[0], &c, 1);
+            _exit(0);
+        }
+        setpgid(pid, pid);
+        j->pgid = pid;
+        j->first_process->pid = pid;
+        clock_gettime(CLOCK_MONOTONIC, &j->first_process->start);
+        list[i] = j;
+    }
+    close(fds[0]);
+    *release = fds[1];
+    return list;
+}
@@ -0,0 +1,95 @@
+/*
+    zygotebench - job launch latency benchmarks for cShell
+
+    usage:
+
+        zygotebench [launches] [megabytes] > results.json
+
+    cShell is compiled into this program as a library (CSHELL_LIBRARY) and launch_job(),
+    the function behind every external command, is called directly to run "true" and wait
+    for it.  Each launch is timed once with the shell forking the process itself and once
+    through the zygote, first with a small heap and then after a heap of the given size
+    (1024MB by default, as left behind by loading a large history) has been allocated and
+    touched.  The zygote is started before the heap grows, as init_shell() does.
+*/
+
+#define CSHELL_LIBRARY
+#include "../src/cshell.c"
+#include "bench.h"
+
+/* Function prototypes */
+    void time_launch(const char *, int, long);
+
+/* Global variables */
+    int zygote_saved_fd = -1;
+
+/* Main function */
+int main(int argc, char ** argv)
+{
+    int launches = argc > 1 ? atoi(argv[1]) : 500;
+    long megabytes = argc > 2 ? atol(argv[2]) : 1024;
+    char * heap;
+
+    //A shell that is not interactive waits for the process group named by its own pid.
+    setpgid(0, 0);
+    zygote_start();
+    zygote_saved_fd = zygote_fd;
+    if (zygote_fd < 0)
+    {
+        return 1;
+    }
+
+    printf("{\n  \"launches\": %d,\n  \"heap_megabytes\": %ld,\n  \"results\": {", launches, megabytes);
+    time_launch("fork_small_heap", 0, launches);
+    time_launch("zygote_small_heap", 1, launches);
+
+    heap = (char *)malloc(megabytes << 20);
+    if (!heap)
+    {
+        perror("zygotebench");
+        return 1;
+    }
+    //Keep the heap in small pages, like a heap built from many small allocations.
+    madvise(heap, megabytes << 20, MADV_NOHUGEPAGE);
+    memset(heap, 1, megabytes << 20);
+    time_launch("fork_large_heap", 0, launches);
+    time_launch("zygote_large_heap", 1, launches);
+    printf("\n  }\n}\n");
+
+    free(heap);
+    return 0;
+}
+
+/* Time launching "true" and waiting for it, with or without the zygote. */
+void time_launch(const char * name, int zygote, long launches)
+{
+    double * samples = (double *)malloc(sizeof(double) * launches);
+    char * args[] = {"true", NULL};
+    int saved_stderr = dup(STDERR_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    //launch_job() reports each job on stderr when the shell is not interactive.
+    zygote_fd = zygote ? zygote_saved_fd : -1;
+    dup2(null_fd, STDERR_FILENO);
+    for (long i = 0; i < launches; i++)
+    {
+        job * j = add_job(args[0]);
+        double begin = now();
+
+        cmd_parser(args, j);
+        launch_job(j, 1);
+        samples[i] = now() - begin;
+        free_job(j);
+    }
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stderr);
+    close(null_fd);
+    qsort(samples, launches, sizeof(double), compare_doubles);
+
+    printf("%s\n    \"%s\": {\"median_us\": %.1f, \"p99_us\": %.1f}",
+        first_result ? "" : ",", name, samples[launches / 2] * 1e6, samples[(launches * 99) / 100] * 1e6);
+    first_result = 0;
+    fprintf(stderr, "    %-18s median %9.1fus  p99 %9.1fus\n", name,
+        samples[launches / 2] * 1e6, samples[(launches * 99) / 100] * 1e6);
+    free(samples);
+}
@@ -4,23 +4,49 @@
     usage:
 
         chsell
+        cshell script [args]
+        cshell --server socket
 
         internal commands:
+        cache - Replays the output of a command that has not changed since it last ran.
+
         cd - Change the current working directory
 
         envset - Sets or create the specified environment variable.
  
         envunset - Clears the specified environment variable.
  
+        export - Marks a shell variable as an environment variable.
+ 
         exit - Exits cShell.
  
+        joblog - Shows or follows the logged output of a background job.
+ 
+        jobs - Lists active jobs.
+ 
+        limit - Runs a command with resource limits applied.
+ 
         pause - Pauses operation of cSHell.
  
         print - Prints specified text.
  
+        profile - Reports the cost of external commands by name.
+ 
         rbg - Attempts to move a job to the background and resume it.
  
         rfg - Attempts to move a job to the foreground and resume it.
+ 
+        set - Sets a shell variable, or lists all variables.
+ 
+        time - Runs a command and reports its resource usage.
+ 
+        timeout - Runs a command and terminates it if it runs for too long.
+ 
+        trace - Records job control events and exports them as a Chrome trace.
+ 
+        source - Runs a script in the current shell.
+ 
+        wait - Waits for background jobs to finish.
 
 */
 /*** END OF SECTION MARKER ***/
@@ -29,9 +55,34 @@
 
     ** Revision history **
  
-    Current version: 2.0
-    Date: 2 April 2016
+    Current version: 2.25
+    Date: 19 October 2026
 
+    2.25: Job notifications are queued and written in batches, with CSHELL_NOTIFY levels.
+    2.24: Background jobs are reported as soon as they finish, above the line being edited.
+    2.23: Added here-documents and here-strings, read from pipes or sealed memfds.
+    2.22: Added process substitution, <(command) and >(command).
+    2.21: Added scripts, ~/.cshellrc, the source builtin and the script AST cache.
+    2.20: Added ";", for, while, until, if and functions, run from a parsed AST.
+    2.19: Added the wait builtin, which waits for jobs through pidfds.
+    2.18: Added per-job timeouts (timeout builtin) and CSHELL_DEADLINE_WARN.
+    2.17: Added background job output logs, CSHELL_JOBLOG and the joblog builtin.
+    2.16: Added the GNU make jobserver, CSHELL_JOBSERVER.
+    2.15: Added the job server mode, cshell --server.
+    2.14: Added the optional zygote process that launches jobs.
+    2.13: Added the cache builtin and $?.
+    2.12: Added glob expansion of *, ?, [...] and ** in arguments.
+    2.11: Added tab completion of commands and file names.
+    2.10: Added the line editor and persistent history with indexed reverse search.
+    2.9: Added the hashed variable store, $VAR expansion and the set and export builtins.
+    2.8: Added $(...) command substitution.
+    2.7: Split command execution out of main(), removed fixed-size argument buffers and added the parser benchmark.
+    2.6: Added the Makefile and pty benchmark suite, fixed rbg/rfg PGID parsing and starting as a session leader.
+    2.5: Added the trace builtin.
+    2.4: Added the profile builtin.
+    2.3: Added live /proc telemetry for running processes to jobs -v.
+    2.2: Added per-process resource usage accounting, the time builtin and CSHELL_REPORT_TIME.
+    2.1: Added per-job resource limits (limit builtin) and the jobs builtin.
     2.0: Finished final implementation.
     1.1: Fixed apostrophe issue, amended address, added section markers for function prototypes
     1.0: Original version
@@ -60,15 +111,34 @@
  ***********************************************************************************************************************/
 
 /*** DO NOT CHANGE OR REMOVE ANY LINES ***/
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 /*** DO NOT CHANGE OR REMOVE ANY LINES ***/
@@ -76,8 +146,54 @@
 #define MAX_ARGS 64
 #define MAX_BUFFER_SIZE 1024
 #define MAX_PATH 255
+#define NUM_JOB_LIMITS 4
+#define PROFILE_BUCKETS 320
+#define TRACE_EVENTS 65536
+#define KEY_UP 256
+#define KEY_DOWN 257
+#define KEY_RIGHT 258
+#define KEY_LEFT 259
+#define KEY_HOME 260
+#define KEY_END 261
+#define KEY_DELETE 262
+#define MAX_PATH_DIRS 63
+#define DIR_CACHE_MAX 64
+#define COMPLETION_LIST_MAX 100
+#define HISTORY_INDEX_BATCH 1024
+#define GLOB_THREADS_MAX 8
+#define JOB_LOG_KEEP 16
+#define EVENT_INPUT 1
+#define EVENT_CHILD 2
+#define EVENT_OUTPUT 4
+#define EVENT_TIMER 8
+#define DEFAULT_TIMEOUT_GRACE 5.0
+#define ARENA_BLOCK_SIZE 4096
+#define FUNCTION_DEPTH_MAX 1000
+#define AST_COMMAND 1
+#define AST_FOR 2
+#define AST_WHILE 3
+#define AST_UNTIL 4
+#define AST_IF 5
+#define AST_FUNCTION 6
+#define AST_BREAK 7
+#define AST_CONTINUE 8
+#define AST_RETURN 9
+#define AST_CACHE_MAGIC "cshast01"
+#define HEREDOC_MARK '\x1f'
+#define HEREDOC_FILES 8
+#define NOTIFY_NONE 0
+#define NOTIFY_FAILURES 1
+#define NOTIFY_SUMMARY 2
+#define NOTIFY_ALL 3
 
 /* Custom data types */ /*** DO NOT CHANGE OR REMOVE ANY LINES ***/
+typedef struct buffer  /* Growable byte buffer */
+    {
+    char * data;                /* contents, always NUL terminated once allocated */
+    size_t length;              /* number of bytes used */
+    size_t size;                /* number of bytes allocated */
+    } buffer;
+
 typedef struct process /* Process control block */
     {
     struct process * next;      /* next process in pipeline */
@@ -86,6 +202,27 @@ typedef struct process /* Process control block */
     char completed;             /* true if process has completed */
     char stopped;               /* true if process has stopped */
     int status;                 /* reported status value */
+    struct job * job;           /* job this process belongs to */
+    struct timespec start;      /* time the process was forked */
+    struct timespec end;        /* time the process was reaped */
+    struct rusage usage;        /* resource usage reported by wait4 */
+    int stat_fd, io_fd;         /* cached /proc/<pid>/stat and io descriptors */
+    unsigned long long ticks;   /* CPU ticks at the last telemetry sample */
+    struct timespec sampled;    /* time of the last telemetry sample */
+    double cpu;                 /* CPU percentage since the last sample */
+    long rss;                   /* resident set size in KB */
+    long threads;               /* number of threads */
+    unsigned long long rchar, wchar; /* bytes read and written */
+    char piped;                 /* true if the output goes through a pipe to the next process */
+    struct process * consumer;  /* process whose argument names the pipe of the process */
+                                /* substitution this process is part of, or NULL */
+    char substituted;           /* true if arguments name the pipes of process substitutions */
+    char deferred;              /* true if its words are only expanded when it is launched */
+    int subst_in, subst_out;    /* pipe of a process substitution read instead of standard */
+                                /* input or written instead of standard output, -1 if none */
+    int consumer_fd;            /* the consumer's end of that pipe, held until it is forked */
+    char * input;               /* here-document or here-string read as standard input, or NULL */
+    size_t input_length;        /* number of bytes in input */
     } process;
 
 typedef struct job     /* Job control block */
@@ -98,8 +235,262 @@ typedef struct job     /* Job control block */
     char notified;              /* true if user told about stopped job */
     struct termios tmodes;      /* saved terminal modes */
     int stdin, stdout, stderr;  /* standard i/o channels */
+    rlim_t limits[NUM_JOB_LIMITS]; /* resource limits applied at launch */
+    char timed;                 /* true if the time builtin was used */
+    char time_reported;         /* true if resource usage has been reported */
+    char capture;               /* true if the job's output is being captured by the shell */
+    int forward_fds[2];         /* pipes of a captured job that was stopped, whose standard */
+                                /* output and error are copied to the terminal, -1 if none */
+    struct server_client * client; /* job server client that submitted the job, or NULL */
+    unsigned long client_id;    /* number of the command line from that client */
+    int token_pipe[2];          /* pipe the first process writes its jobserver token to, -1 if none */
+    struct job_log * log;       /* log the job's output goes to instead of the terminal, or NULL */
+    double timeout;             /* seconds the job may run for, 0 if it has no timeout */
+    double grace;               /* seconds between SIGTERM and SIGKILL once the timeout expires */
+    int timer_fd;               /* timerfd armed with the job's deadline, -1 if none */
+    char timed_out;             /* 1 once SIGTERM has been sent for the timeout, 2 once SIGKILL has */
     } job;
 
+typedef struct profile_entry /* Aggregated cost of an external command */
+    {
+    char * name;                /* argv[0] of the command, NULL if the slot is free */
+    unsigned long count;        /* number of processes reaped */
+    double wall;                /* total wall clock time in seconds */
+    double cpu;                 /* total user and system CPU time in seconds */
+    long peak_rss;              /* largest resident set size in KB */
+    unsigned int buckets[PROFILE_BUCKETS]; /* histogram of wall clock times */
+    } profile_entry;
+
+enum trace_type /* Job control events recorded by the trace builtin */
+    {
+    TRACE_PARSE_BEGIN, TRACE_PARSE_END, TRACE_FORK, TRACE_EXEC, TRACE_SETPGID,
+    TRACE_TCSETPGRP, TRACE_STOP, TRACE_CONTINUE, TRACE_REAP
+    };
+
+typedef struct trace_event /* Entry in the trace ring buffer */
+    {
+    unsigned long long ns;      /* CLOCK_MONOTONIC timestamp in nanoseconds */
+    int type;                   /* one of enum trace_type */
+    pid_t pid;                  /* process the event applies to */
+    pid_t pgid;                 /* process group the event applies to */
+    } trace_event;
+
+typedef struct trace_ring /* Trace ring buffer, shared with children so they can record exec */
+    {
+    unsigned long long next;    /* total number of events ever recorded */
+    trace_event events[TRACE_EVENTS];
+    } trace_ring;
+
+typedef struct variable /* Shell variable, chained in a hash bucket */
+    {
+    struct variable * next;     /* next variable in the same bucket */
+    char * name;                /* variable name */
+    char * value;               /* variable value */
+    char exported;              /* true if passed to the environment of commands */
+    } variable;
+
+typedef struct history_entry /* Command in the history file */
+    {
+    unsigned long long offset;  /* offset of the command in the file */
+    unsigned int length;        /* length of the command, excluding the newline */
+    } history_entry;
+
+typedef struct trigram_list /* Posting list of the history entries containing a trigram */
+    {
+    unsigned int key;           /* the three bytes of the trigram plus one, 0 if the slot is free */
+    unsigned int count;         /* number of entries in ids */
+    unsigned int size;          /* number of entries allocated in ids */
+    unsigned int * ids;         /* history entries containing the trigram, in ascending order */
+    } trigram_list;
+
+typedef struct line_editor /* State of the interactive line editor */
+    {
+    buffer line;                /* line being edited */
+    size_t cursor;              /* offset of the cursor in line */
+    const char * prompt;        /* prompt shown before the line */
+    size_t history_index;       /* history entry being shown, history_count for the new line */
+    int searching;              /* true during reverse search */
+    buffer query;               /* reverse search query */
+    long match;                 /* history entry matching the query, -1 if none */
+    int tabs;                   /* number of consecutive presses of Tab */
+    int active;                 /* true while read_line is waiting for keys */
+    int interrupted;            /* true once a message has been printed over the line */
+    } line_editor;
+
+typedef struct linux_dirent64 /* Directory entry returned by getdents64 */
+    {
+    unsigned long long d_ino;   /* inode number */
+    long long d_off;            /* offset of the next entry */
+    unsigned short d_reclen;    /* length of this entry */
+    unsigned char d_type;       /* file type, DT_UNKNOWN if the file system does not say */
+    char d_name[];              /* file name */
+    } linux_dirent64;
+
+typedef struct dir_cache /* Cached listing of a directory, in sorted order */
+    {
+    char * path;                /* absolute path of the directory */
+    int watch;                  /* inotify watch descriptor, -1 if not watched */
+    int valid;                  /* false once the directory has changed */
+    buffer names;               /* entries, each stored as its type byte followed by its name */
+    unsigned int * entries;     /* offsets of the names in names, sorted by name */
+    size_t count;               /* number of entries */
+    size_t size;                /* number of entries allocated in entries */
+    struct dir_cache * next;    /* next directory, least recently used last */
+    } dir_cache;
+
+typedef struct cache_object /* Stored output considered for eviction */
+    {
+    struct timespec used;       /* when the output was last stored or replayed */
+    off_t size;                 /* size of the output file */
+    char name[40];              /* name of the output file */
+    } cache_object;
+
+typedef struct glob_dir /* Directory waiting to be matched against a pattern component */
+    {
+    char * path;                /* path of the directory with a trailing slash, "" for the current directory */
+    int component;              /* index of the pattern component to match in it */
+    } glob_dir;
+
+typedef struct glob_walk /* State shared by the threads expanding a glob pattern */
+    {
+    char ** components;         /* pattern split at slashes */
+    int count;                  /* number of components */
+    int dirs_only;              /* true if the pattern ends with a slash */
+    glob_dir * queue;           /* directories waiting to be read */
+    size_t queued;              /* number of entries in queue */
+    size_t queue_size;          /* number of entries allocated in queue */
+    int active;                 /* number of threads reading a directory */
+    char ** matches;            /* matching paths */
+    size_t match_count;         /* number of entries in matches */
+    size_t match_size;          /* number of entries allocated in matches */
+    pthread_mutex_t lock;       /* protects the queue and matches */
+    pthread_cond_t ready;       /* signalled when the queue grows or the walk finishes */
+    } glob_walk;
+
+typedef struct zygote_request /* Request to the zygote to launch a process */
+    {
+    pid_t pgid;                 /* process group to join, 0 for a new one */
+    int foreground;             /* true if the process group is given the terminal */
+    rlim_t limits[NUM_JOB_LIMITS]; /* resource limits of the job */
+    unsigned int argc;          /* number of arguments */
+    unsigned int envc;          /* number of environment strings */
+    size_t length;              /* length of the arguments, environment and PATH that follow */
+    } zygote_request;
+
+typedef struct zygote_reply /* Result of a launch request */
+    {
+    pid_t pid;                  /* process ID of the new process, -1 on failure */
+    int error;                  /* errno if the launch failed */
+    } zygote_reply;
+
+typedef struct job_log /* Output of a background job, kept by the shell in a ring buffer */
+    {
+    int id;                     /* number used to refer to the log as %id */
+    pid_t pgid;                 /* process group of the job */
+    char * command;             /* command line of the job */
+    int running;                /* true until the job has completed */
+    int fd;                     /* read end of the job's output pipe, -1 once every writer has closed it */
+    char * data;                /* ring buffer holding the newest output */
+    size_t size;                /* number of bytes allocated in data */
+    size_t start;               /* offset of the oldest byte in data */
+    size_t length;              /* number of bytes held in data */
+    unsigned long long total;   /* number of bytes received */
+    int spill_fd;               /* file holding the bytes that fell out of data, -1 if none */
+    char * spill_path;          /* path of the spill file */
+    struct job_log * next;      /* next older log */
+    } job_log;
+
+typedef struct server_client /* Connection from a client of the job server */
+    {
+    int fd;                     /* socket, -1 once the client has disconnected */
+    int eof;                    /* true once the client has finished sending command lines */
+    buffer input;               /* bytes received that do not yet form a whole line */
+    buffer output;              /* replies not yet written to the socket */
+    size_t written;             /* number of bytes of output already written */
+    unsigned long next_id;      /* number of the last command line received */
+    unsigned long jobs;         /* number of jobs from this client running or queued */
+    struct server_client * next;
+    } server_client;
+
+typedef struct server_request /* Command line waiting for the job server to start it */
+    {
+    server_client * client;     /* client that sent it */
+    unsigned long id;           /* number of the line from that client */
+    char * line;                /* the command line */
+    struct server_request * next;
+    } server_request;
+
+typedef struct arena_block /* Block of memory handed out by an arena, freed all at once */
+    {
+    struct arena_block * next;  /* block that was filled before this one */
+    size_t used;                /* number of bytes handed out */
+    size_t size;                /* number of bytes in data */
+    char data[];                /* the memory itself */
+    } arena_block;
+
+typedef struct ast_node /* Command in a parsed command line, allocated in an arena */
+    {
+    int type;                   /* AST_COMMAND, AST_FOR, AST_WHILE and so on */
+    struct ast_node * next;     /* next command in the list */
+    char ** words;              /* words of a command, the words a for loop iterates over or */
+                                /* the argument of break, continue or return */
+    char expand;                /* true if any of the words needs expanding */
+    char * name;                /* variable of a for loop or name of a function */
+    struct ast_node * cond;     /* condition of a while, until or if */
+    struct ast_node * body;     /* body of a loop or function, or the then branch of an if */
+    struct ast_node * orelse;   /* else branch of an if, where an elif is a nested if */
+    } ast_node;
+
+typedef struct ast_parser /* State of the parser building an AST from tokens */
+    {
+    char ** tokens;             /* tokens from tokenize_line() */
+    size_t index;               /* next token to be parsed */
+    arena_block ** arena;       /* arena the nodes are allocated in */
+    int incomplete;             /* true if the tokens ran out inside a compound command */
+    int failed;                 /* true if a syntax error has been reported */
+    } ast_parser;
+
+typedef struct shell_function /* Function defined with the function keyword */
+    {
+    char * name;                /* name the function is called by */
+    ast_node * body;            /* commands run when it is called */
+    struct shell_function * next; /* next function in the same bucket of function_table */
+    } shell_function;
+
+typedef struct ast_cache_header /* Start of a script cache file, followed by the script's AST */
+    {
+    char magic[8];              /* AST_CACHE_MAGIC */
+    unsigned int node_size;     /* sizeof(ast_node) in the shell that wrote the file */
+    unsigned int reserved;
+    unsigned long long dev, ino, size; /* device, inode and size of the script */
+    long long mtime_sec, mtime_nsec;   /* modification time of the script */
+    unsigned long long length;  /* number of bytes in the file */
+    unsigned long long root;    /* offset of the first node, 0 if the script is empty */
+    } ast_cache_header;
+
+typedef struct heredoc_file /* Sealed memfd holding the text of a here-document */
+    {
+    int fd;                     /* the memfd */
+    size_t length;              /* number of bytes in it */
+    char * map;                 /* its text, mapped read-only to compare with new text */
+    unsigned long used;         /* value of heredoc_uses when last used, 0 if the slot is free */
+    } heredoc_file;
+
+typedef struct trie_node /* Node of the trie of command names */
+    {
+    unsigned char c;            /* last character of the name */
+    int child;                  /* first child, -1 if none */
+    int sibling;                /* next sibling in character order, -1 if none */
+    unsigned long long dirs;    /* bitmask of the PATH directories holding this name, bit 63 for builtins */
+    } trie_node;
+
+typedef struct job_limit /* Resource limit understood by the limit builtin */
+    {
+    char option;                /* option letter, e.g. 'm' for -m */
+    int resource;               /* resource passed to setrlimit */
+    const char * name;          /* name used when displaying the limit */
+    } job_limit;
+
 /* Global variables */ /***DO NOT CHANGE OR REMOVE ANY LINES ***/
 int fg_flag; /* Foreground execution flag */
     pid_t shell_pgid;
@@ -107,48 +498,297 @@ int fg_flag; /* Foreground execution flag */
     int shell_terminal;
     int shell_is_interactive;
     job * job_list = NULL;
+    job_limit job_limits[NUM_JOB_LIMITS] = {
+        {'m', RLIMIT_AS, "memory"},
+        {'t', RLIMIT_CPU, "cpu"},
+        {'n', RLIMIT_NOFILE, "files"},
+        {'p', RLIMIT_NPROC, "processes"},
+    };
+    struct rusage child_usage;  /* resource usage of the last child reaped by wait4 */
+    profile_entry * profile_table = NULL; /* open addressed table keyed by command name */
+    size_t profile_size = 0;    /* number of slots in profile_table */
+    size_t profile_used = 0;    /* number of occupied slots in profile_table */
+    trace_ring * trace_buffer = NULL; /* allocated by "trace on" */
+    int trace_enabled = 0;      /* true while events are being recorded */
+    variable ** var_table = NULL; /* hash table of shell variables */
+    size_t var_buckets = 0;     /* number of buckets in var_table */
+    size_t var_count = 0;       /* number of variables in var_table */
+    char ** var_envp = NULL;    /* packed environment built from the exported variables */
+    int var_envp_dirty = 1;     /* true if var_envp is out of date */
+    int last_status = 0;        /* exit status of the last foreground command, as $? */
+    int jobserver_fds[2] = {-1, -1}; /* GNU make jobserver token pipe, -1 if there is no jobserver */
+    job_log * job_logs = NULL;  /* logs of background jobs, newest first */
+    int job_log_next_id = 1;    /* id of the next log */
+    shell_function ** function_table = NULL; /* hash table of the functions defined so far */
+    size_t function_buckets = 0; /* number of buckets in function_table */
+    size_t function_count = 0;  /* number of functions in function_table */
+    char ** positional_args = NULL; /* arguments of the running function as $0, $1 and so on, or NULL */
+    int positional_count = 0;   /* number of positional_args, including $0 */
+    int function_depth = 0;     /* number of function calls being run */
+    int ast_keep_arena = 0;     /* set when a function is defined, as it refers to the line's arena */
+    volatile sig_atomic_t ast_interrupted = 0; /* set by Ctrl-C while a compound command runs */
+    int deadline_fd = -1;       /* timerfd for CSHELL_DEADLINE_WARN, -1 until first needed */
+    heredoc_file heredoc_files[HEREDOC_FILES]; /* memfds of the longest here-documents used recently */
+    unsigned long heredoc_uses = 0; /* number of times a memfd has been used */
+    job * deadline_job = NULL;  /* foreground job deadline_fd is armed for, or NULL */
+    int zygote_fd = -1;         /* socket connected to the zygote, -1 if jobs are forked directly */
+    pid_t zygote_pid = 0;       /* process ID of the zygote */
+    int server_mode = 0;        /* true when running as a job server */
+    server_client * server_clients = NULL;  /* connected clients of the job server */
+    server_request * server_queue = NULL;   /* command lines waiting for a free job slot, oldest first */
+    server_request * server_queue_tail = NULL; /* last entry in server_queue */
+    unsigned long server_running = 0;       /* number of jobs started by the job server that are running */
+    unsigned long server_limit = 1;         /* number of jobs the job server runs at once */
+    int sigchld_pipe[2] = {-1, -1};         /* written to by the SIGCHLD handler, -1 if it is not installed */
+    volatile sig_atomic_t server_stop = 0;  /* set by SIGINT and SIGTERM to stop the job server */
+    int history_fd = -1;        /* history file, opened for appending */
+    char * history_map = NULL;  /* read-only mapping of the history file */
+    size_t history_mapped = 0;  /* number of bytes mapped */
+    size_t history_scanned = 0; /* number of bytes split into entries */
+    history_entry * history_entries = NULL; /* commands in the history file, oldest first */
+    size_t history_count = 0;   /* number of entries in history_entries */
+    size_t history_size = 0;    /* number of entries allocated in history_entries */
+    trigram_list * trigram_table = NULL; /* open addressed trigram index, built while the shell is idle */
+    size_t trigram_size = 0;    /* number of slots in trigram_table */
+    size_t trigram_used = 0;    /* number of occupied slots in trigram_table */
+    size_t history_indexed = 0; /* number of entries added to the trigram index */
+    line_editor editor;         /* the line editor */
+    buffer notify_queue = {NULL, 0, 0}; /* job notifications waiting to be written */
+    char * notify_single = NULL;    /* notification of the only job summarised so far, if just one */
+    int notify_completed = 0;   /* jobs completed since the queue was last written, with CSHELL_NOTIFY=summary */
+    int notify_failed = 0;      /* how many of them failed */
+    const char * builtin_names[] = {"cache", "cd", "envset", "envunset", "exit", "export", "joblog", "jobs", "limit",
+        "pause", "print", "profile", "rbg", "rfg", "set", "source", "time", "timeout", "trace", "wait", NULL};
+    trie_node * path_trie = NULL;   /* trie of command names, node 0 is the root */
+    size_t path_trie_used = 0;      /* number of nodes in path_trie */
+    size_t path_trie_size = 0;      /* number of nodes allocated in path_trie */
+    char * path_string = NULL;      /* value of PATH when the trie was built */
+    char * path_dirs[MAX_PATH_DIRS];                /* directories in PATH */
+    struct timespec path_mtimes[MAX_PATH_DIRS];     /* modification times of the directories when last read */
+    size_t path_dir_count = 0;      /* number of entries in path_dirs */
+    dir_cache * dir_caches = NULL;  /* cached directory listings, most recently used first */
+    int inotify_fd = -2;            /* inotify instance watching the cached directories, -2 before it is created */
+    const char ** completion_matches = NULL;    /* matches found by complete_line */
+    size_t completion_count = 0;    /* number of matches */
+    size_t completion_size = 0;     /* number of entries allocated in completion_matches */
+    buffer completion_text = {NULL, 0, 0};      /* names of matching commands */
+    char completion_suffix = ' ';   /* character to add after a single match */
+    const char * trace_names[] = {
+        "parse", "parse", "fork", "exec", "setpgid", "tcsetpgrp", "stop", "continue", "reap"
+    };
 
 /*** START OF SECTION MARKER ***/
 /***YOU MAY ADD LINES HERE BUT MAY NOT CHANGE OR REMOVE EXISTING LINES ***/
 
 /* Function prototypes*/
+    void add_argument(char ***, size_t *, size_t *, const char *);
     job * add_job(char *);
     process * add_process(job *, process *);
+    void * arena_alloc(arena_block **, size_t);
+    void arena_free(arena_block *);
+    char * arena_strdup(arena_block **, const char *);
+    int ast_at(ast_parser *, const char *);
+    int ast_at_closer(ast_parser *);
+    int ast_expect(ast_parser *, const char *);
+    int ast_load(char *, size_t, size_t, ast_node **);
+    ast_node * ast_new(ast_parser *, int);
+    int ast_parse(char **, arena_block **, ast_node **);
+    ast_node * ast_parse_command(ast_parser *);
+    ast_node * ast_parse_if(ast_parser *);
+    ast_node * ast_parse_list(ast_parser *);
+    void ast_parse_words(ast_parser *, ast_node *);
+    int ast_run(ast_node *);
+    void ast_run_command(ast_node *);
+    int ast_run_loop(ast_node *);
+    size_t ast_save(buffer *, ast_node *);
+    void ast_sigint(int);
+    void buffer_append(buffer *, const char *, size_t);
+    void buffer_reserve(buffer *, size_t);
+    char * cache_dir(void);
+    void cache_evict(const char *);
+    void cache_func(char **);
+    void cache_key(job *, buffer *);
+    int cache_object_equal(int, const char *);
+    int cache_replay(const char *, const char *, buffer *, long);
+    void cache_store(job *, const char *, const char *, buffer *);
+    void capture_drain(job *, int);
+    void capture_forward(job *, int, int);
+    int capture_output(const char *, buffer *);
+    void close_process_stats(process *);
+    int compare_cache_objects(const void *, const void *);
+    int compare_dir_entries(const void *, const void *, void *);
+    size_t complete_command(const char *, size_t);
+    size_t complete_file(const char *, size_t);
+    size_t complete_line(const char *, size_t, size_t *);
+    void completion_add(const char *);
+    void deadline_arm(job *);
+    dir_cache * dir_cache_get(const char *);
+    void dir_cache_invalidate(void);
+    int dir_cache_load(dir_cache *);
+    void dir_cache_update(dir_cache *, const char *, int);
+    void editor_complete(void);
+    void editor_insert(const char *, size_t);
+    void editor_interrupt(void);
+    void editor_refresh(void);
+    void editor_search_key(int);
+    void editor_show_history(size_t);
+    int event_wait(int, struct pollfd *, size_t, int);
     int cmd_parser(char **, job *);
     void do_job_notification(void);
+    void exec_command(char **, char **);
+    void execute_line(char *);
+    int finish_capture(job *);
     job * find_job(pid_t);
+    double elapsed(struct timespec *, struct timespec *);
+    char ** expand_words(char **);
+    int expand_word(const char *, buffer *, int *);
     void format_job_info(job *, const char *);
     void free_job(job *);
+    void free_words(char **);
+    void function_call(shell_function *, char **);
+    void function_define(const char *, ast_node *);
+    shell_function * function_find(const char *);
+    void glob_add_matches(glob_walk *, char **, size_t);
+    size_t glob_expand(const char *, char ***);
+    int glob_has_magic(const char *);
+    int glob_match(const char *, const char *);
+    void glob_push(glob_walk *, char *, int);
+    void glob_read_dir(glob_walk *, glob_dir *);
+    void * glob_worker(void *);
+    unsigned long long hash_bytes(const void *, size_t, unsigned long long);
+    unsigned long long hash_string(const char *);
+    const char * heredoc_body(const char *);
+    int heredoc_gather(const char *, buffer *, int);
+    int heredoc_open(const char *, size_t);
+    void history_add(const char *);
+    void history_index(size_t);
+    void history_init(void);
+    long history_search(const char *, size_t, long);
+    void history_sync(void);
+    trigram_list * history_trigram(unsigned int, int);
     void init_shell(int);
+    void job_timer_arm(job *);
+    void job_timer_close(job *);
+    void job_timer_expired(job *);
+    void job_timer_signal(job *, int);
+    void job_usage(job *, struct rusage *, double *);
+    void joblog_append(job_log *, const char *, size_t);
+    void joblog_close(job *);
+    void joblog_drain(job_log *);
+    job_log * joblog_find(const char *);
+    void joblog_free(job_log *);
+    void joblog_func(char **);
+    void joblog_open(job *);
+    void joblog_print(job_log *, unsigned long long);
+    void jobserver_acquire(job *);
+    void jobserver_init(void);
+    void jobserver_release(job *);
+    void jobs_func(char **);
     int job_is_stopped(job *);
     int job_is_completed(job *);
+    int job_exit_status(job *);
     void launch_job(job *, int);
     void launch_process(process *, pid_t, int, int, int, int);
+    const char * limit_reason(job *, int);
+    int limit_parser(char **, job *);
     int mark_process_status(pid_t, int);
+    void json_string(FILE *, const char *);
+    void notify_flush(void);
+    int notify_level(void);
     void pause_func(void);
+    int parse_duration(const char *, double *);
+    int parse_size(const char *, unsigned long long *);
+    int path_trie_insert(const char *, int);
+    void path_trie_refresh(void);
+    int read_key(void);
+    char * read_line(const char *);
+    int prefix_parser(char **, job *);
+    void process_expand(process *);
+    char * process_subst_expand(const char *, job *, process *, process **);
+    const char * process_subst_find(const char *);
+    unsigned int profile_bucket(double);
+    void profile_func(char **);
+    double profile_percentile(profile_entry *, double);
+    void profile_record(process *);
     void put_job_in_background(job *, int);
     void put_job_in_foreground(job *, int);
+    void report_job_time(job *);
+    void run_command(char **);
+    int sample_process(process *);
+    char * script_cache_path(struct stat *);
+    int script_cache_load(const char *, struct stat *, ast_node **, char **, size_t *);
+    void script_cache_save(const char *, struct stat *, ast_node *);
+    int script_main(int, char **);
+    int script_parse(const char *, arena_block **, ast_node **);
+    int script_run(const char *, char **);
+    void script_run_rc(void);
+    void set_job_limits(job *);
+    void server_client_close(server_client *);
+    void server_flush(server_client *);
+    void server_job_status(job *, const char *);
+    void server_read(server_client *);
+    void server_reply(server_client *, unsigned long, const char *, const char *);
+    void server_run(const char *);
+    void server_signal(int);
+    void server_start(server_client *, unsigned long, char *);
+    void server_submit(server_client *, char *);
+    void set_func(char **);
+    void sigchld_handler(int);
+    void sigchld_init(void);
+    void string_sort(char **, size_t, size_t);
+    int timeout_parser(char **, job *);
+    char ** tokenize_line(char *);
+    void trace_dump(const char *);
+    void trace_func(char **);
+    void trace_record(int, pid_t, pid_t);
     void update_status(void);
+    char ** var_environment(void);
+    variable ** var_find(const char *);
+    char * var_get(const char *);
+    void var_init(void);
+    void var_set(const char *, const char *, int);
+    int var_unset(const char *);
     void wait_for_job(job *);
+    void wait_func(char **);
+    int wait_reap(process *, int);
+    pid_t zygote_launch(process *, pid_t, int, int, int, int);
+    void zygote_loop(int);
+    void zygote_start(void);
 
 /*** END OF SECTION MARKER ***/
 
 /*** NO CHANGES ARE PERMITTED BEYOND THIS POINT EXCEPT WHERE INDICATED ***/
 
 /* Main function */
+#ifndef CSHELL_LIBRARY
     int main (int argc, char ** argv)
     {
-        char ** argp;
-        char * cmd_args[MAX_ARGS];
-        char buf[MAX_BUFFER_SIZE];
+        char * line;
+        char * shell_path;
         char * prompt = " ==> ";
 
     /*** INSERT CALL TO init_shell() HERE ***/
+        if (argc == 3 && !strcmp(argv[1], "--server"))
+        {
+            server_run(argv[2]);
+        }
+        if (argc > 1 || !isatty(STDIN_FILENO))
+        {
+            exit(script_main(argc, argv));
+        }
         init_shell(argc);
 
     /*** INSERT YOUR CODE HERE for setting SHELL environment variable ***/
-        realpath(argv[0],buf);
-        setenv("SHELL",buf,1);
+        shell_path = realpath(argv[0],NULL);
+        if (shell_path) {
+            var_set("SHELL",shell_path,1);
+            free(shell_path);
+        }
+        if (shell_is_interactive)
+        {
+            history_init();
+            script_run_rc();
+        }
 
 
     /* keep reading commands until the "exit" command or EOF is triggered */
@@ -157,136 +797,387 @@ int fg_flag; /* Foreground execution flag */
         {
         /* get command line from input */
 
-        printf("%s%s", getenv("PWD"),prompt); /*** EDIT THIS LINE ***/
+        char * prompt_line;
+        asprintf(&prompt_line, "%s%s", var_get("PWD"),prompt); /*** EDIT THIS LINE ***/
+        line = read_line(prompt_line);
+        free(prompt_line);
 
 
-        if (fgets(buf, MAX_BUFFER_SIZE, stdin))                 // get next command line from user or batchfile
+        if (line)                                               // get next command line from the line editor
         {
 
+            history_add(line);
             do_job_notification();                              // ensure zombie processes are reaped
-            /* extract tokens from command line */
+            execute_line(line);
+            free(line);
+        }
 
-            argp = cmd_args;
-            *argp++ = strtok(buf, DELIMITERS);              // fetch the first token
-            while ((*argp = strtok(NULL, DELIMITERS)))      // keep fetching tokens until reaching the NULL token
-            {
-                argp++;
+        else                            // user presses control-D or EOF has been reached
+        {
+            puts("");                   // ensure that there is a newline after shell exits
+            break;                      // break out of "while" loop to quit
+        }
+    }
+    exit(EXIT_SUCCESS);
+}
+#endif
+
+/* Check and respond to a tokenized command. */
+void run_command(char ** cmd_args)
+{
+    if (!cmd_args[0])                                   // run if and only if a command has been entered
+    {
+        return;
+    }
+
+    last_status = 0;
+
+    //Check if the directory and valid and change to it.
+    if (!strcmp(cmd_args[0], "cd"))
+    {
+        if (cmd_args[1]) {
+            if (chdir(cmd_args[1]) < 0) {
+                fprintf(stderr,"Error: Can't change directory to: %s\n",cmd_args[1]);
+            } else {
+                char * cwd = getcwd(NULL,0);
+                if (cwd) {
+                    var_set("PWD",cwd,1);
+                    free(cwd);
+                }
             }
-                if (cmd_args[0])                                // run if and only if a command has been entered
-                {
-                /* check and respond to command */
+        }
+    }
 
+    //Checks that two arguments are supplied then sets the variable.
+    else if (!strcmp(cmd_args[0], "envset"))
+    {
+       if (cmd_args[1] == NULL || cmd_args[2] == NULL) {
+          puts("Error: expected two arguments");
+        } else {
 
-                    //Check if the directory and valid and change to it.
-                    if (!strcmp(cmd_args[0], "cd"))
-                    {
-                        if (cmd_args[1]) {
-                            if (chdir(cmd_args[1]) < 0) {
-                                fprintf(stderr,"Error: Can't change directory to: %s\n",cmd_args[1]);
-                            } else {
-                                getcwd(buf,MAX_BUFFER_SIZE);
-                                setenv("PWD",buf,1);
-                            }
-                        }
-                    }
+        var_set(cmd_args[1], cmd_args[2], 1);
+        }
+    }
 
-                    //Checks that two arguments are supplied then sets the variable.
-                    else if (!strcmp(cmd_args[0], "envset"))
-                    {
-                       if (cmd_args[1] == NULL || cmd_args[2] == NULL) {
-                          puts("Error: expected two arguments");
-                        } else {
+    //Unsets the variable if it exists.
+    else if (!strcmp(cmd_args[0], "envunset"))
+    {
+        char* var = cmd_args[1] ? var_get(cmd_args[1]) : NULL;
+        if (var == NULL) {
+            puts("Variable does not exist.");
+        } else {
+        var_unset(cmd_args[1]);
+        }
+    }
+    //Exits program.
+    else if (!strcmp(cmd_args[0], "exit"))
+    {
+        exit(cmd_args[1] ? atoi(cmd_args[1]) : EXIT_SUCCESS);
+    }
 
-                        setenv(cmd_args[1], cmd_args[2], 1);
-                        }
-                    }
+    //Marks variables as exported, optionally setting their value.
+    else if (!strcmp(cmd_args[0], "export"))
+    {
+        if (cmd_args[1] == NULL) {
+            puts("Error: expected a variable name");
+        } else if (cmd_args[2]) {
+            var_set(cmd_args[1], cmd_args[2], 1);
+        } else {
+            char * value = var_get(cmd_args[1]);
+            var_set(cmd_args[1], value ? value : "", 1);
+        }
+    }
 
-                    //Unsets the variable if it exists.
-                    else if (!strcmp(cmd_args[0], "envunset"))
-                    {
-                        char* var = getenv(cmd_args[1]);
-                        if (var == NULL) {
-                            puts("Variable does not exist.");
-                        } else {
-                        unsetenv(cmd_args[1]);
-                        }
-                    }
-                    //Exits program.
-                    else if (!strcmp(cmd_args[0], "exit"))
-                    {
-                        exit(EXIT_SUCCESS); 
-                    }
+    //Shows the output of a background job.
+    else if (!strcmp(cmd_args[0], "joblog"))
+    {
+        joblog_func(cmd_args);
+    }
 
-                    //Pauses the program.
-                    else if (!strcmp(cmd_args[0], "pause"))
-                    {
-                        pause_func();
-                    }
+    //Lists active jobs.
+    else if (!strcmp(cmd_args[0], "jobs"))
+    {
+        jobs_func(cmd_args);
+    }
 
-                    //Prints the provided arguments.
-                    else if (!strcmp(cmd_args[0], "print"))
-                    {
-                    int index = 1;
-                    char line[MAX_BUFFER_SIZE] = "";
+    //Runs an external command with a time report, resource limits or a timeout applied.
+    else if (!strcmp(cmd_args[0], "time") || !strcmp(cmd_args[0], "limit") || !strcmp(cmd_args[0], "timeout"))
+    {
+        job * j = add_job(cmd_args[0]);
+        int index = prefix_parser(cmd_args, j);
+        if (index < 0) {
+            puts("Usage: time command [args]");
+            puts("       limit [-m bytes] [-t seconds] [-n files] [-p processes] command [args]");
+            puts("       timeout [-k grace] duration command [args]");
+            free_job(j);
+        } else {
+            free(j->command);
+            j->command = strdup(cmd_args[index]);
+            int foreground = cmd_parser(cmd_args + index, j);
+            if (foreground < 0) {
+                puts("Malformed command.  Check background symbols and pipes.");
+                free_job(j);
+            } else {
+                launch_job(j,foreground);
+            }
+        }
+    }
 
-                    while (cmd_args[index] != NULL) {
-                        strcat(line, cmd_args[index]);
-                        strcat(line, " ");
-                        index++;
-                    }
-                        puts(line);
-                    }
+    //Waits for background jobs to finish.
+    else if (!strcmp(cmd_args[0], "wait"))
+    {
+        wait_func(cmd_args);
+    }
 
-                    //Attempts to place a job in the background.
-                    else if (!strcmp(cmd_args[0], "rbg"))
-                    {
-                        pid_t PGID = (pid_t)cmd_args[1];
-                        job * j = find_job(PGID);
-                        if (j) {
-                            if (j->first_process->stopped == 0) {
-                                puts("Job already running.");
-                            } else {
-                            put_job_in_background(j,1);
-                            }
-                        } else {
-                            puts("Unable to find job with matching PGID.");
-                        }
-                        
-                    }
+    //Replays the output of a command if nothing it depends on has changed.
+    else if (!strcmp(cmd_args[0], "cache"))
+    {
+        cache_func(cmd_args);
+    }
 
-                    //Attempts to place job in foreground.
-                    else if (!strcmp(cmd_args[0], "rfg"))
-                    {
-                        pid_t PGID = (pid_t)cmd_args[1];
-                        job * j = find_job(PGID);
-                        if (j) {
-                            put_job_in_foreground(j,1);
-                        } else {
-                            puts("Unable to find job with matching PGID.");
-                        }
-                    }
+    //Pauses the program.
+    else if (!strcmp(cmd_args[0], "pause"))
+    {
+        pause_func();
+    }
 
-                    //Run external command.
-                    else
-                    {
-                        job * j = add_job(buf);
-                        int foreground = cmd_parser(cmd_args,j);
-                        if (foreground < 0) {
-                            puts("Malformed command.  Check background symbols and pipes.");
-                        } else {
-                        launch_job(j,foreground);
-                    }
-                }
+    //Prints the provided arguments.
+    else if (!strcmp(cmd_args[0], "print"))
+    {
+    int index = 1;
+
+    while (cmd_args[index] != NULL) {
+        fputs(cmd_args[index], stdout);
+        putchar(' ');
+        index++;
+    }
+        putchar('\n');
+    }
+
+    //Reports the cost of external commands.
+    else if (!strcmp(cmd_args[0], "profile"))
+    {
+        profile_func(cmd_args);
+    }
+
+    //Records job control events.
+    else if (!strcmp(cmd_args[0], "trace"))
+    {
+        trace_func(cmd_args);
+    }
+
+    //Runs a script in this shell, so that the variables and functions it sets remain.
+    else if (!strcmp(cmd_args[0], "source"))
+    {
+        if (cmd_args[1] == NULL) {
+            puts("Usage: source script [args]");
+            last_status = 2;
+        } else {
+            script_run(cmd_args[1], cmd_args + 1);
+        }
+    }
+
+    //Sets a shell variable that is not exported, or lists all variables.
+    else if (!strcmp(cmd_args[0], "set"))
+    {
+        set_func(cmd_args);
+    }
+
+    //Attempts to place a job in the background.
+    else if (!strcmp(cmd_args[0], "rbg"))
+    {
+        pid_t PGID = cmd_args[1] ? (pid_t)atoi(cmd_args[1]) : 0;
+        job * j = find_job(PGID);
+        if (j) {
+            if (j->first_process->stopped == 0) {
+                puts("Job already running.");
+            } else {
+            put_job_in_background(j,1);
             }
+        } else {
+            puts("Unable to find job with matching PGID.");
         }
+        
+    }
 
-        else                            // user presses control-D or EOF has been reached
+    //Attempts to place job in foreground.
+    else if (!strcmp(cmd_args[0], "rfg"))
+    {
+        pid_t PGID = cmd_args[1] ? (pid_t)atoi(cmd_args[1]) : 0;
+        job * j = find_job(PGID);
+        if (j) {
+            put_job_in_foreground(j,1);
+        } else {
+            puts("Unable to find job with matching PGID.");
+        }
+    }
+
+    //Run external command.
+    else
+    {
+        job * j = add_job(cmd_args[0]);
+        int foreground = cmd_parser(cmd_args,j);
+        if (foreground < 0) {
+            puts("Malformed command.  Check background symbols and pipes.");
+            free_job(j);
+        } else {
+        launch_job(j,foreground);
+    }
+}
+}
+
+/* Split a command line into a NULL terminated array of tokens pointing into the line. */
+/* Delimiters and ";" inside $(...) do not split tokens.  The array grows as needed and must be */
+/* freed by the caller. */
+char ** tokenize_line(char * line)
+{
+    size_t size = 16;
+    size_t count = 0;
+    char ** cmd_args = (char **)malloc(sizeof(char *) * size);
+    char * c = line;
+
+    while (1)
+    {
+        char * token;
+        int depth = 0;
+        int quoted = 0;
+        int separator;
+
+        while (*c && strchr(DELIMITERS, *c))
         {
-            puts("");                   // ensure that there is a newline after shell exits
-            break;                      // break out of "while" loop to quit
+            c++;
+        }
+        if (!*c)
+        {
+            break;
+        }
+        token = c;
+        while (*c && (depth > 0 || quoted || (!strchr(DELIMITERS, *c) && *c != ';')))
+        {
+            //The body of a here-document is kept whole, whatever it contains.
+            if (*c == HEREDOC_MARK || quoted)
+            {
+                quoted ^= *c == HEREDOC_MARK;
+            }
+            else if ((c[0] == '$' || c[0] == '<' || c[0] == '>') && c[1] == '(')
+            {
+                depth++;
+                c++;
+            }
+            else if (depth > 0 && *c == '(')
+            {
+                depth++;
+            }
+            else if (depth > 0 && *c == ')')
+            {
+                depth--;
+            }
+            c++;
+        }
+        //";" separates commands, so it is a token of its own even without spaces around it.
+        separator = *c == ';';
+        if (*c)
+        {
+            *c++ = '\0';
+        }
+
+        if (count + 2 >= size)
+        {
+            size *= 2;
+            cmd_args = (char **)realloc(cmd_args, sizeof(char *) * size);
+        }
+        if (*token)
+        {
+            cmd_args[count++] = token;
+        }
+        if (separator)
+        {
+            cmd_args[count++] = ";";
         }
     }
-    exit(EXIT_SUCCESS);
+    cmd_args[count] = NULL;
+    return cmd_args;
+}
+
+/* Tokenize a command line, parse it into an AST and run it.  A line that ends inside a */
+/* compound command is continued on the lines that follow, and the whole construct is */
+/* parsed once however many times its commands run. */
+void execute_line(char * line)
+{
+    buffer text = {NULL, 0, 0};
+    arena_block * arena = NULL;
+    ast_node * list = NULL;
+    int result;
+
+    buffer_append(&text, line, strlen(line));
+    while (1)
+    {
+        buffer gathered = {NULL, 0, 0};
+        int heredoc = heredoc_gather(text.data, &gathered, 0);
+        char * more;
+
+        if (!heredoc)
+        {
+            char ** tokens = tokenize_line(gathered.data);
+            result = ast_parse(tokens, &arena, &list);
+            free(tokens);
+        }
+        free(gathered.data);
+        if (!heredoc && result <= 0)
+        {
+            break;
+        }
+        more = shell_is_interactive ? read_line("> ") : NULL;
+        if (!more)
+        {
+            puts(heredoc ? "Syntax error: unexpected end of input in here-document." : "Syntax error: unexpected end of input.");
+            result = -1;
+            break;
+        }
+        //Each line ends a command, unless it is part of a here-document.
+        buffer_append(&text, "\n", 1);
+        buffer_append(&text, more, strlen(more));
+        free(more);
+        arena_free(arena);
+        arena = NULL;
+    }
+    free(text.data);
+
+    if (result == 0 && list)
+    {
+        //Ctrl-C reaches the shell itself while it runs builtins, so let it stop a loop.
+        int compound = list->type != AST_COMMAND || list->next;
+        struct sigaction action, saved;
+
+        if (compound && shell_is_interactive)
+        {
+            memset(&action, 0, sizeof(action));
+            action.sa_handler = ast_sigint;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGINT, &action, &saved);
+        }
+        ast_interrupted = 0;
+        ast_run(list);
+        if (compound && shell_is_interactive)
+        {
+            sigaction(SIGINT, &saved, NULL);
+        }
+        if (ast_interrupted)
+        {
+            last_status = 128 + SIGINT;
+        }
+    }
+    if (result < 0)
+    {
+        last_status = 2;
+    }
+
+    //Functions defined by the line refer to nodes in its arena.
+    if (!ast_keep_arena)
+    {
+        arena_free(arena);
+    }
+    ast_keep_arena = 0;
 }
 
 /* Create a job and add it to the job list. Return the job */
@@ -302,9 +1193,24 @@ job * add_job(char * cmd)
     k->first_process = NULL;
     k->pgid = 0;
     k->notified = 0;
+    k->timed = 0;
+    k->time_reported = 0;
+    k->capture = 0;
+    k->forward_fds[0] = k->forward_fds[1] = -1;
+    k->client = NULL;
+    k->client_id = 0;
+    k->token_pipe[0] = k->token_pipe[1] = -1;
+    k->log = NULL;
+    k->timeout = 0;
+    k->grace = DEFAULT_TIMEOUT_GRACE;
+    k->timer_fd = -1;
+    k->timed_out = 0;
     k->stdin = STDIN_FILENO;
     k->stdout = STDOUT_FILENO;
     k->stderr = STDERR_FILENO;
+    for (int i = 0; i < NUM_JOB_LIMITS; i++) {
+        k->limits[i] = RLIM_INFINITY;
+    }
     tcgetattr(shell_terminal, &k->tmodes);
 
     //Initialise job list if it is empty.
@@ -313,7 +1219,7 @@ job * add_job(char * cmd)
         job_list->prev = NULL;
     } else {
         //Loop until we find the last item.
-        while (!j->next) {
+        while (j->next) {
             j = j->next;
         }
         j->next = k;
@@ -328,6 +1234,7 @@ process * add_process(job * j, process * p)
 {
     process * current_process = j->first_process;
 
+    p->job = j;
     //Initialise list if it is empty.
     if (j->first_process == NULL) {
         j->first_process = p;
@@ -347,20 +1254,27 @@ int cmd_parser(char ** cmd_args, job * j) /*** YOU MAY MODIFY THIS FUNCTION FOR
 {
     char ** argp = cmd_args; // Working variable for command line tokens
     char ** argvp = NULL;    // Working variable for array of program arguments for process control block */
+    process * substs = NULL; // Processes of any process substitutions in the arguments
+    int malformed = 0;
+
+    trace_record(TRACE_PARSE_BEGIN, shell_pgid, shell_pgid);
 
     //Loop through and check for malformed commands before we start adding processes.
     int index = 0;
     while(*argp) {
         //Check if pipe is at the end.
         if (!*(argp+1) && !strcmp(*argp,"|")) {
+            trace_record(TRACE_PARSE_END, shell_pgid, shell_pgid);
             return -1;
         }
         //Check if pipe is at the start.
         if (index == 0 && !strcmp(*argp,"|")) {
+            trace_record(TRACE_PARSE_END, shell_pgid, shell_pgid);
             return -1;
         }
         //Check if pipe is anywhere except the end.
         if (!strcmp(*argp,"&") && *(argp+1)) {
+            trace_record(TRACE_PARSE_END, shell_pgid, shell_pgid);
             return -1;
         }
         index++;
@@ -378,10 +1292,27 @@ int cmd_parser(char ** cmd_args, job * j) /*** YOU MAY MODIFY THIS FUNCTION FOR
         p->completed = 0;
         p->stopped = 0;
         p->status = 0;
-        p->argv = (char **)malloc(sizeof(char *)*MAX_ARGS);
+        p->stat_fd = -1;
+        p->io_fd = -1;
+        //Telemetry that cannot be sampled, such as the I/O of another user's process, reads as 0.
+        p->ticks = 0;
+        memset(&p->sampled, 0, sizeof(p->sampled));
+        p->cpu = 0;
+        p->rss = 0;
+        p->threads = 0;
+        p->rchar = p->wchar = 0;
+        p->piped = 0;
+        p->consumer = NULL;
+        p->substituted = 0;
+        p->deferred = 0;
+        p->subst_in = p->subst_out = p->consumer_fd = -1;
+        p->input = NULL;
+        p->input_length = 0;
+        size_t size = 8;
+        p->argv = (char **)malloc(sizeof(char *)*size);
         argvp = p->argv;
 
-        int index = 0;
+        size_t index = 0;
         while(*argp) {
             //Check if there is a & symbol at the end.
             if (!strcmp(*argp,"&") && *(argp+1) == NULL) {
@@ -391,22 +1322,78 @@ int cmd_parser(char ** cmd_args, job * j) /*** YOU MAY MODIFY THIS FUNCTION FOR
             }
             //Check if there is a pipe symbol.
             if (!strcmp(*argp,"|")) {
+                p->piped = 1;
                 argp++;
                 break;
             }
-            //Otherwise, add the argument to the list.
-            argvp[index] = (char*)malloc(sizeof(char*));
-            strcpy(argvp[index],*argp);
+            //Otherwise, add the argument to the list, growing it if needed.
+            if (index + 1 >= size) {
+                size *= 2;
+                argvp = p->argv = (char **)realloc(p->argv, sizeof(char *)*size);
+            }
+            //Here-strings and here-documents are given to the process as its input.
+            if (!strcmp(*argp,"<<<") || heredoc_body(*argp)) {
+                const char * body = heredoc_body(*argp);
+                free(p->input);
+                if (body) {
+                    p->input_length = strcspn(body, "\x1f");
+                    p->input = strndup(body, p->input_length);
+                    argp++;
+                } else if (argp[1] && strcmp(argp[1],"|") && strcmp(argp[1],"&")) {
+                    p->input_length = asprintf(&p->input, "%s\n", argp[1]);
+                    argp += 2;
+                } else {
+                    p->input = NULL;
+                    argvp[index] = NULL;
+                    add_process(j,p);
+                    malformed = 1;
+                    break;
+                }
+                continue;
+            }
+            //Process substitutions are replaced by the paths of their pipes.
+            if (process_subst_find(*argp)) {
+                argvp[index] = process_subst_expand(*argp, j, p, &substs);
+                p->substituted = 1;
+                if (!argvp[index]) {
+                    puts("Malformed process substitution.");
+                    add_process(j,p);
+                    malformed = 1;
+                    break;
+                }
+            } else {
+                argvp[index] = strdup(*argp);
+            }
             index++;
             argp++;
         }
+        if (malformed) {
+            break;
+        }
         //Add the PCB to the job.
         argvp[index] = NULL;
         add_process(j,p);
+
+        //Reject empty commands, e.g. two pipes in a row or a lone &.
+        if (index == 0) {
+            malformed = 1;
+            break;
+        }
     }
 
+    //The processes of process substitutions come first, as they are launched before the
+    //processes that open their pipes.  The job's exit status stays that of its last process.
+    if (substs) {
+        process * last = substs;
+        while (last->next) {
+            last = last->next;
+        }
+        last->next = j->first_process;
+        j->first_process = substs;
+    }
 
-    return fg_flag;
+    trace_record(TRACE_PARSE_END, shell_pgid, shell_pgid);
+    return malformed ? -1 : fg_flag;
 
 }
 
@@ -429,7 +1416,8 @@ void do_job_notification(void)
          completed and delete it from the list of active jobs. */
         if (job_is_completed(j))
         {
-            format_job_info(j, "completed");
+            format_job_info(j, j->timed_out ? "timed out" : "completed");
+            report_job_time(j);
             if (jlast)
             {
                 jlast->next = jnext;
@@ -476,8 +1464,69 @@ job * find_job(pid_t pgid)
 /* Format information about job status for the user to look at. */
 void format_job_info(job *j, const char *status)
 {
-    fprintf(stderr, "%ld (%s): %s\n", (long)j->pgid, status, j->command);
-}
+    int level = notify_level();
+    int completed = !strcmp(status, "completed");
+    int failed = !strcmp(status, "timed out") || (completed && job_exit_status(j) != 0);
+    char prefix[32] = "";
+    buffer text = {NULL, 0, 0};
+    char * line;
+
+    if (server_mode)
+    {
+        server_job_status(j, status);
+        return;
+    }
+    //Scripts run every job to completion, so there is nothing to tell anyone.
+    if (!shell_is_interactive)
+    {
+        return;
+    }
+    //Notifications are queued and written together when the shell next waits for something.
+    if (level == NOTIFY_NONE || (level < NOTIFY_ALL && !strcmp(status, "launched"))
+     || (level == NOTIFY_FAILURES && completed && !failed))
+    {
+        return;
+    }
+    if (j->log)
+    {
+        snprintf(prefix, sizeof(prefix), "[%%%d] ", j->log->id);
+    }
+    asprintf(&line, "%s%ld (%s): %s", prefix, (long)j->pgid, status, j->command);
+    buffer_append(&text, line, strlen(line));
+    free(line);
+    //Processes killed by a signal are noted on the job's line, so that the level applies to
+    //them and a job whose processes are all killed is still reported once.
+    for (process * p = j->first_process; p; p = p->next)
+    {
+        if (p->completed && WIFSIGNALED(p->status))
+        {
+            const char * reason = limit_reason(j, WTERMSIG(p->status));
+
+            asprintf(&line, " [%d: Terminated by signal %d.%s%s]", (int)p->pid,
+                WTERMSIG(p->status), reason ? " " : "", reason ? reason : "");
+            buffer_append(&text, line, strlen(line));
+            free(line);
+        }
+    }
+    buffer_append(&text, "\n", 1);
+    line = text.data;
+    if (level == NOTIFY_SUMMARY && completed)
+    {
+        notify_completed++;
+        notify_failed += failed;
+        free(notify_single);
+        notify_single = notify_completed == 1 ? line : NULL;
+        if (notify_single)
+        {
+            return;
+        }
+    }
+    else
+    {
+        buffer_append(&notify_queue, line, strlen(line));
+    }
+    free(line);
+}
 
 void free_job(job * j)
 {
@@ -485,6 +1534,20 @@ void free_job(job * j)
     {
         return;
     }
+    jobserver_release(j);
+    joblog_close(j);
+    job_timer_close(j);
+    for (int i = 0; i < 2; i++)
+    {
+        if (j->forward_fds[i] >= 0)
+        {
+            capture_drain(j, i);
+        }
+        if (j->forward_fds[i] >= 0)
+        {
+            close(j->forward_fds[i]);
+        }
+    }
     if (j->next)
     {
         j->next->prev = j->prev;
@@ -505,6 +1568,21 @@ void free_job(job * j)
             free(*argvp);
         }
         free(p->argv);
+        close_process_stats(p);
+        //A job that was never launched still holds the pipes of its process substitutions.
+        if (p->subst_in >= 0)
+        {
+            close(p->subst_in);
+        }
+        if (p->subst_out >= 0)
+        {
+            close(p->subst_out);
+        }
+        if (p->consumer_fd >= 0)
+        {
+            close(p->consumer_fd);
+        }
+        free(p->input);
         q = p;
         p = p->next;
         free(q);
@@ -556,8 +1634,9 @@ void init_shell(int argc)
         //signal(SIGCHLD, SIG_IGN); // ignoring SIGCHLD would cause waitpid() to misbehave
         
         /* Put ourselves in our own process group. */
+        /* A session leader (e.g. a login shell) already leads its own group and can't call setpgid. */
         shell_pgid = getpid();
-        if (setpgid(shell_pgid, shell_pgid) < 0)
+        if (getpgrp() != shell_pgid && setpgid(shell_pgid, shell_pgid) < 0)
         {
             fprintf(stderr, "FATAL: Unable to put the shell in its own process group");
             perror("cShell");
@@ -566,6 +1645,15 @@ void init_shell(int argc)
         
         /* Grab control of the terminal. */
         tcsetpgrp(shell_terminal, shell_pgid);
+
+        /* Share a token pool with make run by any job, if asked to. */
+        jobserver_init();
+
+        /* Start the zygote while the heap is still small, if asked to. */
+        if (var_get("CSHELL_ZYGOTE") && strcmp(var_get("CSHELL_ZYGOTE"), "0"))
+        {
+            zygote_start();
+        }
     }
     else
     {
@@ -613,11 +1701,51 @@ void launch_job(job * j, int foreground)
     pid_t pid;
     int mypipe[2], infile, outfile;
     
+    /* Rebuild the environment for the children if any exported variable has changed. */
+    var_environment();
+
+    /* Background jobs write to a log instead of the terminal if CSHELL_JOBLOG is set. */
+    if (!foreground && !j->capture && shell_is_interactive)
+    {
+        joblog_open(j);
+    }
+
+    /* Jobs other than command substitutions hold a jobserver token while they run. */
+    if (jobserver_fds[0] >= 0 && !j->capture)
+    {
+        pipe2(j->token_pipe, O_CLOEXEC|O_NONBLOCK);
+    }
+
     infile = j->stdin;
     for (p = j->first_process; p; p = p->next)
     {
-        /* Set up pipes, if necessary.  */
-        if (p->next)
+        /* The words of a process substitution are expanded just before it is forked. */
+        if (p->deferred)
+        {
+            process_expand(p);
+        }
+
+        /* Set up pipes, if necessary.  The processes of a process substitution read or */
+        /* write its pipe at one end of their pipeline instead. */
+        if (p->subst_in >= 0)
+        {
+            infile = p->subst_in;
+        }
+        /* A here-document or here-string replaces the input from the pipeline. */
+        if (p->input)
+        {
+            if (infile != j->stdin)
+            {
+                close(infile);
+            }
+            infile = heredoc_open(p->input, p->input_length);
+            if (infile < 0)
+            {
+                perror("here-document");
+                infile = open("/dev/null", O_RDONLY|O_CLOEXEC);
+            }
+        }
+        if (p->piped)
         {
             if (pipe(mypipe) < 0)
             {
@@ -628,10 +1756,16 @@ void launch_job(job * j, int foreground)
             outfile = mypipe[1];
         }
         else
-            outfile = j->stdout;
+            outfile = p->subst_out >= 0 ? p->subst_out : j->stdout;
         
-        /* Fork the child processes.  */
-        pid = fork();
+        /* Fork the child processes, through the zygote if there is one.  A process that has */
+        /* to take a jobserver token is forked directly, as the zygote is not given the token */
+        /* pipe, and so is one given the pipes of process substitutions. */
+        if (zygote_fd < 0 || (p == j->first_process && j->token_pipe[1] >= 0) || p->substituted
+            || (pid = zygote_launch(p, j->pgid, infile, outfile, j->stderr, foreground)) < 0)
+        {
+            pid = fork();
+        }
         if (pid == 0)
         /* This is the child process.  */
             launch_process(p, j->pgid, infile,
@@ -647,17 +1781,25 @@ void launch_job(job * j, int foreground)
         {
             /* This is the parent process.  */
             p->pid = pid;
-            if (shell_is_interactive)
+            if (p == j->first_process && j->token_pipe[1] >= 0)
+            {
+                close(j->token_pipe[1]);
+                j->token_pipe[1] = -1;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &p->start);
+            trace_record(TRACE_FORK, pid, j->pgid ? j->pgid : pid);
+            if (shell_is_interactive || server_mode)
             {
                 if (!j->pgid)
                 {
                     j->pgid = pid;
                 }
                 setpgid(pid, j->pgid);
+                trace_record(TRACE_SETPGID, pid, j->pgid);
             }
             else
             {
-                j->pgid = getpid();
+                j->pgid = getpgrp();
             }
         }
         
@@ -670,12 +1812,43 @@ void launch_job(job * j, int foreground)
         {
             close(outfile);
         }
-        infile = mypipe[0];
+        p->subst_in = p->subst_out = -1;
+        for (process * q = j->first_process; q && p->substituted; q = q->next)
+        {
+            if (q->consumer == p && q->consumer_fd >= 0)
+            {
+                close(q->consumer_fd);
+                q->consumer_fd = -1;
+            }
+        }
+        infile = p->piped ? mypipe[0] : j->stdin;
+    }
+
+    /* Only the job's processes hold the log's pipe open, so the log sees the end of it. */
+    if (j->log)
+    {
+        j->log->pgid = j->pgid;
+        close(j->stdout);
+        close(j->stderr);
+        j->stdout = STDOUT_FILENO;
+        j->stderr = STDERR_FILENO;
+    }
+
+    /* Start the clock on the job's timeout now that its process group exists. */
+    if (j->timeout > 0)
+    {
+        job_timer_arm(j);
     }
     
+    /* The shell reads the output of captured jobs before waiting for them. */
+    if (j->capture)
+    {
+        return;
+    }
+
     format_job_info(j, "launched");
     
-    if (!shell_is_interactive)
+    if (!shell_is_interactive && !server_mode)
     {
         wait_for_job(j);
     }
@@ -695,7 +1868,7 @@ void launch_process(process *p, pid_t pgid,
 {
     pid_t pid;
     
-    if (shell_is_interactive)
+    if (shell_is_interactive || server_mode)
     {
         /* Put the process into the process group and give the process group
          the terminal, if appropriate.
@@ -707,9 +1880,11 @@ void launch_process(process *p, pid_t pgid,
             pgid = pid;
         }
         setpgid(pid, pgid);
+        trace_record(TRACE_SETPGID, pid, pgid);
         if (foreground)
         {
             tcsetpgrp(shell_terminal, pgid);
+            trace_record(TRACE_TCSETPGRP, pid, pgid);
         }
         
         /* Set the handling for job control signals back to the default.  */
@@ -720,6 +1895,24 @@ void launch_process(process *p, pid_t pgid,
         signal(SIGTTOU, SIG_DFL);
         signal(SIGCHLD, SIG_DFL);
     }
+
+    /* Wait for a jobserver token if the job needs one. */
+    if (p == p->job->first_process && p->job->token_pipe[1] >= 0)
+    {
+        jobserver_acquire(p->job);
+    }
+
+    /* Apply any resource limits requested for the job. */
+    set_job_limits(p->job);
+
+    /* Keep the pipes of the process substitutions named in argv open across exec. */
+    for (process * q = p->job->first_process; q && p->substituted; q = q->next)
+    {
+        if (q->consumer == p && q->consumer_fd >= 0)
+        {
+            fcntl(q->consumer_fd, F_SETFD, 0);
+        }
+    }
     
     /* Set the standard input/output channels of the new process. */
     if (infile != STDIN_FILENO)
@@ -738,11 +1931,12 @@ void launch_process(process *p, pid_t pgid,
         close(errfile);
     }
     
-    /* Exec the new process.  Make sure we exit. */
-    execvp(p->argv[0], p->argv);
+    /* Exec the new process.  Make sure we exit without flushing the shell's stdio buffers. */
+    trace_record(TRACE_EXEC, getpid(), pgid);
+    exec_command(p->argv, var_envp);
     fprintf(stderr, "ERROR: Unable to run external command\n");
     perror(p->argv[0]);
-    exit(EXIT_FAILURE);
+    _exit(EXIT_FAILURE);
 }
 
 /* Store the status of the process pid that was returned by waitpid.
@@ -762,19 +1956,40 @@ int mark_process_status(pid_t pid, int status)
                 {
                     p->status = status;
                     if (WIFSTOPPED(status))
+                    {
                         p->stopped = 1;
+                        trace_record(TRACE_STOP, pid, j->pgid);
+                    }
                     else
                     {
+                        trace_record(TRACE_REAP, pid, j->pgid);
                         p->completed = 1;
-                        if (WIFSIGNALED(status))
+                        if (job_is_completed(j))
+                        {
+                            jobserver_release(j);
+                            job_timer_close(j);
+                        }
+                        close_process_stats(p);
+                        p->usage = child_usage;
+                        clock_gettime(CLOCK_MONOTONIC, &p->end);
+                        profile_record(p);
+                        //At the prompt the signal is reported on the job's notification instead.
+                        if (WIFSIGNALED(status) && (!shell_is_interactive || server_mode))
+                        {
+                            const char * reason = limit_reason(j, WTERMSIG(p->status));
                             fprintf(stderr, "%d: Terminated by signal %d.\n",
                                 (int) pid, WTERMSIG (p->status));
+                            if (reason)
+                            {
+                                fprintf(stderr, "%d: %s\n", (int) pid, reason);
+                            }
+                        }
                     }
                     return 0;
                 }
 
-                fprintf(stderr, "No child process %d.\n", pid);
-                return -1;
+        fprintf(stderr, "No child process %d.\n", pid);
+        return -1;
             }
             else if (pid == 0 || errno == ECHILD)
             {
@@ -833,6 +2048,7 @@ with permission.*/
     /* Send the job a continue signal, if necessary. */
     if (cont)
     {
+        trace_record(TRACE_CONTINUE, j->pgid, j->pgid);
         if (kill(-j->pgid, SIGCONT) < 0)
         {
             perror("kill (SIGCONT)");
@@ -854,20 +2070,29 @@ with permission.*/
     }
     /* Put the job into the foreground. */
     tcsetpgrp(shell_terminal, j->pgid);
+    trace_record(TRACE_TCSETPGRP, j->pgid, j->pgid);
     /* Send the job a continue signal, if necessary. */
     if (cont)
     {
         tcsetattr(shell_terminal, TCSADRAIN, &j->tmodes);
+        trace_record(TRACE_CONTINUE, j->pgid, j->pgid);
         if (kill(-j->pgid, SIGCONT) < 0)
         {
             perror("kill (SIGCONT)");
         }
     }
-    /* Wait for it to report. */
+    /* Wait for it to report, warning if it runs past CSHELL_DEADLINE_WARN. */
+    deadline_arm(j);
     wait_for_job(j);
+    deadline_arm(NULL);
+    if (job_is_completed(j))
+    {
+        report_job_time(j);
+    }
     
     /* Put the shell back in the foreground. */
     tcsetpgrp(shell_terminal, shell_pgid);
+    trace_record(TRACE_TCSETPGRP, shell_pgid, shell_pgid);
     
     /* Restore the shell's terminal modes. */
     tcgetattr(shell_terminal, &j->tmodes);
@@ -883,7 +2108,7 @@ void update_status(void)
     
     do
     {
-        pid = waitpid(-1, &status, WUNTRACED|WNOHANG); //Had to change WAIT_ANY to -1 as it wasn't compiling on UCPU2.
+        pid = wait4(-1, &status, WUNTRACED|WNOHANG, &child_usage); //Had to change WAIT_ANY to -1 as it wasn't compiling on UCPU2.
     } while (!mark_process_status(pid, status));
 }
 
@@ -894,17 +2119,6424 @@ void wait_for_job(job * j)
     int status;
     pid_t pid;
     
+    /* With a jobserver, reap any job that finishes so that its token is returned at once. */
+    /* With the event loop running, keep draining background job logs and firing timers */
+    /* while waiting. */
+    notify_flush();
     do
     {
-        pid = waitpid(-j->pgid, &status, WUNTRACED);
+        int target = jobserver_fds[0] >= 0 ? -1 : -j->pgid;
+
+        if ((shell_is_interactive || j->timer_fd >= 0) && sigchld_pipe[0] >= 0)
+        {
+            while ((pid = wait4(target, &status, WUNTRACED|WNOHANG, &child_usage)) == 0)
+            {
+                event_wait(-1, NULL, 0, -1);
+            }
+        }
+        else
+        {
+            pid = wait4(target, &status, WUNTRACED, &child_usage);
+        }
     } while (!mark_process_status(pid, status)
      && !job_is_stopped(j)
      && !job_is_completed(j));
+    if (job_is_completed(j))
+    {
+        last_status = job_exit_status(j);
+    }
 }
 
 /*** IMPLEMENTATIONS OF ANY ADDITIONAL FUNCTIONS BELONG BELOW THIS LINE ***/
 /*** Note: You might not need to use this section. ***/
 
+/* Add a word to a growable argument array.  A word containing a glob pattern is */
+/* replaced by the paths it matches, or kept as it is if it matches nothing. */
+void add_argument(char *** args, size_t * count, size_t * size, const char * word)
+{
+    char ** matches = NULL;
+    size_t found = glob_has_magic(word) && !process_subst_find(word) && !heredoc_body(word)
+        ? glob_expand(word, &matches) : 0;
+
+    if (*count + found + 1 >= *size)
+    {
+        while (*count + found + 1 >= *size)
+        {
+            *size *= 2;
+        }
+        *args = (char **)realloc(*args, sizeof(char *) * *size);
+    }
+    if (found == 0)
+    {
+        (*args)[(*count)++] = strdup(word);
+    }
+    else
+    {
+        memcpy(*args + *count, matches, sizeof(char *) * found);
+        *count += found;
+    }
+    free(matches);
+}
+
+/* Hand out size bytes from an arena, starting a new block when the current one is full. */
+void * arena_alloc(arena_block ** arena, size_t size)
+{
+    arena_block * block = *arena;
+
+    size = (size + 7) & ~(size_t)7;
+    if (!block || block->used + size > block->size)
+    {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (arena_block *)malloc(sizeof(arena_block) + block_size);
+        block->next = *arena;
+        block->used = 0;
+        block->size = block_size;
+        *arena = block;
+    }
+    block->used += size;
+    return block->data + block->used - size;
+}
+
+/* Free every block of an arena. */
+void arena_free(arena_block * arena)
+{
+    while (arena)
+    {
+        arena_block * next = arena->next;
+        free(arena);
+        arena = next;
+    }
+}
+
+/* Copy a string into an arena. */
+char * arena_strdup(arena_block ** arena, const char * text)
+{
+    size_t length = strlen(text) + 1;
+    return (char *)memcpy(arena_alloc(arena, length), text, length);
+}
+
+/* Return true if the next token is the given word. */
+int ast_at(ast_parser * p, const char * word)
+{
+    return p->tokens[p->index] && !strcmp(p->tokens[p->index], word);
+}
+
+/* Return true if the next token is a keyword that ends a list of commands. */
+int ast_at_closer(ast_parser * p)
+{
+    return ast_at(p, "do") || ast_at(p, "done") || ast_at(p, "then") || ast_at(p, "elif")
+        || ast_at(p, "else") || ast_at(p, "fi") || ast_at(p, "}");
+}
+
+/* Consume a keyword, skipping any ";" before it.  Return 0 if it was found, or -1 after */
+/* marking the parse as incomplete if the tokens ran out, or as failed if not. */
+int ast_expect(ast_parser * p, const char * keyword)
+{
+    if (p->failed || p->incomplete)
+    {
+        return -1;
+    }
+    while (ast_at(p, ";"))
+    {
+        p->index++;
+    }
+    if (ast_at(p, keyword))
+    {
+        p->index++;
+        return 0;
+    }
+    if (!p->tokens[p->index])
+    {
+        p->incomplete = 1;
+    }
+    else
+    {
+        printf("Syntax error: expected \"%s\" before \"%s\".\n", keyword, p->tokens[p->index]);
+        p->failed = 1;
+    }
+    return -1;
+}
+
+/* Allocate a node of the given type in the parser's arena. */
+ast_node * ast_new(ast_parser * p, int type)
+{
+    ast_node * node = (ast_node *)arena_alloc(p->arena, sizeof(ast_node));
+
+    memset(node, 0, sizeof(ast_node));
+    node->type = type;
+    return node;
+}
+
+/* Parse the tokens of a command line into a list of commands allocated in an arena. */
+/* Return 0 on success, -1 after reporting a syntax error, or 1 if the tokens end inside */
+/* a compound command and the line has to be continued. */
+int ast_parse(char ** tokens, arena_block ** arena, ast_node ** list)
+{
+    ast_parser parser = {tokens, 0, arena, 0, 0};
+
+    *list = ast_parse_list(&parser);
+    if (!parser.failed && !parser.incomplete && tokens[parser.index])
+    {
+        printf("Syntax error: unexpected \"%s\".\n", tokens[parser.index]);
+        parser.failed = 1;
+    }
+    return parser.failed ? -1 : parser.incomplete;
+}
+
+/* Parse one command, which is either a simple command or starts with a keyword. */
+/* Return NULL if the parse failed or is incomplete. */
+ast_node * ast_parse_command(ast_parser * p)
+{
+    const char * word = p->tokens[p->index];
+    ast_node * node;
+
+    if (!strcmp(word, "for"))
+    {
+        node = ast_new(p, AST_FOR);
+        p->index++;
+        if (!p->tokens[p->index])
+        {
+            p->incomplete = 1;
+            return NULL;
+        }
+        node->name = arena_strdup(p->arena, p->tokens[p->index++]);
+        //Without "in", the loop runs over the function's arguments.
+        if (ast_at(p, "in"))
+        {
+            p->index++;
+            ast_parse_words(p, node);
+        }
+        if (ast_expect(p, "do") < 0)
+        {
+            return NULL;
+        }
+        node->body = ast_parse_list(p);
+        return ast_expect(p, "done") < 0 ? NULL : node;
+    }
+    if (!strcmp(word, "while") || !strcmp(word, "until"))
+    {
+        node = ast_new(p, word[0] == 'w' ? AST_WHILE : AST_UNTIL);
+        p->index++;
+        node->cond = ast_parse_list(p);
+        if (ast_expect(p, "do") < 0)
+        {
+            return NULL;
+        }
+        node->body = ast_parse_list(p);
+        return ast_expect(p, "done") < 0 ? NULL : node;
+    }
+    if (!strcmp(word, "if"))
+    {
+        p->index++;
+        return ast_parse_if(p);
+    }
+    if (!strcmp(word, "function"))
+    {
+        node = ast_new(p, AST_FUNCTION);
+        p->index++;
+        if (!p->tokens[p->index])
+        {
+            p->incomplete = 1;
+            return NULL;
+        }
+        node->name = arena_strdup(p->arena, p->tokens[p->index++]);
+        if (ast_expect(p, "{") < 0)
+        {
+            return NULL;
+        }
+        node->body = ast_parse_list(p);
+        return ast_expect(p, "}") < 0 ? NULL : node;
+    }
+
+    node = ast_new(p, !strcmp(word, "break") ? AST_BREAK : !strcmp(word, "continue") ? AST_CONTINUE
+        : !strcmp(word, "return") ? AST_RETURN : AST_COMMAND);
+    if (node->type != AST_COMMAND)
+    {
+        p->index++;
+    }
+    ast_parse_words(p, node);
+    return node;
+}
+
+/* Parse the rest of an if or elif once the keyword has been consumed, up to and */
+/* including the matching fi.  Return NULL if the parse failed or is incomplete. */
+ast_node * ast_parse_if(ast_parser * p)
+{
+    ast_node * node = ast_new(p, AST_IF);
+
+    node->cond = ast_parse_list(p);
+    if (ast_expect(p, "then") < 0)
+    {
+        return NULL;
+    }
+    node->body = ast_parse_list(p);
+    if (ast_at(p, "elif"))
+    {
+        p->index++;
+        node->orelse = ast_parse_if(p);
+        return node->orelse ? node : NULL;
+    }
+    if (ast_at(p, "else"))
+    {
+        p->index++;
+        node->orelse = ast_parse_list(p);
+    }
+    return ast_expect(p, "fi") < 0 ? NULL : node;
+}
+
+/* Parse commands separated by ";" until the tokens run out or a keyword that closes */
+/* the enclosing compound command is reached.  Return the first command of the list. */
+ast_node * ast_parse_list(ast_parser * p)
+{
+    ast_node * first = NULL;
+    ast_node ** link = &first;
+
+    while (!p->failed && !p->incomplete)
+    {
+        while (ast_at(p, ";"))
+        {
+            p->index++;
+        }
+        if (!p->tokens[p->index] || ast_at_closer(p))
+        {
+            break;
+        }
+        if (!(*link = ast_parse_command(p)))
+        {
+            break;
+        }
+        link = &(*link)->next;
+        if (p->tokens[p->index] && !ast_at(p, ";") && !ast_at_closer(p))
+        {
+            printf("Syntax error: expected \";\" before \"%s\".\n", p->tokens[p->index]);
+            p->failed = 1;
+        }
+    }
+    return first;
+}
+
+/* Copy the words up to the next ";" into the node, noting whether any of them has */
+/* variables, substitutions or glob patterns to expand each time the node runs. */
+void ast_parse_words(ast_parser * p, ast_node * node)
+{
+    size_t count = 0;
+
+    while (p->tokens[p->index + count] && strcmp(p->tokens[p->index + count], ";"))
+    {
+        count++;
+    }
+    node->words = (char **)arena_alloc(p->arena, sizeof(char *) * (count + 1));
+    for (size_t i = 0; i < count; i++)
+    {
+        const char * word = p->tokens[p->index++];
+        node->words[i] = arena_strdup(p->arena, word);
+        node->expand |= strchr(word, '$') || glob_has_magic(word);
+    }
+    node->words[count] = NULL;
+}
+
+/* Run a list of commands.  Return AST_BREAK, AST_CONTINUE or AST_RETURN if one of them */
+/* has to end the enclosing loop or function early, or 0. */
+int ast_run(ast_node * node)
+{
+    int flow = 0;
+
+    for (; node && !flow && !ast_interrupted; node = node->next)
+    {
+        switch (node->type)
+        {
+            case AST_COMMAND:
+                ast_run_command(node);
+                break;
+
+            case AST_FOR:
+            case AST_WHILE:
+            case AST_UNTIL:
+                flow = ast_run_loop(node);
+                break;
+
+            case AST_IF:
+                if ((flow = ast_run(node->cond)))
+                {
+                    break;
+                }
+                if (last_status == 0)
+                {
+                    flow = ast_run(node->body);
+                }
+                else if (node->orelse)
+                {
+                    flow = ast_run(node->orelse);
+                }
+                else
+                {
+                    last_status = 0;
+                }
+                break;
+
+            case AST_FUNCTION:
+                function_define(node->name, node->body);
+                ast_keep_arena = 1;
+                last_status = 0;
+                break;
+
+            default:
+                //break, continue and return, with return taking an optional exit status.
+                if (node->type == AST_RETURN && node->words[0])
+                {
+                    char ** args = node->expand ? expand_words(node->words) : node->words;
+                    last_status = args && args[0] ? atoi(args[0]) & 0xff : 1;
+                    if (node->expand)
+                    {
+                        free_words(args);
+                    }
+                }
+                flow = node->type;
+                break;
+        }
+    }
+    return flow;
+}
+
+/* Run a simple command, expanding its words first if any of them need it, and calling */
+/* it as a function if one has its name. */
+void ast_run_command(ast_node * node)
+{
+    char ** args = node->expand ? expand_words(node->words) : node->words;
+    shell_function * f;
+
+    if (!args)
+    {
+        last_status = 1;
+        return;
+    }
+    if (args[0] && (f = function_find(args[0])))
+    {
+        function_call(f, args);
+    }
+    else
+    {
+        run_command(args);
+    }
+    if (node->expand)
+    {
+        free_words(args);
+    }
+    //A script has no prompt before which finished jobs are freed.
+    if (!shell_is_interactive && !server_mode && job_list)
+    {
+        do_job_notification();
+    }
+    //A foreground job stopped with Ctrl-C stops the loops around it as well.
+    if (last_status == 128 + SIGINT)
+    {
+        ast_interrupted = 1;
+    }
+}
+
+/* Run a for, while or until loop.  Return AST_RETURN if a return ended it, or 0. */
+/* Its exit status is that of the last command run in its body, or 0 if none was. */
+int ast_run_loop(ast_node * node)
+{
+    int flow = 0;
+    int status = 0;
+
+    if (node->type == AST_FOR)
+    {
+        char * none[] = {NULL};
+        char ** words = !node->words ? (positional_args ? positional_args + 1 : none)
+            : node->expand ? expand_words(node->words) : node->words;
+
+        if (!words)
+        {
+            last_status = 1;
+            return 0;
+        }
+        for (char ** w = words; *w && !ast_interrupted; w++)
+        {
+            var_set(node->name, *w, 0);
+            flow = ast_run(node->body);
+            status = last_status;
+            if (flow == AST_BREAK || flow == AST_RETURN)
+            {
+                break;
+            }
+            flow = 0;
+        }
+        if (node->words && node->expand)
+        {
+            free_words(words);
+        }
+    }
+    else
+    {
+        while (!ast_interrupted)
+        {
+            if ((flow = ast_run(node->cond)))
+            {
+                break;
+            }
+            if ((last_status == 0) != (node->type == AST_WHILE))
+            {
+                break;
+            }
+            flow = ast_run(node->body);
+            status = last_status;
+            if (flow == AST_BREAK || flow == AST_RETURN)
+            {
+                break;
+            }
+            flow = 0;
+        }
+    }
+    last_status = status;
+    return flow == AST_RETURN ? AST_RETURN : 0;
+}
+
+/* Signal handler for Ctrl-C while a compound command is running. */
+void ast_sigint(int signo)
+{
+    (void)signo;
+    ast_interrupted = 1;
+}
+
+/* Append bytes to a buffer, growing it as needed. */
+void buffer_append(buffer * b, const char * data, size_t length)
+{
+    buffer_reserve(b, length);
+    memcpy(b->data + b->length, data, length);
+    b->length += length;
+    b->data[b->length] = '\0';
+}
+
+/* Make sure a buffer has room for at least length more bytes and a terminating NUL. */
+void buffer_reserve(buffer * b, size_t length)
+{
+    if (b->length + length + 1 > b->size)
+    {
+        size_t size = b->size ? b->size : 256;
+        while (size < b->length + length + 1)
+        {
+            size *= 2;
+        }
+        b->data = (char *)realloc(b->data, size);
+        b->size = size;
+        b->data[b->length] = '\0';
+    }
+}
+
+/* Copy what a stopped captured job has written to one of its forwarded pipes (0 for */
+/* standard output, 1 for standard error) to the terminal, closing the pipe at its end. */
+void capture_drain(job * j, int stream)
+{
+    char chunk[65536];
+    ssize_t n;
+
+    while ((n = read(j->forward_fds[stream], chunk, sizeof(chunk))) > 0)
+    {
+        editor_interrupt();
+        write(stream ? STDERR_FILENO : STDOUT_FILENO, chunk, n);
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EINTR))
+    {
+        close(j->forward_fds[stream]);
+        j->forward_fds[stream] = -1;
+    }
+}
+
+/* Hand the pipes a captured job writes its standard output and error to (-1 if it has */
+/* none) to the event loop once the job has been stopped, so that the job does not die */
+/* writing to a pipe with no reader when it is continued. */
+void capture_forward(job * j, int out, int err)
+{
+    int fds[2] = {out, err};
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (fds[i] >= 0)
+        {
+            fcntl(fds[i], F_SETFL, O_NONBLOCK);
+        }
+        j->forward_fds[i] = fds[i];
+    }
+    sigchld_init();
+}
+
+/* Run a command line and append everything it writes to stdout to a buffer. */
+/* The output is read straight from the pipe while the job runs in the foreground. */
+/* Return 0 on success, -1 if the command could not be run. */
+int capture_output(const char * command, buffer * output)
+{
+    char * line = strdup(command);
+    char ** tokens = tokenize_line(line);
+    char ** cmd_args = expand_words(tokens);
+    int fds[2];
+    job * j;
+
+    free(tokens);
+    if (!cmd_args || !cmd_args[0])
+    {
+        free(line);
+        free_words(cmd_args);
+        return cmd_args ? 0 : -1;
+    }
+    j = add_job(cmd_args[0]);
+    j->capture = 1;
+    if (cmd_parser(cmd_args, j) != 1 || pipe2(fds, O_CLOEXEC) < 0)
+    {
+        puts("Malformed command substitution.");
+        free_job(j);
+        free(line);
+        free_words(cmd_args);
+        return -1;
+    }
+    free(line);
+    free_words(cmd_args);
+
+    //A larger pipe means fewer reads when capturing a lot of output.
+    fcntl(fds[0], F_SETPIPE_SZ, 1 << 20);
+    j->stdout = fds[1];
+    launch_job(j, 1);
+    close(fds[1]);
+
+    while (1)
+    {
+        struct pollfd pfd = {fds[0], POLLIN, 0};
+        ssize_t n;
+
+        //Wake up now and then, and whenever SIGCHLD interrupts the wait, to check that the
+        //job has not been stopped with Ctrl-Z.
+        if (poll(&pfd, 1, 100) <= 0)
+        {
+            update_status();
+            if (job_is_stopped(j) && !job_is_completed(j))
+            {
+                //What it writes once it is continued goes to the terminal.
+                capture_forward(j, fds[0], -1);
+                fds[0] = -1;
+                break;
+            }
+            continue;
+        }
+        if (!pfd.revents)
+        {
+            continue;
+        }
+        buffer_reserve(output, 65536);
+        n = read(fds[0], output->data + output->length, output->size - output->length - 1);
+        if (n <= 0)
+        {
+            break;
+        }
+        output->length += n;
+        output->data[output->length] = '\0';
+    }
+    if (fds[0] >= 0)
+    {
+        close(fds[0]);
+    }
+    if (finish_capture(j))
+    {
+        free_job(j);
+    }
+    return 0;
+}
+
+/* Copy a command text to output with the body of each here-document moved into its "<<" */
+/* word between HEREDOC_MARK characters, so that it is one token however many lines it */
+/* spans.  The body is made of the lines after the one holding the "<<" word, up to a */
+/* line consisting of the word's delimiter.  Other ends of lines become ";", and if */
+/* script is true a word starting with "#" starts a comment running to the end of the */
+/* line.  Return 0, or 1 if the text ends before the delimiter of a here-document. */
+int heredoc_gather(const char * text, buffer * output, int script)
+{
+    const char * c = text;
+    size_t offsets[MAX_ARGS];
+    char * delimiters[MAX_ARGS];
+    int pending = 0;
+    int depth = 0;
+    int word_start = 1;
+    int result = 0;
+
+    buffer_append(output, "", 0);
+    while (1)
+    {
+        if (*c == '\0' || (!depth && *c == '\n'))
+        {
+            size_t shift = 0;
+
+            //The bodies of the line's here-documents follow it, in order.
+            c += *c != '\0';
+            for (int i = 0; i < pending; i++)
+            {
+                const char * body = c;
+                size_t length;
+
+                while (1)
+                {
+                    const char * end = strchr(c, '\n');
+                    size_t line = end ? (size_t)(end - c) : strlen(c);
+
+                    if (line == strlen(delimiters[i]) && !strncmp(c, delimiters[i], line))
+                    {
+                        length = c - body;
+                        c += line + (end != NULL);
+                        break;
+                    }
+                    if (!end)
+                    {
+                        length = c + line - body;
+                        c += line;
+                        result = 1;
+                        break;
+                    }
+                    c = end + 1;
+                }
+                buffer_reserve(output, length + 2);
+                memmove(output->data + offsets[i] + shift + length + 2, output->data + offsets[i] + shift,
+                    output->length - offsets[i] - shift + 1);
+                output->data[offsets[i] + shift] = HEREDOC_MARK;
+                memcpy(output->data + offsets[i] + shift + 1, body, length);
+                output->data[offsets[i] + shift + length + 1] = HEREDOC_MARK;
+                output->length += length + 2;
+                shift += length + 2;
+                free(delimiters[i]);
+            }
+            pending = 0;
+            word_start = 1;
+            if (*c == '\0')
+            {
+                break;
+            }
+            buffer_append(output, ";", 1);
+            continue;
+        }
+        if ((c[0] == '$' || c[0] == '<' || c[0] == '>') && c[1] == '(')
+        {
+            buffer_append(output, c, 2);
+            depth++;
+            c += 2;
+            word_start = 0;
+            continue;
+        }
+        if (depth && *c == '(')
+        {
+            depth++;
+        }
+        else if (depth && *c == ')')
+        {
+            depth--;
+        }
+        else if (!depth && word_start && script && *c == '#')
+        {
+            while (*c && *c != '\n')
+            {
+                c++;
+            }
+            continue;
+        }
+        else if (!depth && word_start && c[0] == '<' && c[1] == '<' && c[2] != '<' && pending < MAX_ARGS)
+        {
+            //The delimiter may be written after the "<<" or as the next word.
+            const char * word = c + 2;
+            const char * end;
+
+            while (*word == ' ' || *word == '\t')
+            {
+                word++;
+            }
+            for (end = word; *end && !strchr(DELIMITERS, *end) && *end != ';'; end++);
+            if (end > word)
+            {
+                buffer_append(output, "<<", 2);
+                buffer_append(output, word, end - word);
+                offsets[pending] = output->length;
+                delimiters[pending++] = strndup(word, end - word);
+                c = end;
+                word_start = 0;
+                continue;
+            }
+        }
+        buffer_append(output, c, 1);
+        word_start = *c == ';' || strchr(DELIMITERS, *c) != NULL;
+        c++;
+    }
+    return result;
+}
+
+/* Return a descriptor from which the text of a here-document or here-string can be */
+/* read from the start, or -1 on failure.  Text that fits in a pipe is written to one, */
+/* and longer text to a sealed memfd, so that it never touches the filesystem.  The most */
+/* recently used memfds are kept, and each use of the same text, e.g. by a loop, opens */
+/* one of them afresh rather than copying the text again. */
+int heredoc_open(const char * text, size_t length)
+{
+    heredoc_file * slot = heredoc_files;
+    char * map;
+    char path[64];
+    int fds[2];
+    int fd;
+
+    if (length <= PIPE_BUF)
+    {
+        if (pipe2(fds, O_CLOEXEC) < 0)
+        {
+            return -1;
+        }
+        write(fds[1], text, length);
+        close(fds[1]);
+        return fds[0];
+    }
+
+    for (int i = 0; i < HEREDOC_FILES; i++)
+    {
+        if (heredoc_files[i].used && heredoc_files[i].length == length
+         && !memcmp(heredoc_files[i].map, text, length))
+        {
+            //A new open file description has its own offset, so readers do not share one.
+            heredoc_files[i].used = ++heredoc_uses;
+            snprintf(path, sizeof(path), "/proc/self/fd/%d", heredoc_files[i].fd);
+            if ((fd = open(path, O_RDONLY|O_CLOEXEC)) >= 0)
+            {
+                return fd;
+            }
+        }
+        if (heredoc_files[i].used < slot->used)
+        {
+            slot = &heredoc_files[i];
+        }
+    }
+
+    fd = memfd_create("cshell-heredoc", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    for (size_t written = 0; written < length;)
+    {
+        ssize_t n = write(fd, text + written, length - written);
+        if (n <= 0)
+        {
+            close(fd);
+            return -1;
+        }
+        written += n;
+    }
+    //Sealed, the contents can be handed to any number of jobs without being changed.
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL);
+    map = (char *)mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+    if (slot->used)
+    {
+        munmap(slot->map, slot->length);
+        close(slot->fd);
+    }
+    slot->fd = fd;
+    slot->map = map;
+    slot->length = length;
+    slot->used = ++heredoc_uses;
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    return open(path, O_RDONLY|O_CLOEXEC);
+}
+
+/* Return the body of a here-document word, just after its first HEREDOC_MARK, or NULL */
+/* if the word is not one. */
+const char * heredoc_body(const char * word)
+{
+    const char * mark;
+
+    if (word[0] != '<' || word[1] != '<' || !(mark = strchr(word, HEREDOC_MARK)))
+    {
+        return NULL;
+    }
+    return mark + 1;
+}
+
+/* Replace each process substitution in a word, <(command) or >(command), with the path */
+/* /dev/fd/N of a pipe from or to the command, whose processes are added to the list at */
+/* substs for job j and read or write the pipe on behalf of the consumer process.  Return */
+/* the new word, or NULL if a substitution is malformed. */
+char * process_subst_expand(const char * word, job * j, process * consumer, process ** substs)
+{
+    buffer output = {NULL, 0, 0};
+    const char * c = word;
+    const char * start;
+
+    while ((start = process_subst_find(c)))
+    {
+        job sub;
+        const char * end;
+        char * text;
+        char ** tokens;
+        char path[32];
+        int depth = 1;
+        int result;
+        int fds[2];
+        process * first = NULL;
+        process * last = NULL;
+
+        buffer_append(&output, c, start - c);
+        for (end = start + 2; *end && depth > 0; end++)
+        {
+            depth += (*end == '(') - (*end == ')');
+        }
+        if (depth > 0)
+        {
+            free(output.data);
+            return NULL;
+        }
+
+        //The command is parsed as a job of its own, whose processes then join this one.
+        //Its words are expanded by launch_job, so that parsing never runs a command.
+        text = strndup(start + 2, end - start - 3);
+        tokens = tokenize_line(text);
+        memset(&sub, 0, sizeof(sub));
+        result = tokens[0] ? cmd_parser(tokens, &sub) : -1;
+        free(tokens);
+        free(text);
+        for (process * p = sub.first_process; p; p = p->next)
+        {
+            p->job = j;
+            p->deferred = 1;
+            if (!p->consumer)
+            {
+                p->consumer = consumer;
+                first = first ? first : p;
+            }
+            last = p;
+        }
+        if (last)
+        {
+            last->next = *substs;
+            *substs = sub.first_process;
+        }
+        if (result != 1 || pipe2(fds, O_CLOEXEC) < 0)
+        {
+            free(output.data);
+            return NULL;
+        }
+
+        //The pipe is read by the first process of the command's pipeline or written by
+        //its last, and the consumer opens the other end by its path.
+        if (start[0] == '<')
+        {
+            last->subst_out = fds[1];
+            last->consumer_fd = fds[0];
+        }
+        else
+        {
+            first->subst_in = fds[0];
+            first->consumer_fd = fds[1];
+        }
+        buffer_append(&output, path, snprintf(path, sizeof(path), "/dev/fd/%d", start[0] == '<' ? fds[0] : fds[1]));
+        c = end;
+    }
+    buffer_append(&output, c, strlen(c));
+    return output.data;
+}
+
+/* Expand the words and any here-document of a process of a process substitution, which */
+/* are kept as they were typed until it is launched.  If the words expand to nothing or */
+/* cannot be expanded they are left as they are, for the process to report. */
+void process_expand(process * p)
+{
+    char ** args = expand_words(p->argv);
+    buffer input = {NULL, 0, 0};
+    int split = 0;
+
+    if (args && args[0])
+    {
+        free_words(p->argv);
+        p->argv = args;
+    }
+    else
+    {
+        free_words(args);
+    }
+    if (p->input && strchr(p->input, '$') && expand_word(p->input, &input, &split) == 0)
+    {
+        buffer_reserve(&input, 0);
+        free(p->input);
+        p->input = input.data;
+        p->input_length = input.length;
+    }
+    else
+    {
+        free(input.data);
+    }
+    p->deferred = 0;
+}
+
+/* Return the first process substitution, "<(" or ">(", in a word outside any command */
+/* substitution, or NULL if there is none. */
+const char * process_subst_find(const char * word)
+{
+    int depth = 0;
+
+    if (heredoc_body(word))
+    {
+        return NULL;
+    }
+    for (const char * c = word; *c; c++)
+    {
+        if (c[0] == '$' && c[1] == '(')
+        {
+            depth++;
+            c++;
+        }
+        else if (!depth && (c[0] == '<' || c[0] == '>') && c[1] == '(')
+        {
+            return c;
+        }
+        else if (depth && *c == '(')
+        {
+            depth++;
+        }
+        else if (depth && *c == ')')
+        {
+            depth--;
+        }
+    }
+    return NULL;
+}
+
+/* Return the path of the cache store, creating its directories if needed, or NULL if */
+/* there is nowhere to put it.  The path is to be freed by the caller. */
+char * cache_dir(void)
+{
+    char * path = NULL;
+    char * sub = NULL;
+
+    if (var_get("CSHELL_CACHE_DIR"))
+    {
+        path = strdup(var_get("CSHELL_CACHE_DIR"));
+    }
+    else if (var_get("XDG_CACHE_HOME"))
+    {
+        asprintf(&path, "%s/cshell", var_get("XDG_CACHE_HOME"));
+    }
+    else if (var_get("HOME"))
+    {
+        asprintf(&path, "%s/.cache", var_get("HOME"));
+        mkdir(path, 0700);
+        free(path);
+        asprintf(&path, "%s/.cache/cshell", var_get("HOME"));
+    }
+    else
+    {
+        return NULL;
+    }
+    mkdir(path, 0700);
+    asprintf(&sub, "%s/objects", path);
+    mkdir(sub, 0700);
+    free(sub);
+    asprintf(&sub, "%s/keys", path);
+    mkdir(sub, 0700);
+    free(sub);
+    return path;
+}
+
+/* Delete the least recently used outputs until the store is no larger than its size */
+/* limit, CSHELL_CACHE_SIZE bytes or 256M by default.  Keys whose output has been */
+/* deleted are removed when they are next looked up. */
+void cache_evict(const char * dir)
+{
+    unsigned long long limit = 256ULL << 20;
+    unsigned long long total = 0;
+    cache_object * objects = NULL;
+    size_t count = 0, size = 0;
+    char * path = NULL;
+    DIR * d;
+    struct dirent * entry;
+    int dir_fd;
+
+    if (var_get("CSHELL_CACHE_SIZE") && parse_size(var_get("CSHELL_CACHE_SIZE"), &limit) < 0)
+    {
+        fputs("cache: CSHELL_CACHE_SIZE is not a size\n", stderr);
+        return;
+    }
+    asprintf(&path, "%s/objects", dir);
+    d = opendir(path);
+    free(path);
+    if (!d)
+    {
+        return;
+    }
+    dir_fd = dirfd(d);
+    while ((entry = readdir(d)))
+    {
+        struct stat st;
+        if (entry->d_name[0] == '.' || fstatat(dir_fd, entry->d_name, &st, 0) < 0)
+        {
+            continue;
+        }
+        if (count == size)
+        {
+            size = size ? size * 2 : 64;
+            objects = (cache_object *)realloc(objects, sizeof(cache_object) * size);
+        }
+        objects[count].used = st.st_mtim;
+        objects[count].size = st.st_size;
+        strncpy(objects[count].name, entry->d_name, sizeof(objects[count].name) - 1);
+        objects[count].name[sizeof(objects[count].name) - 1] = '\0';
+        total += st.st_size;
+        count++;
+    }
+
+    //Outputs are touched whenever they are replayed, so the oldest were used least recently.
+    if (total > limit)
+    {
+        qsort(objects, count, sizeof(cache_object), compare_cache_objects);
+        for (size_t i = 0; i < count && total > limit; i++)
+        {
+            if (unlinkat(dir_fd, objects[i].name, 0) == 0)
+            {
+                total -= objects[i].size;
+            }
+        }
+    }
+    closedir(d);
+    free(objects);
+}
+
+/* Run a command through the cache.  Usage: cache [--ttl seconds] [--] command [args] */
+/* A command whose arguments, environment and input files are unchanged since it last */
+/* completed has its output and exit status replayed instead of being run again. */
+void cache_func(char ** cmd_args)
+{
+    int index = 1;
+    long ttl = -1;
+    buffer key = {NULL, 0, 0};
+    char * dir;
+    char * key_path = NULL;
+    char name[33];
+    int foreground;
+    job * j;
+
+    int valid = 1;
+
+    while (valid && cmd_args[index] && !strcmp(cmd_args[index], "--ttl"))
+    {
+        char * end;
+        ttl = cmd_args[index + 1] ? strtol(cmd_args[index + 1], &end, 10) : -1;
+        valid = ttl >= 0 && end != cmd_args[index + 1] && !*end;
+        index += 2;
+    }
+    if (valid && cmd_args[index] && !strcmp(cmd_args[index], "--"))
+    {
+        index++;
+    }
+    if (!valid || !cmd_args[index] || cmd_args[index][0] == '-')
+    {
+        puts("Usage: cache [--ttl seconds] [--] command [args]");
+        return;
+    }
+    for (const char ** builtin = builtin_names; *builtin; builtin++)
+    {
+        if (!strcmp(cmd_args[index], *builtin))
+        {
+            fputs("cache: builtins are not cached\n", stderr);
+            run_command(cmd_args + index);
+            return;
+        }
+    }
+
+    j = add_job(cmd_args[index]);
+    foreground = cmd_parser(cmd_args + index, j);
+    if (foreground != 1)
+    {
+        puts(foreground < 0 ? "Malformed command.  Check background symbols and pipes." : "cache: background commands are not cached");
+        free_job(j);
+        return;
+    }
+
+    //The key is the working directory, the words of every command, the selected
+    //environment variables and the identity of every argument that names a file.
+    cache_key(j, &key);
+    snprintf(name, sizeof(name), "%016llx%016llx", hash_bytes(key.data, key.length, 14695981039346656037ULL),
+        hash_bytes(key.data, key.length, 0x6c62272e07bb0142ULL));
+    dir = cache_dir();
+    if (dir)
+    {
+        asprintf(&key_path, "%s/keys/%s", dir, name);
+        if (cache_replay(dir, key_path, &key, ttl) == 0)
+        {
+            free_job(j);
+            free(key_path);
+            free(dir);
+            free(key.data);
+            return;
+        }
+    }
+    cache_store(j, dir, key_path, &key);
+    free(key_path);
+    free(dir);
+    free(key.data);
+}
+
+/* Build the key of a cached command in a buffer. */
+void cache_key(job * j, buffer * key)
+{
+    const char * names = var_get("CSHELL_CACHE_ENV") ? var_get("CSHELL_CACHE_ENV") : "PATH";
+    const char * cwd = var_get("PWD") ? var_get("PWD") : "";
+
+    buffer_append(key, cwd, strlen(cwd) + 1);
+    for (process * p = j->first_process; p; p = p->next)
+    {
+        for (char ** arg = p->argv; *arg; arg++)
+        {
+            struct stat st;
+            char identity[128];
+
+            buffer_append(key, *arg, strlen(*arg) + 1);
+            //A pipe, e.g. of a process substitution, is new every time, so it is keyed by
+            //its path alone; the command writing it is part of the key as it was typed.
+            if (stat(*arg, &st) == 0 && !S_ISFIFO(st.st_mode))
+            {
+                buffer_append(key, identity, snprintf(identity, sizeof(identity), "%llu:%llu:%lld:%lld.%09ld",
+                    (unsigned long long)st.st_dev, (unsigned long long)st.st_ino, (long long)st.st_size,
+                    (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec) + 1);
+            }
+        }
+        buffer_append(key, "|", 2);
+    }
+    while (*names)
+    {
+        size_t length = strcspn(names, ": ");
+        char variable[MAX_BUFFER_SIZE];
+
+        if (length > 0 && length < sizeof(variable))
+        {
+            const char * value;
+            memcpy(variable, names, length);
+            variable[length] = '\0';
+            value = var_get(variable);
+            buffer_append(key, variable, length);
+            buffer_append(key, "=", 1);
+            if (value)
+            {
+                buffer_append(key, value, strlen(value));
+            }
+            buffer_append(key, "", 1);
+        }
+        names += length;
+        names += *names ? 1 : 0;
+    }
+}
+
+/* Replay the output and exit status recorded for a key, if there is a record no older */
+/* than ttl seconds (any age if ttl is negative).  Return 0 if it was replayed, -1 if */
+/* the command has to be run. */
+int cache_replay(const char * dir, const char * key_path, buffer * key, long ttl)
+{
+    FILE * f = fopen(key_path, "r");
+    long long created;
+    int status;
+    char object[64];
+    size_t length;
+    char * stored;
+    char * path = NULL;
+    char * map;
+    struct stat st;
+    int fd;
+
+    if (!f)
+    {
+        return -1;
+    }
+    if (fscanf(f, "cshell-cache 1\n%lld\n%d\n%40s\n%zu\n", &created, &status, object, &length) != 4
+        || length != key->length)
+    {
+        fclose(f);
+        return -1;
+    }
+
+    //Different keys can share a hash, so the record has to hold exactly this key.
+    stored = (char *)malloc(length + 1);
+    if (fread(stored, 1, length, f) != length || memcmp(stored, key->data, length))
+    {
+        free(stored);
+        fclose(f);
+        return -1;
+    }
+    free(stored);
+    fclose(f);
+    if (ttl >= 0 && time(NULL) - created > ttl)
+    {
+        return -1;
+    }
+
+    asprintf(&path, "%s/objects/%s", dir, object);
+    fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0)
+    {
+        //The output has been evicted.
+        unlink(key_path);
+        free(path);
+        return -1;
+    }
+    utimensat(AT_FDCWD, path, NULL, 0);
+    free(path);
+    fstat(fd, &st);
+    map = st.st_size ? (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    //The output is stored as chunks of a stream number and a length, in the order written.
+    for (off_t offset = 0; offset + 5 <= st.st_size;)
+    {
+        unsigned int chunk;
+        memcpy(&chunk, map + offset + 1, 4);
+        if (offset + 5 + chunk > st.st_size)
+        {
+            break;
+        }
+        for (size_t done = 0; done < chunk;)
+        {
+            ssize_t n = write(map[offset] == 2 ? STDERR_FILENO : STDOUT_FILENO, map + offset + 5 + done, chunk - done);
+            if (n <= 0)
+            {
+                break;
+            }
+            done += n;
+        }
+        offset += 5 + chunk;
+    }
+    if (map)
+    {
+        munmap(map, st.st_size);
+    }
+    last_status = status;
+    return 0;
+}
+
+/* Return 1 if the file open on fd starts with the same bytes as the stored object at */
+/* path, which the caller has checked to be the same size, or 0 if it does not or either */
+/* cannot be read. */
+int cache_object_equal(int fd, const char * path)
+{
+    char ours[65536];
+    char theirs[65536];
+    int object = open(path, O_RDONLY|O_CLOEXEC);
+    off_t offset = 0;
+    ssize_t n = 0;
+
+    if (object < 0)
+    {
+        return 0;
+    }
+    while ((n = pread(fd, ours, sizeof(ours), offset)) > 0)
+    {
+        if (pread(object, theirs, n, offset) != n || memcmp(ours, theirs, n))
+        {
+            n = -1;
+            break;
+        }
+        offset += n;
+    }
+    close(object);
+    return n == 0;
+}
+
+/* Run a cached command with its output copied to the terminal as it arrives, and */
+/* store the output and exit status under the key if the command completes. */
+void cache_store(job * j, const char * dir, const char * key_path, buffer * key)
+{
+    int out[2], err[2];
+    int temp = -1;
+    char * temp_path = NULL;
+    unsigned long long hash[2] = {14695981039346656037ULL, 0x6c62272e07bb0142ULL};
+    unsigned long long written = 0;
+    struct pollfd pfds[2];
+    char data[65536];
+    int open_pipes = 2;
+    int complete = 1;
+
+    if (pipe2(out, O_CLOEXEC) < 0 || pipe2(err, O_CLOEXEC) < 0)
+    {
+        perror("cache");
+        free_job(j);
+        return;
+    }
+    if (dir)
+    {
+        asprintf(&temp_path, "%s/objects/.new.XXXXXX", dir);
+        temp = mkostemp(temp_path, O_CLOEXEC);
+    }
+    j->capture = 1;
+    j->stdout = out[1];
+    j->stderr = err[1];
+    launch_job(j, 1);
+    close(out[1]);
+    close(err[1]);
+
+    pfds[0].fd = out[0];
+    pfds[1].fd = err[0];
+    pfds[0].events = pfds[1].events = POLLIN;
+    pfds[0].revents = pfds[1].revents = 0;
+    while (open_pipes > 0)
+    {
+        //Wake up now and then, and whenever SIGCHLD interrupts the wait, to check that the
+        //job has not been stopped with Ctrl-Z.
+        if (poll(pfds, 2, 100) <= 0)
+        {
+            update_status();
+            if (job_is_stopped(j) && !job_is_completed(j))
+            {
+                //What it writes once it is continued still goes to the terminal.
+                capture_forward(j, pfds[0].fd, pfds[1].fd);
+                pfds[0].fd = pfds[1].fd = -1;
+                break;
+            }
+            continue;
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            ssize_t n;
+            unsigned char header[5];
+            unsigned int length;
+
+            if (pfds[i].fd < 0 || !(pfds[i].revents & (POLLIN|POLLHUP|POLLERR)))
+            {
+                continue;
+            }
+            n = read(pfds[i].fd, data, sizeof(data));
+            if (n <= 0)
+            {
+                close(pfds[i].fd);
+                pfds[i].fd = -1;
+                open_pipes--;
+                continue;
+            }
+            write(i ? STDERR_FILENO : STDOUT_FILENO, data, n);
+            if (temp >= 0)
+            {
+                struct iovec iov[2] = {{header, 5}, {data, (size_t)n}};
+                header[0] = i + 1;
+                length = n;
+                memcpy(header + 1, &length, 4);
+                if (writev(temp, iov, 2) != n + 5)
+                {
+                    close(temp);
+                    unlink(temp_path);
+                    temp = -1;
+                }
+                for (int h = 0; h < 2; h++)
+                {
+                    hash[h] = hash_bytes(iov[0].iov_base, 5, hash[h]);
+                    hash[h] = hash_bytes(data, n, hash[h]);
+                }
+                written += n + 5;
+            }
+        }
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        if (pfds[i].fd >= 0)
+        {
+            close(pfds[i].fd);
+        }
+    }
+
+    //A stopped or killed command has incomplete output, so it is not stored.
+    if (!finish_capture(j))
+    {
+        complete = 0;
+    }
+    else
+    {
+        for (process * p = j->first_process; p; p = p->next)
+        {
+            complete = complete && !WIFSIGNALED(p->status);
+        }
+        free_job(j);
+    }
+    if (complete && temp >= 0)
+    {
+        char object[33];
+        char * object_path = NULL;
+        char * record_path = NULL;
+        struct stat st;
+        FILE * f;
+
+        //Outputs are named by a hash of their content, so identical outputs are only stored
+        //once.  The hash is not proof against collisions, so an output is only taken to be
+        //one already stored if their bytes match; one that collides is not cached at all.
+        snprintf(object, sizeof(object), "%016llx%016llx", hash[0], hash[1]);
+        asprintf(&object_path, "%s/objects/%s", dir, object);
+        if (stat(object_path, &st) < 0)
+        {
+            rename(temp_path, object_path);
+        }
+        else
+        {
+            if ((unsigned long long)st.st_size == written && cache_object_equal(temp, object_path))
+            {
+                utimensat(AT_FDCWD, object_path, NULL, 0);
+            }
+            else
+            {
+                complete = 0;
+            }
+            unlink(temp_path);
+        }
+        asprintf(&record_path, "%s.new", key_path);
+        f = complete ? fopen(record_path, "w") : NULL;
+        if (f)
+        {
+            fprintf(f, "cshell-cache 1\n%lld\n%d\n%s\n%zu\n", (long long)time(NULL), last_status, object, key->length);
+            fwrite(key->data, 1, key->length, f);
+            if (fclose(f) == 0)
+            {
+                rename(record_path, key_path);
+            }
+        }
+        free(record_path);
+        free(object_path);
+        close(temp);
+        cache_evict(dir);
+    }
+    else if (temp >= 0)
+    {
+        close(temp);
+        unlink(temp_path);
+    }
+    free(temp_path);
+}
+
+/* Close the cached /proc descriptors of a process. */
+void close_process_stats(process * p)
+{
+    if (p->stat_fd >= 0)
+    {
+        close(p->stat_fd);
+        p->stat_fd = -1;
+    }
+    if (p->io_fd >= 0)
+    {
+        close(p->io_fd);
+        p->io_fd = -1;
+    }
+}
+
+/* Compare two stored outputs by when they were last used, for qsort. */
+int compare_cache_objects(const void * a, const void * b)
+{
+    const struct timespec * x = &((const cache_object *)a)->used;
+    const struct timespec * y = &((const cache_object *)b)->used;
+    if (x->tv_sec != y->tv_sec)
+    {
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    }
+    return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+/* Compare two directory entries by name for qsort_r. */
+int compare_dir_entries(const void * a, const void * b, void * names)
+{
+    return strcmp((char *)names + *(const unsigned int *)a, (char *)names + *(const unsigned int *)b);
+}
+
+/* Find the commands and builtins starting with a prefix. */
+/* Return the number of matches, which are left in completion_matches. */
+size_t complete_command(const char * prefix, size_t length)
+{
+    int node = 0;
+    int stack[MAX_BUFFER_SIZE];
+    int depth = 0;
+    char name[MAX_BUFFER_SIZE];
+
+    path_trie_refresh();
+    if (length >= MAX_BUFFER_SIZE)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < length && node >= 0; i++)
+    {
+        for (node = path_trie[node].child; node >= 0 && path_trie[node].c < (unsigned char)prefix[i];
+            node = path_trie[node].sibling);
+        if (node >= 0 && path_trie[node].c != (unsigned char)prefix[i])
+        {
+            node = -1;
+        }
+    }
+    if (node < 0)
+    {
+        return 0;
+    }
+
+    //Walk the subtree depth first.  Siblings are kept in order, so the names come out sorted.
+    memcpy(name, prefix, length);
+    completion_text.length = 0;
+    completion_count = 0;
+    if (path_trie[node].dirs)
+    {
+        name[length] = '\0';
+        completion_add(name);
+    }
+    stack[depth] = path_trie[node].child;
+    while (depth >= 0)
+    {
+        int n = stack[depth];
+        if (n < 0)
+        {
+            if (--depth >= 0)
+            {
+                stack[depth] = path_trie[stack[depth]].sibling;
+            }
+            continue;
+        }
+        name[length + depth] = path_trie[n].c;
+        if (path_trie[n].dirs)
+        {
+            name[length + depth + 1] = '\0';
+            completion_add(name);
+        }
+        if (path_trie[n].child >= 0 && length + depth + 2 < MAX_BUFFER_SIZE)
+        {
+            stack[++depth] = path_trie[n].child;
+        }
+        else
+        {
+            stack[depth] = path_trie[n].sibling;
+        }
+    }
+
+    //The names were copied into completion_text, which may have moved as it grew.
+    completion_count = 0;
+    for (size_t offset = 0; offset < completion_text.length; offset += strlen(completion_text.data + offset) + 1)
+    {
+        completion_matches[completion_count++] = completion_text.data + offset;
+    }
+    completion_suffix = ' ';
+    return completion_count;
+}
+
+/* Find the files in a directory starting with a prefix.  The word is a path, and only */
+/* the part after its last slash is matched.  Return the number of matches. */
+size_t complete_file(const char * word, size_t length)
+{
+    const char * slash = NULL;
+    const char * base = word;
+    const char * home = var_get("HOME");
+    size_t base_length;
+    char * path = NULL;
+    dir_cache * d;
+    size_t low, high, end;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        if (word[i] == '/')
+        {
+            slash = word + i;
+        }
+    }
+    if (slash)
+    {
+        base = slash + 1;
+    }
+    base_length = word + length - base;
+
+    if (!slash)
+    {
+        asprintf(&path, "%s/", var_get("PWD") ? var_get("PWD") : ".");
+    }
+    else if (word[0] == '/')
+    {
+        asprintf(&path, "%.*s", (int)(slash - word + 1), word);
+    }
+    else if (word[0] == '~' && word + 1 == slash && home)
+    {
+        asprintf(&path, "%s/", home);
+    }
+    else
+    {
+        asprintf(&path, "%s/%.*s", var_get("PWD") ? var_get("PWD") : ".", (int)(slash - word + 1), word);
+    }
+    d = dir_cache_get(path);
+    free(path);
+    completion_count = 0;
+    if (!d)
+    {
+        return 0;
+    }
+
+    //The entries are sorted, so the matches are a contiguous range found by binary search.
+    low = 0;
+    high = d->count;
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+        if (strncmp(d->names.data + d->entries[middle], base, base_length) < 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    end = d->count;
+    high = low;
+    while (high < end)
+    {
+        size_t middle = (high + end) / 2;
+        if (strncmp(d->names.data + d->entries[middle], base, base_length) == 0)
+        {
+            high = middle + 1;
+        }
+        else
+        {
+            end = middle;
+        }
+    }
+
+    if (completion_size < high - low)
+    {
+        completion_size = high - low;
+        completion_matches = (const char **)realloc(completion_matches, sizeof(char *) * completion_size);
+    }
+    for (size_t i = low; i < high; i++)
+    {
+        const char * name = d->names.data + d->entries[i];
+
+        //Hidden files are only offered once a dot has been typed.
+        if (name[0] != '.' || (base_length > 0 && base[0] == '.'))
+        {
+            completion_matches[completion_count++] = name;
+        }
+    }
+
+    completion_suffix = ' ';
+    if (completion_count == 1)
+    {
+        unsigned char type = completion_matches[0][-1];
+        struct stat st;
+        char * file = NULL;
+
+        if (type == DT_DIR)
+        {
+            completion_suffix = '/';
+        }
+        else if (type == DT_LNK || type == DT_UNKNOWN)
+        {
+            asprintf(&file, "%s%s", d->path, completion_matches[0]);
+            if (stat(file, &st) == 0 && S_ISDIR(st.st_mode))
+            {
+                completion_suffix = '/';
+            }
+            free(file);
+        }
+    }
+    return completion_count;
+}
+
+/* Find the completions of the word ending at the cursor.  Commands are completed in */
+/* command position and file names elsewhere.  Return the number of matches and set */
+/* start to the offset of the text the matches replace. */
+size_t complete_line(const char * line, size_t cursor, size_t * start)
+{
+    size_t word = cursor;
+    size_t before;
+
+    while (word > 0 && !isspace((unsigned char)line[word - 1]))
+    {
+        word--;
+    }
+    for (before = word; before > 0 && isspace((unsigned char)line[before - 1]); before--);
+    *start = word;
+    for (size_t i = word; i < cursor; i++)
+    {
+        if (line[i] == '/')
+        {
+            *start = i + 1;
+        }
+    }
+
+    if ((before == 0 || line[before - 1] == '|') && *start == word)
+    {
+        return complete_command(line + word, cursor - word);
+    }
+    return complete_file(line + word, cursor - word);
+}
+
+/* Add a command name to the completion matches. */
+void completion_add(const char * name)
+{
+    buffer_append(&completion_text, name, strlen(name) + 1);
+    if (completion_count == completion_size)
+    {
+        completion_size = completion_size ? completion_size * 2 : 64;
+        completion_matches = (const char **)realloc(completion_matches, sizeof(char *) * completion_size);
+    }
+    completion_count++;
+}
+
+/* Return the cached listing of a directory, reading it if it has changed since it was */
+/* last read.  Return NULL if the directory cannot be read. */
+dir_cache * dir_cache_get(const char * path)
+{
+    dir_cache ** link = &dir_caches;
+    dir_cache * d;
+    size_t count = 0;
+
+    dir_cache_invalidate();
+    for (d = dir_caches; d && strcmp(d->path, path); d = d->next)
+    {
+        link = &d->next;
+        count++;
+    }
+    if (d)
+    {
+        *link = d->next;
+    }
+    else
+    {
+        //Evict the least recently used directory once the cache is full.
+        if (count >= DIR_CACHE_MAX)
+        {
+            dir_cache ** last = &dir_caches;
+            while ((*last)->next)
+            {
+                last = &(*last)->next;
+            }
+            if ((*last)->watch >= 0)
+            {
+                inotify_rm_watch(inotify_fd, (*last)->watch);
+            }
+            free((*last)->path);
+            free((*last)->names.data);
+            free((*last)->entries);
+            free(*last);
+            *last = NULL;
+        }
+        d = (dir_cache *)calloc(1, sizeof(dir_cache));
+        d->path = strdup(path);
+        d->watch = -1;
+    }
+    d->next = dir_caches;
+    dir_caches = d;
+
+    //Without a watch there is no way to tell whether the directory has changed.
+    if ((!d->valid || d->watch < 0) && dir_cache_load(d) < 0)
+    {
+        return NULL;
+    }
+    return d;
+}
+
+/* Apply the changes inotify reports to the cached directories.  Files created, */
+/* deleted or renamed are added to or removed from the listing in place; any other */
+/* change means the directory has to be read again. */
+void dir_cache_invalidate(void)
+{
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+
+    if (inotify_fd == -2)
+    {
+        inotify_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    }
+    while (inotify_fd >= 0 && (length = read(inotify_fd, events, sizeof(events))) > 0)
+    {
+        for (char * e = events; e < events + length; e += sizeof(struct inotify_event) + ((struct inotify_event *)e)->len)
+        {
+            struct inotify_event * event = (struct inotify_event *)e;
+            for (dir_cache * d = dir_caches; d; d = d->next)
+            {
+                if (event->mask & IN_Q_OVERFLOW)
+                {
+                    d->valid = 0;
+                }
+                else if (d->watch != event->wd || !d->valid)
+                {
+                    continue;
+                }
+                else if (event->len && (event->mask & (IN_CREATE|IN_MOVED_TO)))
+                {
+                    dir_cache_update(d, event->name, 1);
+                }
+                else if (event->len && (event->mask & (IN_DELETE|IN_MOVED_FROM)))
+                {
+                    dir_cache_update(d, event->name, 0);
+                }
+                else
+                {
+                    d->valid = 0;
+                    if (event->mask & IN_IGNORED)
+                    {
+                        d->watch = -1;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* Read a directory into its cache entry with getdents64 and sort it. */
+/* Return 0 on success, -1 if the directory cannot be read. */
+int dir_cache_load(dir_cache * d)
+{
+    char entries[65536] __attribute__((aligned(8)));
+    int fd = open(d->path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    long length;
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    //Watch before reading, so a change made while reading is not missed.
+    if (d->watch < 0 && inotify_fd >= 0)
+    {
+        d->watch = inotify_add_watch(inotify_fd, d->path,
+            IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR);
+    }
+    d->valid = 1;
+    d->names.length = 0;
+    d->count = 0;
+    while ((length = syscall(SYS_getdents64, fd, entries, sizeof(entries))) > 0)
+    {
+        for (long offset = 0; offset < length; offset += ((linux_dirent64 *)(entries + offset))->d_reclen)
+        {
+            linux_dirent64 * entry = (linux_dirent64 *)(entries + offset);
+            size_t name_length = strlen(entry->d_name);
+
+            if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            {
+                continue;
+            }
+            if (d->count == d->size)
+            {
+                d->size = d->size ? d->size * 2 : 256;
+                d->entries = (unsigned int *)realloc(d->entries, sizeof(unsigned int) * d->size);
+            }
+            buffer_append(&d->names, (char *)&entry->d_type, 1);
+            d->entries[d->count++] = d->names.length;
+            buffer_append(&d->names, entry->d_name, name_length + 1);
+        }
+    }
+    close(fd);
+    qsort_r(d->entries, d->count, sizeof(unsigned int), compare_dir_entries, d->names.data);
+    return 0;
+}
+
+/* Add a file to or remove it from a cached listing, keeping the entries sorted. */
+void dir_cache_update(dir_cache * d, const char * name, int add)
+{
+    size_t low = 0;
+    size_t high = d->count;
+    unsigned char type = DT_UNKNOWN;
+
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+        if (strcmp(d->names.data + d->entries[middle], name) < 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    if (low < d->count && !strcmp(d->names.data + d->entries[low], name))
+    {
+        //Removed names stay in the names buffer until the directory is next read.
+        if (!add)
+        {
+            memmove(d->entries + low, d->entries + low + 1, sizeof(unsigned int) * (d->count - low - 1));
+            d->count--;
+        }
+        return;
+    }
+    if (!add)
+    {
+        return;
+    }
+    if (d->count == d->size)
+    {
+        d->size = d->size ? d->size * 2 : 256;
+        d->entries = (unsigned int *)realloc(d->entries, sizeof(unsigned int) * d->size);
+    }
+    memmove(d->entries + low + 1, d->entries + low, sizeof(unsigned int) * (d->count - low));
+    buffer_append(&d->names, (char *)&type, 1);
+    d->entries[low] = d->names.length;
+    buffer_append(&d->names, name, strlen(name) + 1);
+    d->count++;
+}
+
+/* Run a command, searching the shell's PATH for it, with the given environment. */
+/* Only returns if the command could not be run, with errno set. */
+void exec_command(char ** argv, char ** envp)
+{
+    const char * path = var_get("PATH");
+    char candidate[MAX_BUFFER_SIZE * 4];
+    int saved_errno = ENOENT;
+
+    if (strchr(argv[0], '/') || !path)
+    {
+        execve(argv[0], argv, envp);
+        return;
+    }
+    while (1)
+    {
+        const char * end = strchr(path, ':');
+        size_t length = end ? (size_t)(end - path) : strlen(path);
+
+        //An empty entry in PATH means the current directory.
+        if (length + strlen(argv[0]) + 2 < sizeof(candidate))
+        {
+            memcpy(candidate, path, length);
+            candidate[length] = '/';
+            strcpy(candidate + length + 1, argv[0]);
+            execve(length ? candidate : argv[0], argv, envp);
+            if (errno != ENOENT && errno != ENOTDIR)
+            {
+                saved_errno = errno;
+            }
+        }
+        if (!end)
+        {
+            break;
+        }
+        path = end + 1;
+    }
+    errno = saved_errno;
+}
+
+/* Complete the word at the cursor.  A single match is inserted in full; otherwise the */
+/* text common to all the matches is inserted, and a second Tab lists them. */
+void editor_complete(void)
+{
+    size_t start;
+    size_t count = complete_line(editor.line.data, editor.cursor, &start);
+    size_t typed = editor.cursor - start;
+    size_t common;
+
+    if (count == 0)
+    {
+        write(STDOUT_FILENO, "\a", 1);
+        return;
+    }
+    common = strlen(completion_matches[0]);
+    if (count > 1)
+    {
+        const char * last = completion_matches[count - 1];
+        size_t i = 0;
+        while (i < common && completion_matches[0][i] == last[i])
+        {
+            i++;
+        }
+        common = i;
+    }
+    if (common > typed)
+    {
+        editor_insert(completion_matches[0] + typed, common - typed);
+    }
+    if (count == 1)
+    {
+        if (editor.cursor == editor.line.length || editor.line.data[editor.cursor] != completion_suffix)
+        {
+            editor_insert(&completion_suffix, 1);
+        }
+        else
+        {
+            editor.cursor++;
+        }
+        return;
+    }
+
+    if (common == typed && editor.tabs >= 2)
+    {
+        buffer out = {NULL, 0, 0};
+        char more[64];
+
+        buffer_append(&out, "\n", 1);
+        for (size_t i = 0; i < count && i < COMPLETION_LIST_MAX; i++)
+        {
+            buffer_append(&out, completion_matches[i], strlen(completion_matches[i]));
+            buffer_append(&out, "  ", 2);
+        }
+        if (count > COMPLETION_LIST_MAX)
+        {
+            buffer_append(&out, more, snprintf(more, sizeof(more), "... and %zu more", count - COMPLETION_LIST_MAX));
+        }
+        buffer_append(&out, "\n", 1);
+        write(STDOUT_FILENO, out.data, out.length);
+        free(out.data);
+    }
+    else if (common == typed)
+    {
+        write(STDOUT_FILENO, "\a", 1);
+    }
+}
+
+/* Insert text at the cursor. */
+void editor_insert(const char * text, size_t length)
+{
+    buffer_reserve(&editor.line, length);
+    memmove(editor.line.data + editor.cursor + length, editor.line.data + editor.cursor,
+        editor.line.length - editor.cursor + 1);
+    memcpy(editor.line.data + editor.cursor, text, length);
+    editor.line.length += length;
+    editor.cursor += length;
+}
+
+/* Clear the line being edited, if a line is being edited, so that a message can be */
+/* printed in its place.  The line is redrawn below the message once it is printed. */
+void editor_interrupt(void)
+{
+    if (editor.active && !editor.interrupted)
+    {
+        write(STDOUT_FILENO, "\r\033[K", 4);
+        editor.interrupted = 1;
+    }
+}
+
+/* Redraw the prompt and line, scrolling the line horizontally if it is wider than the terminal. */
+void editor_refresh(void)
+{
+    buffer out = {NULL, 0, 0};
+    struct winsize ws;
+    size_t columns = 80;
+    size_t start = 0;
+    size_t prompt_length;
+    const char * prompt = editor.prompt;
+    char search_prompt[MAX_BUFFER_SIZE];
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+    {
+        columns = ws.ws_col;
+    }
+    if (editor.searching)
+    {
+        snprintf(search_prompt, sizeof(search_prompt), "(%sreverse-i-search)`%s': ",
+            editor.match < 0 && editor.query.length ? "failing " : "", editor.query.data ? editor.query.data : "");
+        prompt = search_prompt;
+    }
+    prompt_length = strlen(prompt);
+    if (prompt_length + 1 >= columns)
+    {
+        prompt_length = 0;
+        prompt = "";
+    }
+    while (prompt_length + editor.cursor - start + 1 >= columns)
+    {
+        start++;
+    }
+
+    buffer_append(&out, "\r", 1);
+    buffer_append(&out, prompt, prompt_length);
+    buffer_append(&out, editor.line.data + start,
+        editor.line.length - start < columns - prompt_length - 1 ? editor.line.length - start : columns - prompt_length - 1);
+    buffer_append(&out, "\033[K\r", 4);
+    if (prompt_length + editor.cursor - start > 0)
+    {
+        char move[32];
+        int length = snprintf(move, sizeof(move), "\033[%zuC", prompt_length + editor.cursor - start);
+        buffer_append(&out, move, length);
+    }
+    write(STDOUT_FILENO, out.data, out.length);
+    free(out.data);
+}
+
+/* Handle a key during reverse search.  Keys that do not edit the query end the search. */
+void editor_search_key(int key)
+{
+    long from = editor.match >= 0 ? editor.match : (long)history_count;
+
+    if (key == 18)                                      // Ctrl-R: look for an older match
+    {
+        from = editor.match >= 0 ? editor.match : (long)history_count;
+    }
+    else if (key == 127 || key == 8)                    // Backspace: shorten the query
+    {
+        if (editor.query.length > 0)
+        {
+            editor.query.data[--editor.query.length] = '\0';
+        }
+        from = history_count;
+    }
+    else if (key >= 32 && key < 256)                    // Printable: extend the query
+    {
+        char c = (char)key;
+        buffer_append(&editor.query, &c, 1);
+        from = editor.match >= 0 ? editor.match + 1 : (long)history_count;
+    }
+    else
+    {
+        editor.searching = 0;
+        return;
+    }
+
+    if (editor.query.length == 0)
+    {
+        editor.match = -1;
+        return;
+    }
+    editor.match = history_search(editor.query.data ? editor.query.data : "", editor.query.length, from);
+    if (editor.match >= 0)
+    {
+        const char * text = history_map + history_entries[editor.match].offset;
+        const char * found = (const char *)memmem(text, history_entries[editor.match].length,
+            editor.query.data, editor.query.length);
+
+        editor.line.length = 0;
+        buffer_append(&editor.line, text, history_entries[editor.match].length);
+        editor.cursor = found ? (size_t)(found - text) : 0;
+    }
+}
+
+/* Replace the line with a history entry, or an empty line if index is history_count. */
+void editor_show_history(size_t index)
+{
+    editor.history_index = index;
+    editor.line.length = 0;
+    buffer_reserve(&editor.line, 0);
+    editor.line.data[0] = '\0';
+    if (index < history_count)
+    {
+        buffer_append(&editor.line, history_map + history_entries[index].offset, history_entries[index].length);
+    }
+    editor.cursor = editor.line.length;
+}
+
+/* Return the number of seconds between two points in time. */
+double elapsed(struct timespec * start, struct timespec * end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Sum the resource usage of the job's completed processes. */
+/* The maximum resident set size is the largest of any process rather than a sum. */
+void job_usage(job * j, struct rusage * ru, double * wall)
+{
+    struct timespec * first = NULL;
+    struct timespec * last = NULL;
+
+    memset(ru, 0, sizeof(*ru));
+    for (process * p = j->first_process; p; p = p->next)
+    {
+        if (!p->completed)
+        {
+            continue;
+        }
+        timeradd(&ru->ru_utime, &p->usage.ru_utime, &ru->ru_utime);
+        timeradd(&ru->ru_stime, &p->usage.ru_stime, &ru->ru_stime);
+        if (p->usage.ru_maxrss > ru->ru_maxrss)
+        {
+            ru->ru_maxrss = p->usage.ru_maxrss;
+        }
+        ru->ru_nvcsw += p->usage.ru_nvcsw;
+        ru->ru_nivcsw += p->usage.ru_nivcsw;
+        if (!first || elapsed(&p->start, first) > 0)
+        {
+            first = &p->start;
+        }
+        if (!last || elapsed(last, &p->end) > 0)
+        {
+            last = &p->end;
+        }
+    }
+    *wall = first ? elapsed(first, last) : 0;
+}
+
+/* Continue a 64-bit FNV-1a hash over a block of bytes, starting from hash. */
+unsigned long long hash_bytes(const void * data, size_t length, unsigned long long hash)
+{
+    for (const unsigned char * c = (const unsigned char *)data; length > 0; c++, length--)
+    {
+        hash = (hash ^ *c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Return the 64-bit FNV-1a hash of a string. */
+unsigned long long hash_string(const char * str)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+
+    for (; *str; str++)
+    {
+        hash = (hash ^ (unsigned char)*str) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Expand the variables and command substitutions in a word, appending the result to a buffer. */
+/* Trailing newlines are removed from each substitution's output, and split is set to true */
+/* if the word contained a substitution.  Return 0 on success, -1 if the word is malformed */
+/* or a substitution fails. */
+int expand_word(const char * word, buffer * output, int * split)
+{
+    const char * c = word;
+
+    while (*c)
+    {
+        const char * end;
+        char * name;
+        int depth = 1;
+
+        //The exit status of the last foreground command, written as $?.
+        if (c[0] == '$' && c[1] == '?')
+        {
+            char status[16];
+            buffer_append(output, status, snprintf(status, sizeof(status), "%d", last_status));
+            c += 2;
+            continue;
+        }
+
+        //The arguments of the running function, written as $0 to $9, $# and $@.
+        if (c[0] == '$' && (isdigit((unsigned char)c[1]) || c[1] == '#' || c[1] == '@'))
+        {
+            if (c[1] == '#')
+            {
+                char count[16];
+                buffer_append(output, count, snprintf(count, sizeof(count), "%d",
+                    positional_count ? positional_count - 1 : 0));
+            }
+            else if (c[1] == '@')
+            {
+                for (int i = 1; i < positional_count; i++)
+                {
+                    if (i > 1)
+                    {
+                        buffer_append(output, " ", 1);
+                    }
+                    buffer_append(output, positional_args[i], strlen(positional_args[i]));
+                }
+                *split = 1;
+            }
+            else if (c[1] - '0' < positional_count)
+            {
+                buffer_append(output, positional_args[c[1] - '0'], strlen(positional_args[c[1] - '0']));
+            }
+            c += 2;
+            continue;
+        }
+
+        //Variables, written as $NAME or ${NAME}.
+        if (c[0] == '$' && (c[1] == '{' || c[1] == '_' || isalpha((unsigned char)c[1])))
+        {
+            char * value;
+
+            if (c[1] == '{')
+            {
+                if (!(end = strchr(c, '}')))
+                {
+                    puts("Malformed variable reference.");
+                    return -1;
+                }
+                name = strndup(c + 2, end - c - 2);
+                c = end + 1;
+            }
+            else
+            {
+                for (end = c + 1; *end == '_' || isalnum((unsigned char)*end); end++);
+                name = strndup(c + 1, end - c - 1);
+                c = end;
+            }
+            if ((value = var_get(name)))
+            {
+                buffer_append(output, value, strlen(value));
+            }
+            free(name);
+            continue;
+        }
+
+        //Process substitutions are expanded when their commands are parsed.
+        if ((c[0] == '<' || c[0] == '>') && c[1] == '(')
+        {
+            for (end = c + 2; *end && depth > 0; end++)
+            {
+                depth += (*end == '(') - (*end == ')');
+            }
+            buffer_append(output, c, end - c);
+            c = end;
+            continue;
+        }
+
+        if (c[0] != '$' || c[1] != '(')
+        {
+            buffer_append(output, c, 1);
+            c++;
+            continue;
+        }
+
+        //Command substitutions, written as $(command).
+        for (end = c + 2; *end && depth > 0; end++)
+        {
+            depth += (*end == '(') - (*end == ')');
+        }
+        if (depth > 0)
+        {
+            puts("Malformed command substitution.");
+            return -1;
+        }
+        name = strndup(c + 2, end - c - 3);
+        if (capture_output(name, output) < 0)
+        {
+            free(name);
+            return -1;
+        }
+        free(name);
+        while (output->length > 0 && output->data[output->length - 1] == '\n')
+        {
+            output->data[--output->length] = '\0';
+        }
+        *split = 1;
+        c = end;
+    }
+    return 0;
+}
+
+/* Expand a NULL terminated array of tokens into a new array of arguments. */
+/* Words containing command substitutions are split on whitespace after expansion, and */
+/* words that expand to nothing are removed. */
+/* Return the arguments, to be freed with free_words(), or NULL if expansion failed. */
+char ** expand_words(char ** words)
+{
+    size_t size = 16;
+    size_t count = 0;
+    char ** cmd_args = (char **)malloc(sizeof(char *) * size);
+
+    for (; *words; words++)
+    {
+        buffer expanded = {NULL, 0, 0};
+        char * saveptr;
+        int split = 0;
+
+        if (!strchr(*words, '$'))
+        {
+            add_argument(&cmd_args, &count, &size, *words);
+            continue;
+        }
+        if (expand_word(*words, &expanded, &split) < 0)
+        {
+            free(expanded.data);
+            cmd_args[count] = NULL;
+            free_words(cmd_args);
+            return NULL;
+        }
+        buffer_reserve(&expanded, 0);
+        split = split && !heredoc_body(*words);
+        for (char * field = split ? strtok_r(expanded.data, DELIMITERS, &saveptr) : expanded.data;
+            field && *field; field = split ? strtok_r(NULL, DELIMITERS, &saveptr) : NULL)
+        {
+            add_argument(&cmd_args, &count, &size, field);
+        }
+        free(expanded.data);
+    }
+    cmd_args[count] = NULL;
+    return cmd_args;
+}
+
+/* Free an array of arguments returned by expand_words(). */
+void free_words(char ** words)
+{
+    if (!words)
+    {
+        return;
+    }
+    for (char ** w = words; *w; w++)
+    {
+        free(*w);
+    }
+    free(words);
+}
+
+/* Call a function with the given arguments, which it sees as $0, $1 and so on. */
+void function_call(shell_function * f, char ** args)
+{
+    char ** saved_args = positional_args;
+    int saved_count = positional_count;
+
+    if (function_depth >= FUNCTION_DEPTH_MAX)
+    {
+        fprintf(stderr, "%s: Functions nested too deeply.\n", f->name);
+        last_status = 1;
+        return;
+    }
+    positional_args = args;
+    for (positional_count = 0; args[positional_count]; positional_count++);
+    function_depth++;
+    last_status = 0;
+    ast_run(f->body);
+    function_depth--;
+    positional_args = saved_args;
+    positional_count = saved_count;
+}
+
+/* Define a function, replacing any function with the same name. */
+void function_define(const char * name, ast_node * body)
+{
+    shell_function * f = function_find(name);
+
+    if (!f)
+    {
+        size_t bucket;
+
+        //Keep the average chain length at most one, as a startup file may define hundreds.
+        if (function_count + 1 > function_buckets)
+        {
+            size_t buckets = function_buckets ? function_buckets * 2 : 64;
+            shell_function ** table = (shell_function **)calloc(buckets, sizeof(shell_function *));
+
+            for (size_t i = 0; i < function_buckets; i++)
+            {
+                while (function_table[i])
+                {
+                    shell_function * moved = function_table[i];
+                    bucket = hash_string(moved->name) & (buckets - 1);
+                    function_table[i] = moved->next;
+                    moved->next = table[bucket];
+                    table[bucket] = moved;
+                }
+            }
+            free(function_table);
+            function_table = table;
+            function_buckets = buckets;
+        }
+        bucket = hash_string(name) & (function_buckets - 1);
+        f = (shell_function *)malloc(sizeof(shell_function));
+        f->name = strdup(name);
+        f->next = function_table[bucket];
+        function_table[bucket] = f;
+        function_count++;
+    }
+    f->body = body;
+}
+
+/* Find the function with the given name, or return NULL. */
+shell_function * function_find(const char * name)
+{
+    if (!function_count)
+    {
+        return NULL;
+    }
+    for (shell_function * f = function_table[hash_string(name) & (function_buckets - 1)]; f; f = f->next)
+    {
+        if (!strcmp(f->name, name))
+        {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+/* Wait for a job whose output has been captured once its output has ended.  A job */
+/* stopped with Ctrl-Z is handed over to normal job control.  Return true if the job */
+/* has completed, in which case the caller frees it. */
+int finish_capture(job * j)
+{
+    if (job_is_completed(j))
+    {
+        last_status = job_exit_status(j);
+    }
+    else if (!shell_is_interactive)
+    {
+        wait_for_job(j);
+    }
+    else if (job_is_stopped(j))
+    {
+        tcsetpgrp(shell_terminal, shell_pgid);
+        tcgetattr(shell_terminal, &j->tmodes);
+        tcsetattr(shell_terminal, TCSADRAIN, &shell_tmodes);
+    }
+    else
+    {
+        put_job_in_foreground(j, 0);
+    }
+    if (!job_is_completed(j))
+    {
+        j->capture = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/* Add matches found by one thread to the results of a glob walk. */
+void glob_add_matches(glob_walk * w, char ** matches, size_t count)
+{
+    pthread_mutex_lock(&w->lock);
+    if (w->match_count + count > w->match_size)
+    {
+        while (w->match_count + count > w->match_size)
+        {
+            w->match_size = w->match_size ? w->match_size * 2 : 64;
+        }
+        w->matches = (char **)realloc(w->matches, sizeof(char *) * w->match_size);
+    }
+    memcpy(w->matches + w->match_count, matches, sizeof(char *) * count);
+    w->match_count += count;
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* Expand a glob pattern into the paths it matches, sorted, in a new array of strings */
+/* to be freed by the caller.  Patterns containing ** are walked by several threads. */
+/* Return the number of matches. */
+size_t glob_expand(const char * pattern, char *** matches)
+{
+    glob_walk w;
+    char * copy = strdup(pattern);
+    char * saveptr;
+    int threads = 1;
+    pthread_t workers[GLOB_THREADS_MAX];
+
+    memset(&w, 0, sizeof(w));
+    w.components = (char **)malloc(sizeof(char *) * (strlen(pattern) / 2 + 2));
+    w.dirs_only = pattern[strlen(pattern) - 1] == '/';
+    for (char * c = strtok_r(copy, "/", &saveptr); c; c = strtok_r(NULL, "/", &saveptr))
+    {
+        w.components[w.count++] = c;
+        if (!strcmp(c, "**"))
+        {
+            threads = GLOB_THREADS_MAX;
+        }
+    }
+    if (w.count == 0)
+    {
+        free(w.components);
+        free(copy);
+        return 0;
+    }
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.ready, NULL);
+    glob_push(&w, strdup(pattern[0] == '/' ? "/" : ""), 0);
+
+    //Recursive patterns can visit thousands of directories, so read them in parallel.
+    if (threads > 1 && sysconf(_SC_NPROCESSORS_ONLN) < threads)
+    {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    for (int i = 1; i < threads; i++)
+    {
+        if (pthread_create(&workers[i], NULL, glob_worker, &w) != 0)
+        {
+            threads = i;
+            break;
+        }
+    }
+    glob_worker(&w);
+    for (int i = 1; i < threads; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+
+    string_sort(w.matches, w.match_count, 0);
+    pthread_mutex_destroy(&w.lock);
+    pthread_cond_destroy(&w.ready);
+    free(w.queue);
+    free(w.components);
+    free(copy);
+    *matches = w.matches;
+    return w.match_count;
+}
+
+/* Return true if a word contains an unescaped glob character. */
+int glob_has_magic(const char * word)
+{
+    for (; *word; word++)
+    {
+        if (*word == '\\' && word[1])
+        {
+            word++;
+        }
+        else if (*word == '*' || *word == '?' || *word == '[')
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Return true if a name matches a pattern of *, ?, [...] and \-escaped characters. */
+int glob_match(const char * pattern, const char * name)
+{
+    const char * star = NULL;
+    const char * resume = NULL;
+
+    while (*name)
+    {
+        if (*pattern == '*')
+        {
+            //Remember the star, and on a mismatch later let it absorb one more character.
+            star = ++pattern;
+            resume = name;
+            continue;
+        }
+        if (*pattern == '[')
+        {
+            const char * p = pattern + 1;
+            int negate = *p == '!' || *p == '^';
+            int found = 0;
+
+            if (negate)
+            {
+                p++;
+            }
+            //A "]" straight after the "[" is one of the characters, not the end.
+            while (*p)
+            {
+                unsigned char low = *p == '\\' && p[1] ? *++p : *p;
+                unsigned char high = low;
+                if (p[1] == '-' && p[2] && p[2] != ']')
+                {
+                    p += 2;
+                    high = *p == '\\' && p[1] ? *++p : *p;
+                }
+                if ((unsigned char)*name >= low && (unsigned char)*name <= high)
+                {
+                    found = 1;
+                }
+                p++;
+                if (*p == ']')
+                {
+                    break;
+                }
+            }
+            if (*p == ']' && found != negate)
+            {
+                pattern = p + 1;
+                name++;
+                continue;
+            }
+            if (*p != ']' && *name == '[')
+            {
+                //An unterminated bracket is an ordinary character.
+                pattern++;
+                name++;
+                continue;
+            }
+        }
+        else if (*pattern == '?' || (*pattern == '\\' && pattern[1] == *name)
+            || (*pattern != '\\' && *pattern == *name))
+        {
+            pattern += *pattern == '\\' ? 2 : 1;
+            name++;
+            continue;
+        }
+        if (!star)
+        {
+            return 0;
+        }
+        pattern = star;
+        name = ++resume;
+    }
+    while (*pattern == '*')
+    {
+        pattern++;
+    }
+    return *pattern == '\0';
+}
+
+/* Queue a directory to be matched against a pattern component, taking ownership of path. */
+void glob_push(glob_walk * w, char * path, int component)
+{
+    pthread_mutex_lock(&w->lock);
+    if (w->queued == w->queue_size)
+    {
+        w->queue_size = w->queue_size ? w->queue_size * 2 : 64;
+        w->queue = (glob_dir *)realloc(w->queue, sizeof(glob_dir) * w->queue_size);
+    }
+    w->queue[w->queued].path = path;
+    w->queue[w->queued].component = component;
+    w->queued++;
+    pthread_cond_signal(&w->ready);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* Match the entries of a directory against a pattern component, queueing the */
+/* subdirectories that later components have to be matched in.  The entries are */
+/* matched in place in the getdents64 buffer without being copied.  For ** the */
+/* component after it is matched in the same pass, so each directory is read once. */
+void glob_read_dir(glob_walk * w, glob_dir * d)
+{
+    int recursive = !strcmp(w->components[d->component], "**");
+    int next = recursive ? d->component + 1 : d->component;
+    const char * component = next < w->count ? w->components[next] : NULL;
+    size_t path_length = strlen(d->path);
+    char ** found = NULL;
+    size_t found_count = 0;
+    size_t found_size = 0;
+    char entries[65536] __attribute__((aligned(8)));
+    long length;
+    int fd;
+
+    //A component without glob characters only needs to exist, so avoid reading the directory.
+    if (component && !glob_has_magic(component))
+    {
+        struct stat st;
+        int last = next == w->count - 1;
+        char * path = (char *)malloc(path_length + strlen(component) + 2);
+        size_t n = path_length;
+
+        memcpy(path, d->path, path_length);
+        for (const char * c = component; *c; c++)
+        {
+            if (*c == '\\' && c[1])
+            {
+                c++;
+            }
+            path[n++] = *c;
+        }
+        path[n] = '\0';
+        if (!last)
+        {
+            strcpy(path + n, "/");
+            glob_push(w, path, next + 1);
+        }
+        else if (lstat(path, &st) == 0 && (!w->dirs_only || (stat(path, &st) == 0 && S_ISDIR(st.st_mode))))
+        {
+            if (w->dirs_only)
+            {
+                strcpy(path + n, "/");
+            }
+            glob_add_matches(w, &path, 1);
+        }
+        else
+        {
+            free(path);
+        }
+        if (!recursive)
+        {
+            return;
+        }
+        component = NULL;
+    }
+
+    fd = open(path_length ? d->path : ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (fd < 0)
+    {
+        return;
+    }
+    while ((length = syscall(SYS_getdents64, fd, entries, sizeof(entries))) > 0)
+    {
+        for (long offset = 0; offset < length; offset += ((linux_dirent64 *)(entries + offset))->d_reclen)
+        {
+            linux_dirent64 * entry = (linux_dirent64 *)(entries + offset);
+            const char * name = entry->d_name;
+            size_t name_length;
+            int descend, matched;
+            struct stat st;
+
+            //Hidden files only match a component that starts with a dot, and ** never matches them.
+            if (name[0] == '.' && (!component || component[0] != '.' || !strcmp(name, ".") || !strcmp(name, "..")))
+            {
+                continue;
+            }
+            descend = recursive && name[0] != '.' && (entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN
+                && fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)));
+            matched = recursive && name[0] != '.' && next == w->count;
+            if (!matched && component && glob_match(component, name))
+            {
+                matched = next == w->count - 1 ? 1 : 2;
+            }
+
+            //Later components and trailing slashes only match directories, following symbolic links.
+            if ((matched == 2 || (matched && w->dirs_only)) && entry->d_type != DT_DIR
+                && ((entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN)
+                    || fstatat(fd, name, &st, 0) < 0 || !S_ISDIR(st.st_mode)))
+            {
+                matched = 0;
+            }
+            if (!descend && !matched)
+            {
+                continue;
+            }
+
+            name_length = strlen(name);
+            if (descend)
+            {
+                char * sub = (char *)malloc(path_length + name_length + 2);
+                memcpy(sub, d->path, path_length);
+                memcpy(sub + path_length, name, name_length);
+                strcpy(sub + path_length + name_length, "/");
+                glob_push(w, sub, d->component);
+            }
+            if (matched)
+            {
+                char * path = (char *)malloc(path_length + name_length + 2);
+                memcpy(path, d->path, path_length);
+                memcpy(path + path_length, name, name_length + 1);
+                if (matched == 2)
+                {
+                    strcat(path, "/");
+                    glob_push(w, path, next + 1);
+                    continue;
+                }
+                if (w->dirs_only)
+                {
+                    strcat(path, "/");
+                }
+                if (found_count == found_size)
+                {
+                    found_size = found_size ? found_size * 2 : 64;
+                    found = (char **)realloc(found, sizeof(char *) * found_size);
+                }
+                found[found_count++] = path;
+            }
+        }
+    }
+    close(fd);
+    if (found_count)
+    {
+        glob_add_matches(w, found, found_count);
+    }
+    free(found);
+}
+
+/* Take directories from the queue of a glob walk until it is empty and no other */
+/* thread is reading a directory that could add to it. */
+void * glob_worker(void * arg)
+{
+    glob_walk * w = (glob_walk *)arg;
+
+    pthread_mutex_lock(&w->lock);
+    while (1)
+    {
+        glob_dir d;
+
+        while (w->queued == 0 && w->active > 0)
+        {
+            pthread_cond_wait(&w->ready, &w->lock);
+        }
+        if (w->queued == 0)
+        {
+            break;
+        }
+        d = w->queue[--w->queued];
+        w->active++;
+        pthread_mutex_unlock(&w->lock);
+        glob_read_dir(w, &d);
+        free(d.path);
+        pthread_mutex_lock(&w->lock);
+        w->active--;
+    }
+    pthread_cond_broadcast(&w->ready);
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/* Append a command to the history file and index it.  Empty commands and */
+/* repeats of the previous command are not recorded. */
+void history_add(const char * line)
+{
+    size_t length = strlen(line);
+    struct iovec iov[2] = {{(void *)line, length}, {"\n", 1}};
+
+    if (history_fd < 0 || length == 0 || strchr(line, '\n'))
+    {
+        return;
+    }
+    history_sync();
+    if (history_count > 0 && history_entries[history_count - 1].length == length
+        && !memcmp(history_map + history_entries[history_count - 1].offset, line, length))
+    {
+        return;
+    }
+
+    //A single append is atomic, so other shells sharing the file never see half a command.
+    if (writev(history_fd, iov, 2) < 0)
+    {
+        perror("history");
+        return;
+    }
+    history_sync();
+}
+
+/* Add up to count of the history entries that are not yet in the trigram index. */
+void history_index(size_t count)
+{
+    for (; history_indexed < history_count && count > 0; history_indexed++, count--)
+    {
+        const unsigned char * text = (const unsigned char *)history_map + history_entries[history_indexed].offset;
+        unsigned int length = history_entries[history_indexed].length;
+
+        for (unsigned int i = 0; i + 3 <= length; i++)
+        {
+            trigram_list * list = history_trigram((text[i] << 16) | (text[i + 1] << 8) | text[i + 2], 1);
+            if (list->count > 0 && list->ids[list->count - 1] == history_indexed)
+            {
+                continue;
+            }
+            if (list->count == list->size)
+            {
+                list->size = list->size ? list->size * 2 : 4;
+                list->ids = (unsigned int *)realloc(list->ids, sizeof(unsigned int) * list->size);
+            }
+            list->ids[list->count++] = (unsigned int)history_indexed;
+        }
+    }
+}
+
+/* Open the history file named by CSHELL_HISTFILE, or ~/.cshell_history by default. */
+void history_init(void)
+{
+    char * path = var_get("CSHELL_HISTFILE");
+    char * home = var_get("HOME");
+    char * default_path = NULL;
+
+    if (!path && home)
+    {
+        asprintf(&default_path, "%s/.cshell_history", home);
+        path = default_path;
+    }
+    if (path)
+    {
+        history_fd = open(path, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0600);
+    }
+    free(default_path);
+    history_sync();
+}
+
+/* Find the newest history entry older than before that contains the query. */
+/* Queries of three or more bytes only check the entries in the posting list of */
+/* their rarest trigram.  Return the entry, or -1 if there is none. */
+long history_search(const char * query, size_t length, long before)
+{
+    trigram_list * rarest = NULL;
+    long i;
+
+    history_sync();
+    if (before > (long)history_count)
+    {
+        before = history_count;
+    }
+    if (length < 3)
+    {
+        for (i = before - 1; i >= 0; i--)
+        {
+            if (memmem(history_map + history_entries[i].offset, history_entries[i].length, query, length))
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    //The newest entries may not have been indexed yet.  They lie one after another in the
+    //file, so they are searched a block of entries at a time, newest block first.
+    while (before > (long)history_indexed)
+    {
+        long start = before - HISTORY_INDEX_BATCH > (long)history_indexed ? before - HISTORY_INDEX_BATCH : (long)history_indexed;
+        const char * block = history_map + history_entries[start].offset;
+        const char * end = history_map + history_entries[before - 1].offset + history_entries[before - 1].length;
+        const char * match = NULL;
+
+        for (const char * c = block; (c = (const char *)memmem(c, end - c, query, length)); c++)
+        {
+            match = c;
+        }
+        if (match)
+        {
+            //Entries never contain a newline, so the match lies within the last entry
+            //starting at or before it.
+            long low = start;
+            long high = before - 1;
+            while (low < high)
+            {
+                long middle = (low + high + 1) / 2;
+                if (history_map + history_entries[middle].offset <= match)
+                {
+                    low = middle;
+                }
+                else
+                {
+                    high = middle - 1;
+                }
+            }
+            return low;
+        }
+        before = start;
+    }
+    for (size_t k = 0; k + 3 <= length; k++)
+    {
+        const unsigned char * q = (const unsigned char *)query + k;
+        trigram_list * list = history_trigram((q[0] << 16) | (q[1] << 8) | q[2], 0);
+        if (!list)
+        {
+            return -1;
+        }
+        if (!rarest || list->count < rarest->count)
+        {
+            rarest = list;
+        }
+    }
+
+    //Find the newest candidate older than before, then check candidates from newest to oldest.
+    long low = 0;
+    long high = rarest->count;
+    while (low < high)
+    {
+        long middle = (low + high) / 2;
+        if ((long)rarest->ids[middle] < before)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    for (i = low - 1; i >= 0; i--)
+    {
+        history_entry * e = &history_entries[rarest->ids[i]];
+        if (memmem(history_map + e->offset, e->length, query, length))
+        {
+            return rarest->ids[i];
+        }
+    }
+    return -1;
+}
+
+/* Map any commands appended to the history file since the last call, including */
+/* those appended by other shells, and split them into entries. */
+void history_sync(void)
+{
+    struct stat st;
+    char * end;
+
+    if (history_fd < 0 || fstat(history_fd, &st) < 0 || (size_t)st.st_size <= history_mapped)
+    {
+        return;
+    }
+    if (history_map)
+    {
+        char * map = (char *)mremap(history_map, history_mapped, st.st_size, MREMAP_MAYMOVE);
+        if (map == MAP_FAILED)
+        {
+            return;
+        }
+        history_map = map;
+    }
+    else
+    {
+        history_map = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history_fd, 0);
+        if (history_map == MAP_FAILED)
+        {
+            history_map = NULL;
+            return;
+        }
+    }
+    history_mapped = st.st_size;
+
+    //Only split up to the last newline, in case another shell is part way through an append.
+    end = history_map + history_mapped;
+    while (end > history_map + history_scanned && end[-1] != '\n')
+    {
+        end--;
+    }
+    for (char * c = history_map + history_scanned; c < end;)
+    {
+        char * newline = (char *)memchr(c, '\n', end - c);
+        if (newline > c)
+        {
+            if (history_count == history_size)
+            {
+                history_size = history_size ? history_size * 2 : 1024;
+                history_entries = (history_entry *)realloc(history_entries, sizeof(history_entry) * history_size);
+            }
+            history_entries[history_count].offset = c - history_map;
+            history_entries[history_count].length = newline - c;
+            history_count++;
+        }
+        c = newline + 1;
+    }
+    history_scanned = end - history_map;
+}
+
+/* Return the posting list of a trigram, or NULL if it has none and create is false. */
+trigram_list * history_trigram(unsigned int trigram, int create)
+{
+    size_t slot;
+
+    //Keep the table at most half full so probes stay short.
+    if (create && 2 * (trigram_used + 1) > trigram_size)
+    {
+        trigram_list * old = trigram_table;
+        size_t old_size = trigram_size;
+
+        trigram_size = trigram_size ? trigram_size * 2 : 4096;
+        trigram_table = (trigram_list *)calloc(trigram_size, sizeof(trigram_list));
+        for (size_t i = 0; i < old_size; i++)
+        {
+            if (old[i].key)
+            {
+                slot = ((old[i].key - 1) * 2654435761u) & (trigram_size - 1);
+                while (trigram_table[slot].key)
+                {
+                    slot = (slot + 1) & (trigram_size - 1);
+                }
+                trigram_table[slot] = old[i];
+            }
+        }
+        free(old);
+    }
+    if (!trigram_table)
+    {
+        return NULL;
+    }
+
+    for (slot = (trigram * 2654435761u) & (trigram_size - 1); trigram_table[slot].key;
+        slot = (slot + 1) & (trigram_size - 1))
+    {
+        if (trigram_table[slot].key == trigram + 1)
+        {
+            return &trigram_table[slot];
+        }
+    }
+    if (!create)
+    {
+        return NULL;
+    }
+    trigram_table[slot].key = trigram + 1;
+    trigram_used++;
+    return &trigram_table[slot];
+}
+
+/* Write a string to a file as a quoted JSON string. */
+void json_string(FILE * f, const char * str)
+{
+    fputc('"', f);
+    for (; *str; str++)
+    {
+        if (*str == '"' || *str == '\\')
+        {
+            fprintf(f, "\\%c", *str);
+        }
+        else if ((unsigned char)*str < 0x20)
+        {
+            fprintf(f, "\\u%04x", *str);
+        }
+        else
+        {
+            fputc(*str, f);
+        }
+    }
+    fputc('"', f);
+}
+
+/* Return the exit status of a completed job, that of its last process, with 128 */
+/* added to the signal number if it was killed by a signal. */
+int job_exit_status(job * j)
+{
+    process * p = j->first_process;
+
+    while (p && p->next)
+    {
+        p = p->next;
+    }
+    if (!p)
+    {
+        return 0;
+    }
+    return WIFSIGNALED(p->status) ? 128 + WTERMSIG(p->status) : WEXITSTATUS(p->status);
+}
+
+/* List the active jobs.  With -v, also list each process and any resource limits. */
+void jobs_func(char ** cmd_args)
+{
+    int verbose = cmd_args[1] && !strcmp(cmd_args[1], "-v");
+
+    for (job * j = job_list; j; j = j->next)
+    {
+        printf("%ld (%s): %s\n", (long)j->pgid,
+            job_is_stopped(j) ? "stopped" : "running", j->command);
+        if (!verbose)
+        {
+            continue;
+        }
+        for (process * p = j->first_process; p; p = p->next)
+        {
+            printf("    %ld %s:", (long)p->pid,
+                p->completed ? "done" : p->stopped ? "stopped" : "running");
+            for (char ** argvp = p->argv; *argvp; argvp++)
+            {
+                printf(" %s", *argvp);
+            }
+            puts("");
+            if (!p->completed && sample_process(p) == 0)
+            {
+                printf("        cpu %.1f%%  rss %ldKB  read %lluKB  written %lluKB  threads %ld\n",
+                    p->cpu, p->rss, p->rchar >> 10, p->wchar >> 10, p->threads);
+            }
+        }
+        for (int i = 0; i < NUM_JOB_LIMITS; i++)
+        {
+            if (j->limits[i] != RLIM_INFINITY)
+            {
+                printf("    limit %s: %llu\n", job_limits[i].name,
+                    (unsigned long long)j->limits[i]);
+            }
+        }
+        if (j->timeout > 0)
+        {
+            printf("    timeout: %gs\n", j->timeout);
+        }
+    }
+}
+
+/* Explain a signal that was probably caused by one of the job's resource limits or */
+/* its timeout.  Return NULL if the signal has nothing to do with them. */
+const char * limit_reason(job * j, int sig)
+{
+    int has_memory_limit = 0;
+    int has_cpu_limit = 0;
+
+    if (j->timed_out && (sig == SIGTERM || sig == SIGKILL))
+    {
+        return sig == SIGTERM ? "Timed out." : "Killed after timing out.";
+    }
+
+    for (int i = 0; i < NUM_JOB_LIMITS; i++)
+    {
+        if (j->limits[i] != RLIM_INFINITY)
+        {
+            has_memory_limit |= job_limits[i].resource == RLIMIT_AS;
+            has_cpu_limit |= job_limits[i].resource == RLIMIT_CPU;
+        }
+    }
+
+    if (sig == SIGXCPU)
+    {
+        return "CPU time limit exceeded.";
+    }
+    if (sig == SIGKILL && has_cpu_limit)
+    {
+        return "Killed, possibly by the CPU time limit.";
+    }
+    if ((sig == SIGSEGV || sig == SIGBUS || sig == SIGABRT) && has_memory_limit)
+    {
+        return "Crashed, possibly by exceeding the memory limit.";
+    }
+    return NULL;
+}
+
+/* Add a name to the command trie, marking it as found in the given PATH directory, */
+/* or as a builtin if dir is 63.  Return the node for the name. */
+int path_trie_insert(const char * name, int dir)
+{
+    int node = 0;
+
+    for (const unsigned char * c = (const unsigned char *)name; *c; c++)
+    {
+        int * link = &path_trie[node].child;
+        while (*link >= 0 && path_trie[*link].c < *c)
+        {
+            link = &path_trie[*link].sibling;
+        }
+        if (*link < 0 || path_trie[*link].c != *c)
+        {
+            if (path_trie_used == path_trie_size)
+            {
+                //The link points into the array that is about to move.
+                size_t index = (char *)link - (char *)path_trie;
+                path_trie_size *= 2;
+                path_trie = (trie_node *)realloc(path_trie, sizeof(trie_node) * path_trie_size);
+                link = (int *)((char *)path_trie + index);
+            }
+            path_trie[path_trie_used].c = *c;
+            path_trie[path_trie_used].child = -1;
+            path_trie[path_trie_used].sibling = *link;
+            path_trie[path_trie_used].dirs = 0;
+            *link = path_trie_used++;
+        }
+        node = *link;
+    }
+    path_trie[node].dirs |= 1ULL << dir;
+    return node;
+}
+
+/* Bring the command trie up to date, rereading only the PATH directories whose */
+/* modification time has changed, or rebuilding it if PATH itself has changed. */
+void path_trie_refresh(void)
+{
+    const char * path = var_get("PATH") ? var_get("PATH") : "";
+
+    if (!path_trie || strcmp(path, path_string))
+    {
+        const char * start = path;
+
+        for (size_t i = 0; i < path_dir_count; i++)
+        {
+            free(path_dirs[i]);
+        }
+        path_dir_count = 0;
+        free(path_string);
+        path_string = strdup(path);
+        while (path_dir_count < MAX_PATH_DIRS)
+        {
+            const char * end = strchrnul(start, ':');
+            path_dirs[path_dir_count] = end > start ? strndup(start, end - start) : strdup(".");
+            path_mtimes[path_dir_count].tv_sec = -1;
+            path_dir_count++;
+            if (!*end)
+            {
+                break;
+            }
+            start = end + 1;
+        }
+
+        path_trie_size = 4096;
+        path_trie_used = 1;
+        path_trie = (trie_node *)realloc(path_trie, sizeof(trie_node) * path_trie_size);
+        path_trie[0].c = 0;
+        path_trie[0].child = -1;
+        path_trie[0].sibling = -1;
+        path_trie[0].dirs = 0;
+        for (const char ** name = builtin_names; *name; name++)
+        {
+            path_trie_insert(*name, MAX_PATH_DIRS);
+        }
+    }
+
+    for (size_t i = 0; i < path_dir_count; i++)
+    {
+        struct stat st;
+        dir_cache * d;
+        char * dir_path = NULL;
+        int fd;
+
+        if (stat(path_dirs[i], &st) < 0 || (st.st_mtim.tv_sec == path_mtimes[i].tv_sec
+            && st.st_mtim.tv_nsec == path_mtimes[i].tv_nsec))
+        {
+            continue;
+        }
+        path_mtimes[i] = st.st_mtim;
+
+        //Forget the directory's commands and add back the ones it holds now.
+        for (size_t n = 0; n < path_trie_used; n++)
+        {
+            path_trie[n].dirs &= ~(1ULL << i);
+        }
+        asprintf(&dir_path, "%s/", path_dirs[i]);
+        d = dir_cache_get(dir_path);
+        free(dir_path);
+        fd = open(path_dirs[i], O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        for (size_t e = 0; d && fd >= 0 && e < d->count; e++)
+        {
+            const char * name = d->names.data + d->entries[e];
+            struct stat file;
+
+            if (name[-1] == DT_DIR || faccessat(fd, name, X_OK, 0) < 0)
+            {
+                continue;
+            }
+            if (name[-1] != DT_UNKNOWN || (fstatat(fd, name, &file, 0) == 0 && !S_ISDIR(file.st_mode)))
+            {
+                path_trie_insert(name, i);
+            }
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+}
+
+/* Parse a duration in seconds with an optional s, m, h or d suffix, e.g. 1.5m. */
+/* Return 0 on success, -1 if the text is not a duration. */
+int parse_duration(const char * text, double * seconds)
+{
+    char * end;
+    double value;
+
+    errno = 0;
+    value = strtod(text, &end);
+    if (errno || end == text || value < 0)
+    {
+        return -1;
+    }
+    switch (*end)
+    {
+        case 'd': value *= 24; /* fall through */
+        case 'h': value *= 60; /* fall through */
+        case 'm': value *= 60; /* fall through */
+        case 's': end++; break;
+    }
+    if (*end)
+    {
+        return -1;
+    }
+    *seconds = value;
+    return 0;
+}
+
+/* Parse a size in bytes with an optional K, M or G suffix, e.g. 512M. */
+/* Return 0 on success, -1 if the text is not a size. */
+int parse_size(const char * text, unsigned long long * size)
+{
+    char * end;
+    unsigned long long value;
+
+    errno = 0;
+    value = strtoull(text, &end, 10);
+    if (errno || end == text)
+    {
+        return -1;
+    }
+    switch (*end)
+    {
+        case 'G': case 'g': value <<= 10; /* fall through */
+        case 'M': case 'm': value <<= 10; /* fall through */
+        case 'K': case 'k': value <<= 10; end++; break;
+    }
+    if (*end)
+    {
+        return -1;
+    }
+    *size = value;
+    return 0;
+}
+
+/* Parse the time, limit and timeout prefixes of a command and record them in the job. */
+/* Return the index of the command to run, or -1 if a prefix is malformed. */
+int prefix_parser(char ** cmd_args, job * j)
+{
+    int index = 0;
+
+    while (cmd_args[index])
+    {
+        if (!strcmp(cmd_args[index], "time"))
+        {
+            j->timed = 1;
+            index++;
+        }
+        else if (!strcmp(cmd_args[index], "limit"))
+        {
+            int count = limit_parser(cmd_args + index, j);
+            if (count < 0)
+            {
+                return -1;
+            }
+            index += count;
+        }
+        else if (!strcmp(cmd_args[index], "timeout"))
+        {
+            int count = timeout_parser(cmd_args + index, j);
+            if (count < 0)
+            {
+                return -1;
+            }
+            index += count;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    return cmd_args[index] ? index : -1;
+}
+
+/* Parse the options of the limit builtin and record them in the job. */
+/* Return the index of the command to run, or -1 if the options are malformed. */
+int limit_parser(char ** cmd_args, job * j)
+{
+    int index = 1;
+
+    while (cmd_args[index] && cmd_args[index][0] == '-')
+    {
+        int i;
+        unsigned long long value;
+
+        for (i = 0; i < NUM_JOB_LIMITS; i++)
+        {
+            if (cmd_args[index][1] == job_limits[i].option && !cmd_args[index][2])
+            {
+                break;
+            }
+        }
+        if (i == NUM_JOB_LIMITS || !cmd_args[index + 1])
+        {
+            return -1;
+        }
+
+        //Accept K, M and G suffixes so memory limits can be written as 512M.
+        if (parse_size(cmd_args[index + 1], &value) < 0)
+        {
+            return -1;
+        }
+        j->limits[i] = (rlim_t)value;
+        index += 2;
+    }
+
+    return cmd_args[index] ? index : -1;
+}
+
+/* Parse the options of the timeout builtin and record them in the job. */
+/* Return the index of the command to run, or -1 if the options are malformed. */
+int timeout_parser(char ** cmd_args, job * j)
+{
+    int index = 1;
+
+    if (cmd_args[index] && !strcmp(cmd_args[index], "-k"))
+    {
+        if (!cmd_args[index + 1] || parse_duration(cmd_args[index + 1], &j->grace) < 0)
+        {
+            return -1;
+        }
+        index += 2;
+    }
+    if (!cmd_args[index] || parse_duration(cmd_args[index], &j->timeout) < 0 || j->timeout <= 0)
+    {
+        return -1;
+    }
+    index++;
+
+    return cmd_args[index] ? index : -1;
+}
+
+/* Map a wall clock time to a histogram bucket.  Each power of two microseconds */
+/* is split into 8 linear buckets, so percentiles are accurate to within 12.5%. */
+unsigned int profile_bucket(double seconds)
+{
+    unsigned long long us = (unsigned long long)(seconds * 1e6);
+    unsigned int bucket;
+    int msb;
+
+    if (us < 8)
+    {
+        return (unsigned int)us;
+    }
+    msb = 63 - __builtin_clzll(us);
+    bucket = (msb - 2) * 8 + ((us >> (msb - 3)) & 7);
+    return bucket < PROFILE_BUCKETS ? bucket : PROFILE_BUCKETS - 1;
+}
+
+/* Print the command profile.  Usage: profile [tsv|json|reset] */
+void profile_func(char ** cmd_args)
+{
+    const char * format = cmd_args[1] ? cmd_args[1] : "tsv";
+    profile_entry ** sorted;
+    size_t count = 0;
+
+    if (!strcmp(format, "reset"))
+    {
+        for (size_t i = 0; i < profile_size; i++)
+        {
+            free(profile_table[i].name);
+        }
+        free(profile_table);
+        profile_table = NULL;
+        profile_size = profile_used = 0;
+        return;
+    }
+    if (strcmp(format, "tsv") && strcmp(format, "json"))
+    {
+        puts("Usage: profile [tsv|json|reset]");
+        return;
+    }
+
+    //Order the commands by total wall clock time, most expensive first.
+    sorted = (profile_entry **)malloc(sizeof(profile_entry *) * (profile_used + 1));
+    for (size_t i = 0; i < profile_size; i++)
+    {
+        if (profile_table[i].name)
+        {
+            size_t k = count++;
+            while (k > 0 && sorted[k - 1]->wall < profile_table[i].wall)
+            {
+                sorted[k] = sorted[k - 1];
+                k--;
+            }
+            sorted[k] = &profile_table[i];
+        }
+    }
+
+    if (!strcmp(format, "tsv"))
+    {
+        puts("command\tcount\ttotal_s\tp50_s\tp99_s\tcpu_s\tpeak_rss_kb");
+        for (size_t i = 0; i < count; i++)
+        {
+            profile_entry * e = sorted[i];
+            printf("%s\t%lu\t%.6f\t%.6f\t%.6f\t%.6f\t%ld\n", e->name, e->count, e->wall,
+                profile_percentile(e, 0.5), profile_percentile(e, 0.99), e->cpu, e->peak_rss);
+        }
+    }
+    else
+    {
+        printf("[");
+        for (size_t i = 0; i < count; i++)
+        {
+            profile_entry * e = sorted[i];
+            printf("%s\n  {\"command\": ", i ? "," : "");
+            json_string(stdout, e->name);
+            printf(", \"count\": %lu, \"total_s\": %.6f, \"p50_s\": %.6f, \"p99_s\": %.6f, "
+                "\"cpu_s\": %.6f, \"peak_rss_kb\": %ld}", e->count, e->wall,
+                profile_percentile(e, 0.5), profile_percentile(e, 0.99), e->cpu, e->peak_rss);
+        }
+        printf("%s]\n", count ? "\n" : "");
+    }
+    free(sorted);
+}
+
+/* Estimate a percentile of a command's wall clock time from its histogram. */
+/* Return the midpoint of the bucket holding the percentile, in seconds. */
+double profile_percentile(profile_entry * e, double q)
+{
+    unsigned long rank = (unsigned long)(q * e->count + 0.999999);
+    unsigned long seen = 0;
+    unsigned int bucket;
+
+    for (bucket = 0; bucket < PROFILE_BUCKETS - 1; bucket++)
+    {
+        seen += e->buckets[bucket];
+        if (seen >= rank)
+        {
+            break;
+        }
+    }
+    if (bucket < 8)
+    {
+        return bucket / 1e6;
+    }
+    int msb = bucket / 8 + 2;
+    double low = (double)((8ULL + bucket % 8) << (msb - 3));
+    return (low + (1ULL << (msb - 3)) / 2.0) / 1e6;
+}
+
+/* Add a reaped process to the command profile. */
+void profile_record(process * p)
+{
+    const char * name = p->argv[0];
+    size_t slot;
+    profile_entry * e;
+
+    //Keep the table at most half full so probes stay short.
+    if (2 * (profile_used + 1) > profile_size)
+    {
+        profile_entry * old = profile_table;
+        size_t old_size = profile_size;
+
+        profile_size = profile_size ? profile_size * 2 : 64;
+        profile_table = (profile_entry *)calloc(profile_size, sizeof(profile_entry));
+        profile_used = 0;
+        for (size_t i = 0; i < old_size; i++)
+        {
+            if (old[i].name)
+            {
+                slot = hash_string(old[i].name) & (profile_size - 1);
+                while (profile_table[slot].name)
+                {
+                    slot = (slot + 1) & (profile_size - 1);
+                }
+                profile_table[slot] = old[i];
+                profile_used++;
+            }
+        }
+        free(old);
+    }
+
+    for (slot = hash_string(name) & (profile_size - 1); profile_table[slot].name; slot = (slot + 1) & (profile_size - 1))
+    {
+        if (!strcmp(profile_table[slot].name, name))
+        {
+            break;
+        }
+    }
+    e = &profile_table[slot];
+    if (!e->name)
+    {
+        e->name = strdup(name);
+        profile_used++;
+    }
+
+    double wall = elapsed(&p->start, &p->end);
+    e->count++;
+    e->wall += wall;
+    e->cpu += p->usage.ru_utime.tv_sec + p->usage.ru_utime.tv_usec / 1e6
+        + p->usage.ru_stime.tv_sec + p->usage.ru_stime.tv_usec / 1e6;
+    if (p->usage.ru_maxrss > e->peak_rss)
+    {
+        e->peak_rss = p->usage.ru_maxrss;
+    }
+    e->buckets[profile_bucket(wall)]++;
+}
+
+/* Read a key from the terminal.  Escape sequences for the arrow, Home, End and Delete */
+/* keys are returned as KEY_* codes above 255.  Return -1 on end of file. */
+int read_key(void)
+{
+    unsigned char c;
+    unsigned char seq[3];
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+
+    //Reap background jobs as they finish, so that jobserver tokens are returned, and
+    //drain their logs while the shell waits for a key.  Jobs that have finished or stopped
+    //are reported at once, above the line being edited, which is then redrawn.  While
+    //nothing happens, the history is added to the trigram index a batch at a time, so that
+    //a large history neither delays the prompt nor the first Ctrl-R.
+    while (sigchld_pipe[0] >= 0)
+    {
+        int indexing = history_indexed < history_count;
+        int events = event_wait(STDIN_FILENO, NULL, 0, indexing ? 0 : -1);
+
+        if (!events && indexing)
+        {
+            history_index(HISTORY_INDEX_BATCH);
+            continue;
+        }
+        if (events & EVENT_CHILD)
+        {
+            do_job_notification();
+            notify_flush();
+        }
+        if (editor.interrupted)
+        {
+            fflush(stdout);
+            editor.interrupted = 0;
+            editor_refresh();
+        }
+        if (events & EVENT_INPUT)
+        {
+            break;
+        }
+    }
+    while (read(STDIN_FILENO, &c, 1) != 1)
+    {
+        if (errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    if (c != 27)
+    {
+        return c;
+    }
+
+    //A lone Escape is not followed by anything, so only wait briefly for the rest of a sequence.
+    if (poll(&pfd, 1, 50) <= 0 || read(STDIN_FILENO, &seq[0], 1) != 1)
+    {
+        return 27;
+    }
+    if (seq[0] != '[' && seq[0] != 'O')
+    {
+        return 27;
+    }
+    if (poll(&pfd, 1, 50) <= 0 || read(STDIN_FILENO, &seq[1], 1) != 1)
+    {
+        return 27;
+    }
+    if (seq[1] >= '0' && seq[1] <= '9')
+    {
+        if (poll(&pfd, 1, 50) <= 0 || read(STDIN_FILENO, &seq[2], 1) != 1 || seq[2] != '~')
+        {
+            return 27;
+        }
+        switch (seq[1])
+        {
+            case '1': case '7': return KEY_HOME;
+            case '4': case '8': return KEY_END;
+            case '3': return KEY_DELETE;
+        }
+        return 27;
+    }
+    switch (seq[1])
+    {
+        case 'A': return KEY_UP;
+        case 'B': return KEY_DOWN;
+        case 'C': return KEY_RIGHT;
+        case 'D': return KEY_LEFT;
+        case 'H': return KEY_HOME;
+        case 'F': return KEY_END;
+    }
+    return 27;
+}
+
+/* Read a command line from the terminal with line editing and history. */
+/* Return the line, to be freed by the caller, or NULL at end of file. */
+char * read_line(const char * prompt)
+{
+    struct termios raw = shell_tmodes;
+    char * result = NULL;
+
+    //Without a terminal there is nothing to edit, so read whole lines as before.
+    if (!shell_is_interactive)
+    {
+        size_t size = 0;
+        fputs(prompt, stdout);
+        fflush(stdout);
+        if (getline(&result, &size, stdin) < 0)
+        {
+            free(result);
+            return NULL;
+        }
+        return result;
+    }
+
+    //The editor waits for keys in the event loop, which wakes up when a child changes state.
+    sigchld_init();
+    raw.c_iflag &= ~(ICRNL|IXON|BRKINT|INPCK|ISTRIP);
+    raw.c_lflag &= ~(ICANON|ECHO|ISIG|IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(shell_terminal, TCSADRAIN, &raw);
+
+    fflush(stdout);
+    editor.prompt = prompt;
+    editor.line.length = 0;
+    buffer_reserve(&editor.line, 0);
+    editor.line.data[0] = '\0';
+    editor.cursor = 0;
+    editor.history_index = history_count;
+    editor.searching = 0;
+    editor.tabs = 0;
+    editor.active = 1;
+    //Jobs that finished while the last command ran are reported before the prompt.
+    do_job_notification();
+    notify_flush();
+    fflush(stdout);
+    editor.interrupted = 0;
+    editor_refresh();
+
+    while (1)
+    {
+        int key = read_key();
+
+        if (editor.searching)
+        {
+            editor_search_key(key);
+            if (editor.searching)
+            {
+                editor_refresh();
+                continue;
+            }
+            //Enter runs the match straight away; other keys go on to edit it.
+            if (key == 27 || key == 7)
+            {
+                editor_refresh();
+                continue;
+            }
+        }
+
+        if (key == -1 || (key == 4 && editor.line.length == 0))      // Ctrl-D on an empty line
+        {
+            break;
+        }
+        else if (key == '\r' || key == '\n')                        // Enter
+        {
+            if (editor.cursor < editor.line.length)
+            {
+                editor.cursor = editor.line.length;
+                editor_refresh();
+            }
+            result = strdup(editor.line.data);
+            break;
+        }
+        else if (key == 3)                                          // Ctrl-C: abandon the line
+        {
+            write(STDOUT_FILENO, "^C", 2);
+            result = strdup("");
+            break;
+        }
+        else if (key == 18)                                         // Ctrl-R: reverse search
+        {
+            editor.searching = 1;
+            editor.query.length = 0;
+            buffer_reserve(&editor.query, 0);
+            editor.query.data[0] = '\0';
+            editor.match = -1;
+        }
+        else if (key == 127 || key == 8)                            // Backspace
+        {
+            if (editor.cursor > 0)
+            {
+                memmove(editor.line.data + editor.cursor - 1, editor.line.data + editor.cursor,
+                    editor.line.length - editor.cursor + 1);
+                editor.cursor--;
+                editor.line.length--;
+            }
+        }
+        else if (key == 4 || key == KEY_DELETE)                     // Ctrl-D or Delete
+        {
+            if (editor.cursor < editor.line.length)
+            {
+                memmove(editor.line.data + editor.cursor, editor.line.data + editor.cursor + 1,
+                    editor.line.length - editor.cursor);
+                editor.line.length--;
+            }
+        }
+        else if (key == 1 || key == KEY_HOME)                       // Ctrl-A or Home
+        {
+            editor.cursor = 0;
+        }
+        else if (key == 5 || key == KEY_END)                        // Ctrl-E or End
+        {
+            editor.cursor = editor.line.length;
+        }
+        else if (key == 2 || key == KEY_LEFT)                       // Ctrl-B or Left
+        {
+            if (editor.cursor > 0)
+            {
+                editor.cursor--;
+            }
+        }
+        else if (key == 6 || key == KEY_RIGHT)                      // Ctrl-F or Right
+        {
+            if (editor.cursor < editor.line.length)
+            {
+                editor.cursor++;
+            }
+        }
+        else if (key == 16 || key == KEY_UP)                        // Ctrl-P or Up: older history
+        {
+            if (editor.history_index > 0)
+            {
+                editor_show_history(editor.history_index - 1);
+            }
+        }
+        else if (key == 14 || key == KEY_DOWN)                      // Ctrl-N or Down: newer history
+        {
+            if (editor.history_index < history_count)
+            {
+                editor_show_history(editor.history_index + 1);
+            }
+        }
+        else if (key == 11)                                         // Ctrl-K: delete to the end
+        {
+            editor.line.length = editor.cursor;
+            editor.line.data[editor.cursor] = '\0';
+        }
+        else if (key == 21)                                         // Ctrl-U: delete to the start
+        {
+            memmove(editor.line.data, editor.line.data + editor.cursor, editor.line.length - editor.cursor + 1);
+            editor.line.length -= editor.cursor;
+            editor.cursor = 0;
+        }
+        else if (key == 23)                                         // Ctrl-W: delete the previous word
+        {
+            size_t start = editor.cursor;
+            while (start > 0 && editor.line.data[start - 1] == ' ')
+            {
+                start--;
+            }
+            while (start > 0 && editor.line.data[start - 1] != ' ')
+            {
+                start--;
+            }
+            memmove(editor.line.data + start, editor.line.data + editor.cursor, editor.line.length - editor.cursor + 1);
+            editor.line.length -= editor.cursor - start;
+            editor.cursor = start;
+        }
+        else if (key == 9)                                          // Tab: complete the word
+        {
+            editor.tabs++;
+            editor_complete();
+        }
+        else if (key == 12)                                         // Ctrl-L: clear the screen
+        {
+            write(STDOUT_FILENO, "\033[H\033[2J", 7);
+        }
+        else if (key >= 32 && key < 256 && key != 127)              // Printable characters
+        {
+            char c = (char)key;
+            editor_insert(&c, 1);
+        }
+        if (key != 9)
+        {
+            editor.tabs = 0;
+        }
+        editor_refresh();
+    }
+
+    if (result)
+    {
+        write(STDOUT_FILENO, "\n", 1);
+    }
+    editor.active = 0;
+    tcsetattr(shell_terminal, TCSADRAIN, &shell_tmodes);
+    return result;
+}
+
+/* Sort strings in byte order with multikey quicksort, comparing from the depth'th */
+/* character on.  Strings sharing a long prefix, as paths in one directory do, are */
+/* only compared character by character once rather than once per comparison. */
+void string_sort(char ** a, size_t n, size_t depth)
+{
+    while (n > 1)
+    {
+        size_t lt = 0, i = 0, gt = n;
+        unsigned char pivot;
+
+        if (n < 16)
+        {
+            for (size_t j = 1; j < n; j++)
+            {
+                for (size_t k = j; k > 0 && strcmp(a[k - 1] + depth, a[k] + depth) > 0; k--)
+                {
+                    char * t = a[k];
+                    a[k] = a[k - 1];
+                    a[k - 1] = t;
+                }
+            }
+            return;
+        }
+
+        //Partition into strings whose depth'th character is below, equal to and above the pivot.
+        pivot = a[n / 2][depth];
+        while (i < gt)
+        {
+            unsigned char c = a[i][depth];
+            char * t;
+            if (c < pivot)
+            {
+                t = a[lt]; a[lt++] = a[i]; a[i++] = t;
+            }
+            else if (c > pivot)
+            {
+                t = a[--gt]; a[gt] = a[i]; a[i] = t;
+            }
+            else
+            {
+                i++;
+            }
+        }
+        string_sort(a, lt, depth);
+        string_sort(a + gt, n - gt, depth);
+        if (pivot == '\0')
+        {
+            return;
+        }
+        a += lt;
+        n = gt - lt;
+        depth++;
+    }
+}
+
+/* Set a shell variable that is not exported, or list all variables.  Usage: set [name value] */
+void set_func(char ** cmd_args)
+{
+    if (cmd_args[1] == NULL)
+    {
+        for (size_t i = 0; i < var_buckets; i++)
+        {
+            for (variable * v = var_table[i]; v; v = v->next)
+            {
+                printf("%s%s=%s\n", v->exported ? "export " : "", v->name, v->value);
+            }
+        }
+    }
+    else if (cmd_args[2] == NULL)
+    {
+        puts("Error: expected two arguments");
+    }
+    else
+    {
+        var_set(cmd_args[1], cmd_args[2], 0);
+    }
+}
+
+/* Report the resource usage of a completed job if the time builtin was used, */
+/* or if it ran for longer than the number of seconds in CSHELL_REPORT_TIME. */
+void report_job_time(job * j)
+{
+    struct rusage ru;
+    double wall;
+    char * threshold = var_get("CSHELL_REPORT_TIME");
+
+    if (j->time_reported)
+    {
+        return;
+    }
+    job_usage(j, &ru, &wall);
+    if (!j->timed && !(threshold && *threshold && wall >= atof(threshold)))
+    {
+        return;
+    }
+    j->time_reported = 1;
+    notify_flush();
+    fprintf(stderr, "%ld (time): %s\n", (long)j->pgid, j->command);
+    fprintf(stderr, "    real %.3fs  user %.3fs  sys %.3fs\n", wall,
+        ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+    fprintf(stderr, "    max rss %ldKB  context switches %ld voluntary, %ld involuntary\n",
+        ru.ru_maxrss, ru.ru_nvcsw, ru.ru_nivcsw);
+}
+
+/* Sample the CPU usage, memory, threads and I/O of a running process from /proc. */
+/* The descriptors are kept open so later samples only cost a pread each, and the CPU */
+/* percentage is measured since the previous sample (or since launch for the first). */
+/* Return 0 on success, -1 if the process could not be sampled. */
+int sample_process(process * p)
+{
+    char buf[1024];
+    char * fields;
+    ssize_t n;
+    unsigned long long utime, stime;
+    struct timespec now;
+    double interval;
+
+    if (p->stat_fd < 0)
+    {
+        snprintf(buf, sizeof(buf), "/proc/%ld/stat", (long)p->pid);
+        p->stat_fd = open(buf, O_RDONLY|O_CLOEXEC);
+        snprintf(buf, sizeof(buf), "/proc/%ld/io", (long)p->pid);
+        p->io_fd = open(buf, O_RDONLY|O_CLOEXEC);
+        p->ticks = 0;
+        p->sampled = p->start;
+    }
+    if (p->stat_fd < 0 || (n = pread(p->stat_fd, buf, sizeof(buf) - 1, 0)) <= 0)
+    {
+        return -1;
+    }
+    buf[n] = '\0';
+
+    //The command name may contain spaces or brackets, so parse from the last ')'.
+    fields = strrchr(buf, ')');
+    if (!fields || sscanf(fields + 2,
+        "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d %*d %*d %ld %*d %*u %*u %ld",
+        &utime, &stime, &p->threads, &p->rss) != 4)
+    {
+        return -1;
+    }
+    p->rss *= sysconf(_SC_PAGESIZE) / 1024;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    interval = elapsed(&p->sampled, &now);
+    if (interval > 0)
+    {
+        p->cpu = 100.0 * (utime + stime - p->ticks) / sysconf(_SC_CLK_TCK) / interval;
+    }
+    p->ticks = utime + stime;
+    p->sampled = now;
+
+    //The io file is only readable for our own processes, so leave the counters alone if it fails.
+    if (p->io_fd >= 0 && (n = pread(p->io_fd, buf, sizeof(buf) - 1, 0)) > 0)
+    {
+        buf[n] = '\0';
+        sscanf(buf, "rchar: %llu wchar: %llu", &p->rchar, &p->wchar);
+    }
+    return 0;
+}
+
+/* Write the trace ring buffer to a file in Chrome trace event format. */
+/* Events are grouped by process group, with one track per process. */
+void trace_dump(const char * path)
+{
+    FILE * f;
+    unsigned long long first = 0;
+    unsigned long long last;
+
+    if (!trace_buffer)
+    {
+        puts("No trace has been recorded.  Use \"trace on\" first.");
+        return;
+    }
+    if (!(f = fopen(path, "w")))
+    {
+        fprintf(stderr, "Error: Can't open trace file: %s\n", path);
+        return;
+    }
+
+    last = __atomic_load_n(&trace_buffer->next, __ATOMIC_ACQUIRE);
+    if (last > TRACE_EVENTS)
+    {
+        first = last - TRACE_EVENTS;
+    }
+    fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    for (unsigned long long i = first; i < last; i++)
+    {
+        trace_event * e = &trace_buffer->events[i % TRACE_EVENTS];
+        const char * phase = e->type == TRACE_PARSE_BEGIN ? "B" : e->type == TRACE_PARSE_END ? "E" : "i";
+
+        fprintf(f, "%s\n  {\"name\": \"%s\", \"ph\": \"%s\", \"ts\": %llu.%03llu, \"pid\": %ld, \"tid\": %ld%s}",
+            i > first ? "," : "", trace_names[e->type], phase, e->ns / 1000, e->ns % 1000,
+            (long)e->pgid, (long)e->pid, *phase == 'i' ? ", \"s\": \"t\"" : "");
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f) != 0)
+    {
+        perror("trace");
+    }
+}
+
+/* Control event tracing.  Usage: trace on|off|clear|dump file.json */
+void trace_func(char ** cmd_args)
+{
+    if (cmd_args[1] && !strcmp(cmd_args[1], "on"))
+    {
+        //Map the buffer shared so forked children can record their own events before exec.
+        if (!trace_buffer)
+        {
+            trace_buffer = (trace_ring *)mmap(NULL, sizeof(trace_ring), PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+            if (trace_buffer == MAP_FAILED)
+            {
+                trace_buffer = NULL;
+                perror("trace");
+                return;
+            }
+        }
+        trace_enabled = 1;
+    }
+    else if (cmd_args[1] && !strcmp(cmd_args[1], "off"))
+    {
+        trace_enabled = 0;
+    }
+    else if (cmd_args[1] && !strcmp(cmd_args[1], "clear"))
+    {
+        if (trace_buffer)
+        {
+            trace_buffer->next = 0;
+        }
+    }
+    else if (cmd_args[1] && !strcmp(cmd_args[1], "dump") && cmd_args[2])
+    {
+        trace_dump(cmd_args[2]);
+    }
+    else
+    {
+        puts("Usage: trace on|off|clear|dump file.json");
+    }
+}
+
+/* Record an event in the trace ring buffer if tracing is on. */
+void trace_record(int type, pid_t pid, pid_t pgid)
+{
+    struct timespec now;
+    trace_event * e;
+
+    if (!trace_enabled)
+    {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    e = &trace_buffer->events[__atomic_fetch_add(&trace_buffer->next, 1, __ATOMIC_RELAXED) % TRACE_EVENTS];
+    e->ns = (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    e->type = type;
+    e->pid = pid;
+    e->pgid = pgid;
+}
+
+/* Apply the job's resource limits to the calling process.  Only called in the child after fork. */
+void set_job_limits(job * j)
+{
+    for (int i = 0; i < NUM_JOB_LIMITS; i++)
+    {
+        struct rlimit rl;
+
+        if (j->limits[i] == RLIM_INFINITY)
+        {
+            continue;
+        }
+        getrlimit(job_limits[i].resource, &rl);
+        rl.rlim_cur = j->limits[i];
+        //Leave a second between SIGXCPU and SIGKILL for CPU limits.
+        if (job_limits[i].resource == RLIMIT_CPU && rl.rlim_cur < rl.rlim_max)
+        {
+            rl.rlim_max = rl.rlim_cur + 1;
+        }
+        else if (rl.rlim_cur < rl.rlim_max)
+        {
+            rl.rlim_max = rl.rlim_cur;
+        }
+        if (rl.rlim_cur > rl.rlim_max)
+        {
+            rl.rlim_cur = rl.rlim_max;
+        }
+        if (setrlimit(job_limits[i].resource, &rl) < 0)
+        {
+            fprintf(stderr, "ERROR: Unable to set %s limit\n", job_limits[i].name);
+            perror("setrlimit");
+            _exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* Return the environment for new commands, built from the exported variables. */
+/* The array and its strings are packed into one allocation, which is only rebuilt */
+/* when an exported variable has changed since the last call. */
+char ** var_environment(void)
+{
+    size_t count = 0;
+    size_t bytes = 0;
+    char ** envp;
+    char * strings;
+
+    if (!var_table)
+    {
+        var_init();
+    }
+    if (!var_envp_dirty)
+    {
+        return var_envp;
+    }
+    for (size_t i = 0; i < var_buckets; i++)
+    {
+        for (variable * v = var_table[i]; v; v = v->next)
+        {
+            if (v->exported)
+            {
+                count++;
+                bytes += strlen(v->name) + strlen(v->value) + 2;
+            }
+        }
+    }
+    envp = (char **)malloc(sizeof(char *) * (count + 1) + bytes);
+    strings = (char *)(envp + count + 1);
+    count = 0;
+    for (size_t i = 0; i < var_buckets; i++)
+    {
+        for (variable * v = var_table[i]; v; v = v->next)
+        {
+            if (v->exported)
+            {
+                envp[count++] = strings;
+                strings += sprintf(strings, "%s=%s", v->name, v->value) + 1;
+            }
+        }
+    }
+    envp[count] = NULL;
+    free(var_envp);
+    var_envp = envp;
+    var_envp_dirty = 0;
+    return var_envp;
+}
+
+/* Return the link pointing at the named variable in its bucket, or at the end of the bucket. */
+variable ** var_find(const char * name)
+{
+    variable ** link;
+
+    if (!var_table)
+    {
+        var_init();
+    }
+    for (link = &var_table[hash_string(name) & (var_buckets - 1)]; *link; link = &(*link)->next)
+    {
+        if (!strcmp((*link)->name, name))
+        {
+            break;
+        }
+    }
+    return link;
+}
+
+/* Return the value of a variable, or NULL if it is not set. */
+char * var_get(const char * name)
+{
+    variable * v = *var_find(name);
+    return v ? v->value : NULL;
+}
+
+/* Create the variable table from the environment the shell was started with. */
+void var_init(void)
+{
+    extern char ** environ;
+
+    var_buckets = 64;
+    var_table = (variable **)calloc(var_buckets, sizeof(variable *));
+    for (char ** e = environ; *e; e++)
+    {
+        char * equals = strchr(*e, '=');
+        if (equals)
+        {
+            char * name = strndup(*e, equals - *e);
+            var_set(name, equals + 1, 1);
+            free(name);
+        }
+    }
+}
+
+/* Set a variable.  If exported is true the variable is also passed to commands; an */
+/* existing exported variable stays exported. */
+void var_set(const char * name, const char * value, int exported)
+{
+    variable ** link = var_find(name);
+    variable * v = *link;
+
+    if (v)
+    {
+        //The new value may be the old one, e.g. when exporting a variable.
+        char * copy = strdup(value);
+        free(v->value);
+        v->value = copy;
+        v->exported |= exported;
+        var_envp_dirty |= v->exported;
+        return;
+    }
+
+    //Keep the average chain length at most one.
+    if (var_count + 1 > var_buckets)
+    {
+        size_t buckets = var_buckets * 2;
+        variable ** table = (variable **)calloc(buckets, sizeof(variable *));
+
+        for (size_t i = 0; i < var_buckets; i++)
+        {
+            while (var_table[i])
+            {
+                variable * moved = var_table[i];
+                size_t bucket = hash_string(moved->name) & (buckets - 1);
+                var_table[i] = moved->next;
+                moved->next = table[bucket];
+                table[bucket] = moved;
+            }
+        }
+        free(var_table);
+        var_table = table;
+        var_buckets = buckets;
+        link = var_find(name);
+    }
+
+    v = (variable *)malloc(sizeof(variable));
+    v->next = NULL;
+    v->name = strdup(name);
+    v->value = strdup(value);
+    v->exported = exported;
+    *link = v;
+    var_count++;
+    var_envp_dirty |= exported;
+}
+
+/* Remove a variable.  Return 0 if it existed, -1 otherwise. */
+int var_unset(const char * name)
+{
+    variable ** link = var_find(name);
+    variable * v = *link;
+
+    if (!v)
+    {
+        return -1;
+    }
+    *link = v->next;
+    var_envp_dirty |= v->exported;
+    free(v->name);
+    free(v->value);
+    free(v);
+    var_count--;
+    return 0;
+}
+
+/* Launch a process through the zygote.  Return its process ID, or -1 if the zygote */
+/* could not start it, in which case the caller forks it itself. */
+pid_t zygote_launch(process * p, pid_t pgid, int infile, int outfile, int errfile, int foreground)
+{
+    zygote_request request;
+    zygote_reply reply;
+    buffer payload = {NULL, 0, 0};
+    const char * path = var_get("PATH") ? var_get("PATH") : "";
+    int fds[3] = {infile, outfile, errfile};
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {&request, sizeof(request)};
+    struct msghdr msg;
+    struct cmsghdr * cmsg;
+    ssize_t n = 0;
+
+    //Pack the arguments, the environment and PATH one after another.
+    memset(&request, 0, sizeof(request));
+    request.pgid = pgid;
+    request.foreground = foreground;
+    memcpy(request.limits, p->job->limits, sizeof(request.limits));
+    for (char ** arg = p->argv; *arg; arg++, request.argc++)
+    {
+        buffer_append(&payload, *arg, strlen(*arg) + 1);
+    }
+    for (char ** env = var_envp; env && *env; env++, request.envc++)
+    {
+        buffer_append(&payload, *env, strlen(*env) + 1);
+    }
+    buffer_append(&payload, path, strlen(path) + 1);
+    request.length = payload.length;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(zygote_fd, &msg, MSG_NOSIGNAL) == sizeof(request))
+    {
+        for (n = 0; n < (ssize_t)payload.length;)
+        {
+            ssize_t sent = send(zygote_fd, payload.data + n, payload.length - n, MSG_NOSIGNAL);
+            if (sent <= 0)
+            {
+                break;
+            }
+            n += sent;
+        }
+    }
+    free(payload.data);
+    if (n == (ssize_t)request.length && read(zygote_fd, &reply, sizeof(reply)) == sizeof(reply))
+    {
+        errno = reply.error;
+        return reply.pid;
+    }
+
+    //The zygote has gone, so fork directly from now on.
+    fputs("cShell: the zygote has exited, forking directly\n", stderr);
+    close(zygote_fd);
+    zygote_fd = -1;
+    return -1;
+}
+
+/* Serve launch requests from the shell until it closes the socket.  Each process is */
+/* created with CLONE_PARENT, so it is a child of the shell, which waits for it as usual. */
+void zygote_loop(int fd)
+{
+    buffer payload = {NULL, 0, 0};
+
+    while (1)
+    {
+        zygote_request request;
+        zygote_reply reply;
+        int fds[3];
+        char control[CMSG_SPACE(sizeof(fds))];
+        struct iovec iov = {&request, sizeof(request)};
+        struct msghdr msg;
+        struct cmsghdr * cmsg;
+        size_t received = 0;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(request) || !(cmsg = CMSG_FIRSTHDR(&msg))
+            || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+        {
+            _exit(EXIT_SUCCESS);
+        }
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        payload.length = 0;
+        buffer_reserve(&payload, request.length);
+        while (received < request.length)
+        {
+            ssize_t n = read(fd, payload.data + received, request.length - received);
+            if (n <= 0)
+            {
+                _exit(EXIT_SUCCESS);
+            }
+            received += n;
+        }
+
+        reply.pid = syscall(SYS_clone, CLONE_PARENT|SIGCHLD, NULL, NULL, NULL, NULL);
+        reply.error = errno;
+        if (reply.pid == 0)
+        {
+            char ** argv = (char **)malloc(sizeof(char *) * (request.argc + 1));
+            char ** envp = (char **)malloc(sizeof(char *) * (request.envc + 1));
+            char * c = payload.data;
+            job j;
+            process p;
+
+            for (unsigned int i = 0; i < request.argc; i++, c += strlen(c) + 1)
+            {
+                argv[i] = c;
+            }
+            argv[request.argc] = NULL;
+            for (unsigned int i = 0; i < request.envc; i++, c += strlen(c) + 1)
+            {
+                envp[i] = c;
+            }
+            envp[request.envc] = NULL;
+            var_set("PATH", c, 0);
+            var_envp = envp;
+
+            //The received descriptors are close-on-exec, but launch_process() duplicates them into place.
+            memset(&j, 0, sizeof(j));
+            memcpy(j.limits, request.limits, sizeof(j.limits));
+            memset(&p, 0, sizeof(p));
+            p.argv = argv;
+            p.job = &j;
+            launch_process(&p, request.pgid, fds[0], fds[1], fds[2], request.foreground);
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            close(fds[i]);
+        }
+        if (write(fd, &reply, sizeof(reply)) != sizeof(reply))
+        {
+            _exit(EXIT_SUCCESS);
+        }
+    }
+}
+
+/* Start the zygote, a small helper forked while the shell's heap is still small that */
+/* creates every later process, so launching a job never copies a large address space. */
+void zygote_start(void)
+{
+    int sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv) < 0)
+    {
+        perror("zygote");
+        return;
+    }
+    pid = fork();
+    if (pid < 0)
+    {
+        perror("zygote");
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    if (pid == 0)
+    {
+        close(sv[0]);
+        zygote_loop(sv[1]);
+    }
+    close(sv[1]);
+    zygote_fd = sv[0];
+    zygote_pid = pid;
+}
+
+/* Close a job server client's connection and drop any of its command lines that are */
+/* still queued.  The event loop frees the client once none of its jobs are running. */
+void server_client_close(server_client * c)
+{
+    server_request ** r = &server_queue;
+
+    if (c->fd >= 0)
+    {
+
+        close(c->fd);
+        c->fd = -1;
+        server_queue_tail = NULL;
+        while (*r)
+        {
+            if ((*r)->client == c)
+            {
+                server_request * dropped = *r;
+                *r = dropped->next;
+                free(dropped->line);
+                free(dropped);
+                c->jobs--;
+            }
+            else
+            {
+                server_queue_tail = *r;
+                r = &(*r)->next;
+            }
+        }
+    }
+}
+
+/* Write as much of a job server client's pending replies as the socket will take. */
+void server_flush(server_client * c)
+{
+    while (c->fd >= 0 && c->written < c->output.length)
+    {
+        ssize_t n = send(c->fd, c->output.data + c->written, c->output.length - c->written,
+            MSG_NOSIGNAL|MSG_DONTWAIT);
+        if (n < 0)
+        {
+            if (errno != EAGAIN && errno != EINTR)
+            {
+                server_client_close(c);
+            }
+            return;
+        }
+        c->written += n;
+    }
+    if (c->fd >= 0)
+    {
+        c->output.length = c->written = 0;
+    }
+}
+
+/* Report a change in the status of a job started by the job server to the client that */
+/* submitted it.  Completed jobs free their slot and report their exit status. */
+void server_job_status(job * j, const char * status)
+{
+    server_client * c = j->client;
+
+    if (!strcmp(status, "completed"))
+    {
+        char code[16];
+
+        snprintf(code, sizeof(code), "%d", job_exit_status(j));
+        server_reply(c, j->client_id, status, code);
+        server_running--;
+        j->client = NULL;
+        if (c)
+        {
+            c->jobs--;
+        }
+    }
+    else if (!strcmp(status, "launched"))
+    {
+        char pgid[16];
+
+        snprintf(pgid, sizeof(pgid), "%ld", (long)j->pgid);
+        server_reply(c, j->client_id, status, pgid);
+    }
+    else
+    {
+        server_reply(c, j->client_id, status, NULL);
+    }
+}
+
+/* Read from a job server client and submit each whole command line received. */
+void server_read(server_client * c)
+{
+    char * line;
+    char * end;
+
+    while (1)
+    {
+        ssize_t n;
+
+        buffer_reserve(&c->input, 4096);
+        n = read(c->fd, c->input.data + c->input.length, c->input.size - c->input.length - 1);
+        if (n > 0)
+        {
+            c->input.length += n;
+            continue;
+        }
+        if (n == 0)
+        {
+            c->eof = 1;
+        }
+        else if (errno != EAGAIN && errno != EINTR)
+        {
+            server_client_close(c);
+            return;
+        }
+        break;
+    }
+
+    c->input.data[c->input.length] = '\0';
+    for (line = c->input.data; c->fd >= 0 && (end = memchr(line, '\n', c->input.data + c->input.length - line));
+        line = end + 1)
+    {
+        *end = '\0';
+        server_submit(c, line);
+    }
+    c->input.length -= line - c->input.data;
+    memmove(c->input.data, line, c->input.length);
+}
+
+/* Queue a reply of the form "<id> <status> [<detail>]" to a job server client. */
+void server_reply(server_client * c, unsigned long id, const char * status, const char * detail)
+{
+    char reply[64];
+    int length;
+
+    if (!c || c->fd < 0)
+    {
+        return;
+    }
+    length = snprintf(reply, sizeof(reply), "%lu %s%s", id, status, detail ? " " : "");
+    buffer_append(&c->output, reply, length);
+    if (detail)
+    {
+        buffer_append(&c->output, detail, strlen(detail));
+    }
+    buffer_append(&c->output, "\n", 1);
+    server_flush(c);
+}
+
+/* Run as a job server.  Command lines are read from clients connected to the Unix */
+/* socket at path, one per line, and run as jobs, at most CSHELL_SERVER_JOBS at once. */
+/* Each client is told when its jobs are launched, stopped and completed. */
+void server_run(const char * path)
+{
+    struct sockaddr_un address;
+    struct sigaction action;
+    struct pollfd * fds = NULL;
+    size_t fds_size = 0;
+    const char * limit = var_get("CSHELL_SERVER_JOBS");
+    int listen_fd, probe_fd, null_fd;
+
+    server_mode = 1;
+    shell_pgid = getpid();
+    server_limit = limit && atol(limit) > 0 ? (unsigned long)atol(limit) : (unsigned long)sysconf(_SC_NPROCESSORS_ONLN);
+
+    //Jobs read from /dev/null rather than from whatever started the server.
+    null_fd = open("/dev/null", O_RDONLY);
+    if (null_fd >= 0)
+    {
+        dup2(null_fd, STDIN_FILENO);
+        close(null_fd);
+    }
+
+    jobserver_init();
+    if (var_get("CSHELL_ZYGOTE") && strcmp(var_get("CSHELL_ZYGOTE"), "0"))
+    {
+        zygote_start();
+    }
+
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "cShell: socket path is too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    //Replace a socket left behind by a server that has exited, but not one in use.
+    probe_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (connect(probe_fd, (struct sockaddr *)&address, sizeof(address)) == 0)
+    {
+        fprintf(stderr, "cShell: a server is already listening on %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    close(probe_fd);
+    if (errno == ECONNREFUSED)
+    {
+        unlink(path);
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0
+        || listen(listen_fd, SOMAXCONN) < 0)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    sigchld_init();
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = server_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    while (!server_stop)
+    {
+        server_client * c;
+        server_client ** link;
+        size_t count = 2;
+
+        for (c = server_clients; c; c = c->next)
+        {
+            count++;
+        }
+        if (count > fds_size)
+        {
+            fds_size = count * 2;
+            fds = (struct pollfd *)realloc(fds, sizeof(struct pollfd) * fds_size);
+        }
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = sigchld_pipe[0];
+        fds[1].events = POLLIN;
+        count = 2;
+        for (c = server_clients; c; c = c->next, count++)
+        {
+            fds[count].fd = c->fd;
+            fds[count].events = (c->eof ? 0 : POLLIN) | (c->written < c->output.length ? POLLOUT : 0);
+        }
+
+        if (poll(fds, count, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        //Reap the jobs that have changed state, which frees their slots.
+        if (fds[1].revents)
+        {
+            char drain[256];
+            while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0);
+            do_job_notification();
+        }
+
+        //Serve the clients that were polled.  Clients are only added and freed below.
+        count = 2;
+        for (c = server_clients; c; c = c->next, count++)
+        {
+            if (!fds[count].revents)
+            {
+                continue;
+            }
+            if (fds[count].revents & POLLOUT)
+            {
+                server_flush(c);
+            }
+            if (c->fd >= 0 && fds[count].revents & (POLLIN|POLLHUP|POLLERR))
+            {
+                server_read(c);
+            }
+        }
+
+        if (fds[0].revents)
+        {
+            int fd;
+            while ((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC|SOCK_NONBLOCK)) >= 0)
+            {
+                c = (server_client *)calloc(1, sizeof(server_client));
+                c->fd = fd;
+                c->next = server_clients;
+                server_clients = c;
+            }
+        }
+
+        //Start queued command lines in the slots that are free.
+        while (server_queue && server_running < server_limit)
+        {
+            server_request * r = server_queue;
+            if (!(server_queue = r->next))
+            {
+                server_queue_tail = NULL;
+            }
+            server_start(r->client, r->id, r->line);
+            free(r->line);
+            free(r);
+        }
+
+        //Close the connections of clients that have finished and been told everything, and
+        //free the clients that have gone once their jobs have completed.
+        for (link = &server_clients; (c = *link);)
+        {
+            if (c->fd >= 0 && c->eof && !c->jobs && c->written == c->output.length)
+            {
+                server_client_close(c);
+            }
+            if (c->fd < 0 && !c->jobs)
+            {
+                *link = c->next;
+                free(c->input.data);
+                free(c->output.data);
+                free(c);
+            }
+            else
+            {
+                link = &c->next;
+            }
+        }
+    }
+
+    unlink(path);
+    exit(EXIT_SUCCESS);
+}
+
+/* Signal handler for SIGINT and SIGTERM in the job server, which stop it. */
+void server_signal(int signo)
+{
+    (void)signo;
+    server_stop = 1;
+}
+
+/* Start a command line for a job server client as a background job.  Builtins are not */
+/* run, as they would change the state shared by every client. */
+void server_start(server_client * c, unsigned long id, char * line)
+{
+    char ** tokens = tokenize_line(line);
+    char ** cmd_args = expand_words(tokens);
+    const char * error = NULL;
+    job * j;
+
+    free(tokens);
+    if (!cmd_args || !cmd_args[0])
+    {
+        error = cmd_args ? "empty command" : "expansion failed";
+    }
+    else
+    {
+        for (const char ** name = builtin_names; *name; name++)
+        {
+            if (!strcmp(*name, cmd_args[0]))
+            {
+                error = "builtins are not supported";
+            }
+        }
+    }
+    if (!error)
+    {
+        j = add_job(cmd_args[0]);
+        j->client = c;
+        j->client_id = id;
+        if (cmd_parser(cmd_args, j) < 0)
+        {
+            error = "malformed command";
+            free_job(j);
+        }
+        else
+        {
+            server_running++;
+            launch_job(j, 0);
+        }
+    }
+    if (error)
+    {
+        server_reply(c, id, "error", error);
+        c->jobs--;
+    }
+    free_words(cmd_args);
+}
+
+/* Number a command line from a job server client and start it, or queue it if the */
+/* maximum number of jobs are running. */
+void server_submit(server_client * c, char * line)
+{
+    unsigned long id = ++c->next_id;
+
+    c->jobs++;
+    if (!server_queue && server_running < server_limit)
+    {
+        server_start(c, id, line);
+    }
+    else
+    {
+        server_request * r = (server_request *)malloc(sizeof(server_request));
+        r->client = c;
+        r->id = id;
+        r->line = strdup(line);
+        r->next = NULL;
+        if (server_queue_tail)
+        {
+            server_queue_tail->next = r;
+        }
+        else
+        {
+            server_queue = r;
+        }
+        server_queue_tail = r;
+    }
+}
+
+/* Take a token from the jobserver for a job, waiting until one is free, and pass it to */
+/* the shell through the job's token pipe so that it is returned when the job completes. */
+/* Called in the job's first process before it execs. */
+void jobserver_acquire(job * j)
+{
+    char token;
+
+    //make puts the read end in non-blocking mode, which is shared by every process using it.
+    while (read(jobserver_fds[0], &token, 1) != 1)
+    {
+        struct pollfd pfd = {jobserver_fds[0], POLLIN, 0};
+
+        if (errno == EAGAIN)
+        {
+            poll(&pfd, 1, -1);
+        }
+        else if (errno != EINTR)
+        {
+            return;
+        }
+    }
+    write(j->token_pipe[1], &token, 1);
+}
+
+/* Create a GNU make jobserver if CSHELL_JOBSERVER is set to a number of tokens and add */
+/* it to MAKEFLAGS, so that make run by any job takes its extra job slots from the same */
+/* pool.  Every job holds one token itself, so no more than that many jobs and make */
+/* recipes run at once across all jobs. */
+void jobserver_init(void)
+{
+    const char * value = var_get("CSHELL_JOBSERVER");
+    const char * makeflags = var_get("MAKEFLAGS");
+    long tokens = value ? atol(value) : 0;
+    char * flags;
+
+    if (tokens <= 0)
+    {
+        return;
+    }
+    if (pipe(jobserver_fds) < 0)
+    {
+        perror("jobserver");
+        return;
+    }
+    if (tokens > 4096)
+    {
+        fcntl(jobserver_fds[1], F_SETPIPE_SZ, tokens);
+    }
+    for (long i = 0; i < tokens; i++)
+    {
+        write(jobserver_fds[1], "+", 1);
+    }
+    sigchld_init();
+    asprintf(&flags, "%s%s-j%ld --jobserver-auth=%d,%d", makeflags ? makeflags : "",
+        makeflags && *makeflags ? " " : "", tokens, jobserver_fds[0], jobserver_fds[1]);
+    var_set("MAKEFLAGS", flags, 1);
+    free(flags);
+}
+
+/* Return a job's jobserver token, if its first process took one. */
+void jobserver_release(job * j)
+{
+    char token;
+
+    if (j->token_pipe[0] < 0)
+    {
+        return;
+    }
+    if (read(j->token_pipe[0], &token, 1) == 1)
+    {
+        write(jobserver_fds[1], &token, 1);
+    }
+    close(j->token_pipe[0]);
+    j->token_pipe[0] = -1;
+    if (j->token_pipe[1] >= 0)
+    {
+        close(j->token_pipe[1]);
+        j->token_pipe[1] = -1;
+    }
+}
+
+/* Write to sigchld_pipe when a child changes state, so that a poll loop wakes up. */
+void sigchld_handler(int signo)
+{
+    int saved_errno = errno;
+
+    (void)signo;
+    write(sigchld_pipe[1], "", 1);
+    errno = saved_errno;
+}
+
+/* Create sigchld_pipe and install sigchld_handler, if that has not been done already. */
+void sigchld_init(void)
+{
+    struct sigaction action;
+
+    if (sigchld_pipe[0] >= 0)
+    {
+        return;
+    }
+    if (pipe2(sigchld_pipe, O_CLOEXEC|O_NONBLOCK) < 0)
+    {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sigchld_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &action, NULL);
+}
+
+/* Wait for something to happen: fd (unless it is -1) becoming readable, a child changing */
+/* state, output from a background job, which is drained into its log, or from a captured */
+/* job that was stopped, which is copied to the terminal, or a job's timeout or the */
+/* foreground deadline expiring, which are acted on.  Return a mask of EVENT_INPUT, */
+/* EVENT_CHILD, EVENT_OUTPUT and EVENT_TIMER for what happened, or 0 if timeout (in */
+/* milliseconds, -1 for none) passed first.  The extra descriptors are polled as well */
+/* and their revents are left for the caller. */
+int event_wait(int fd, struct pollfd * extra, size_t extra_count, int timeout)
+{
+    struct pollfd * fds;
+    job_log ** logs;
+    job ** jobs;
+    size_t count = 3;
+    size_t logs_end;
+    size_t timers_end;
+    size_t forwards_end;
+    int events = 0;
+
+    notify_flush();
+    //Every log and timer is polled, however many background jobs there are.
+    for (job_log * log = job_logs; log; log = log->next)
+    {
+        count += log->fd >= 0;
+    }
+    for (job * j = job_list; j; j = j->next)
+    {
+        count += (j->timer_fd >= 0) + (j->forward_fds[0] >= 0) + (j->forward_fds[1] >= 0);
+    }
+    fds = (struct pollfd *)malloc(sizeof(struct pollfd) * (count + extra_count));
+    logs = (job_log **)malloc(sizeof(job_log *) * count);
+    jobs = (job **)malloc(sizeof(job *) * count);
+    count = 3;
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = sigchld_pipe[0];
+    fds[1].events = POLLIN;
+    fds[2].fd = deadline_job ? deadline_fd : -1;
+    fds[2].events = POLLIN;
+    for (job_log * log = job_logs; log; log = log->next)
+    {
+        if (log->fd >= 0)
+        {
+            logs[count] = log;
+            fds[count].fd = log->fd;
+            fds[count++].events = POLLIN;
+        }
+    }
+    logs_end = count;
+    for (job * j = job_list; j; j = j->next)
+    {
+        if (j->timer_fd >= 0)
+        {
+            jobs[count] = j;
+            fds[count].fd = j->timer_fd;
+            fds[count++].events = POLLIN;
+        }
+    }
+    timers_end = count;
+    for (job * j = job_list; j; j = j->next)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            if (j->forward_fds[i] >= 0)
+            {
+                jobs[count] = j;
+                fds[count].fd = j->forward_fds[i];
+                fds[count++].events = POLLIN;
+            }
+        }
+    }
+    forwards_end = count;
+    if (extra_count)
+    {
+        memcpy(fds + count, extra, sizeof(struct pollfd) * extra_count);
+        count += extra_count;
+    }
+
+    if (poll(fds, count, timeout) <= 0)
+    {
+        free(fds);
+        free(logs);
+        free(jobs);
+        return 0;
+    }
+    for (size_t i = 0; i < extra_count; i++)
+    {
+        extra[i].revents = fds[forwards_end + i].revents;
+    }
+    if (fds[0].revents)
+    {
+        events |= EVENT_INPUT;
+    }
+    if (fds[1].revents)
+    {
+        char drain[256];
+        while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0);
+        events |= EVENT_CHILD;
+    }
+    if (fds[2].revents)
+    {
+        uint64_t expirations;
+        char * line;
+
+        read(deadline_fd, &expirations, sizeof(expirations));
+        //The warning is queued with the job notifications, and only given at their
+        //summary and all levels.
+        if (notify_level() >= NOTIFY_SUMMARY)
+        {
+            asprintf(&line, "%ld (running for over %ss): %s\n", (long)deadline_job->pgid,
+                var_get("CSHELL_DEADLINE_WARN"), deadline_job->command);
+            buffer_append(&notify_queue, line, strlen(line));
+            free(line);
+        }
+        events |= EVENT_TIMER;
+    }
+    for (size_t i = 3; i < logs_end; i++)
+    {
+        if (fds[i].revents)
+        {
+            joblog_drain(logs[i]);
+            events |= EVENT_OUTPUT;
+        }
+    }
+    for (size_t i = logs_end; i < timers_end; i++)
+    {
+        if (fds[i].revents)
+        {
+            job_timer_expired(jobs[i]);
+            events |= EVENT_TIMER;
+        }
+    }
+    for (size_t i = timers_end; i < forwards_end; i++)
+    {
+        if (fds[i].revents)
+        {
+            capture_drain(jobs[i], fds[i].fd == jobs[i]->forward_fds[1]);
+            events |= EVENT_OUTPUT;
+        }
+    }
+    free(fds);
+    free(logs);
+    free(jobs);
+    return events;
+}
+
+/* Arm deadline_fd to warn when the foreground job j has run for CSHELL_DEADLINE_WARN */
+/* seconds, or disarm it if j is NULL. */
+void deadline_arm(job * j)
+{
+    struct itimerspec spec;
+    char * warn = var_get("CSHELL_DEADLINE_WARN");
+    double seconds;
+
+    memset(&spec, 0, sizeof(spec));
+    if (!j)
+    {
+        if (deadline_job)
+        {
+            timerfd_settime(deadline_fd, 0, &spec, NULL);
+            deadline_job = NULL;
+        }
+        return;
+    }
+    if (!warn || parse_duration(warn, &seconds) < 0 || seconds <= 0)
+    {
+        return;
+    }
+    if (deadline_fd < 0 && (deadline_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC|TFD_NONBLOCK)) < 0)
+    {
+        return;
+    }
+    //The warning is delivered by the event loop that wait_for_job runs while it waits.
+    sigchld_init();
+    spec.it_value.tv_sec = (time_t)seconds;
+    spec.it_value.tv_nsec = (long)((seconds - (time_t)seconds) * 1e9);
+    timerfd_settime(deadline_fd, 0, &spec, NULL);
+    deadline_job = j;
+}
+
+/* Arm a timerfd that expires when the job has run for its timeout. */
+void job_timer_arm(job * j)
+{
+    struct itimerspec spec;
+
+    j->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC|TFD_NONBLOCK);
+    if (j->timer_fd < 0)
+    {
+        perror("timerfd_create");
+        return;
+    }
+    //Timers fire from the event loop, which needs the SIGCHLD pipe to wake up on children.
+    sigchld_init();
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = (time_t)j->timeout;
+    spec.it_value.tv_nsec = (long)((j->timeout - (time_t)j->timeout) * 1e9);
+    timerfd_settime(j->timer_fd, 0, &spec, NULL);
+}
+
+/* Close the job's timer, if it has one, so a finished job is never signalled. */
+void job_timer_close(job * j)
+{
+    if (j->timer_fd >= 0)
+    {
+        close(j->timer_fd);
+        j->timer_fd = -1;
+    }
+}
+
+/* Act on the expiry of a job's timer: send the process group SIGTERM and rearm the timer */
+/* for the grace period, then SIGKILL if the job is still running when that expires. */
+void job_timer_expired(job * j)
+{
+    struct itimerspec spec;
+    uint64_t expirations;
+
+    read(j->timer_fd, &expirations, sizeof(expirations));
+    if (j->timed_out)
+    {
+        j->timed_out = 2;
+        job_timer_signal(j, SIGKILL);
+        job_timer_close(j);
+        return;
+    }
+    j->timed_out = 1;
+    job_timer_signal(j, SIGTERM);
+    //A stopped job would never act on SIGTERM, so wake it up to receive it.
+    job_timer_signal(j, SIGCONT);
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = (time_t)j->grace;
+    spec.it_value.tv_nsec = (long)((j->grace - (time_t)j->grace) * 1e9);
+    if (j->grace <= 0 || timerfd_settime(j->timer_fd, 0, &spec, NULL) < 0)
+    {
+        j->timed_out = 2;
+        job_timer_signal(j, SIGKILL);
+        job_timer_close(j);
+    }
+}
+
+/* Send a signal to the job's process group, or to each of its processes if they were */
+/* left in the shell's own group, as they are when the shell is not interactive. */
+void job_timer_signal(job * j, int sig)
+{
+    if (j->pgid != getpgrp())
+    {
+        kill(-j->pgid, sig);
+        return;
+    }
+    for (process * p = j->first_process; p; p = p->next)
+    {
+        if (!p->completed)
+        {
+            kill(p->pid, sig);
+        }
+    }
+}
+
+/* Add output to a job log, moving the oldest bytes to the spill file, if there is one, */
+/* once the ring buffer is full. */
+void joblog_append(job_log * log, const char * data, size_t length)
+{
+    size_t overflow = log->length + length > log->size ? log->length + length - log->size : 0;
+    size_t tail;
+
+    log->total += length;
+
+    //Output that would not fit even in an empty buffer goes straight to the spill file.
+    if (length > log->size)
+    {
+        if (log->spill_fd >= 0)
+        {
+            write(log->spill_fd, data, length - log->size);
+        }
+        overflow -= length - log->size;
+        data += length - log->size;
+        length = log->size;
+    }
+    while (overflow)
+    {
+        size_t chunk = log->size - log->start < overflow ? log->size - log->start : overflow;
+        if (log->spill_fd >= 0)
+        {
+            write(log->spill_fd, log->data + log->start, chunk);
+        }
+        log->start = (log->start + chunk) % log->size;
+        log->length -= chunk;
+        overflow -= chunk;
+    }
+
+    tail = (log->start + log->length) % log->size;
+    if (tail + length > log->size)
+    {
+        memcpy(log->data + tail, data, log->size - tail);
+        memcpy(log->data, data + log->size - tail, length - (log->size - tail));
+    }
+    else
+    {
+        memcpy(log->data + tail, data, length);
+    }
+    log->length += length;
+}
+
+/* Detach a job's log when the job is freed.  The log is kept, so its output can still */
+/* be shown, until there are more than JOB_LOG_KEEP logs of finished jobs. */
+void joblog_close(job * j)
+{
+    job_log * log = j->log;
+    job_log * previous = NULL;
+    int finished = 0;
+
+    if (!log)
+    {
+        return;
+    }
+    j->log = NULL;
+    log->running = 0;
+    if (log->fd >= 0)
+    {
+        joblog_drain(log);
+    }
+    for (log = job_logs; log; previous = log, log = log->next)
+    {
+        if (!log->running && log->fd < 0 && ++finished > JOB_LOG_KEEP)
+        {
+            previous->next = log->next;
+            joblog_free(log);
+            log = previous;
+        }
+    }
+}
+
+/* Read everything a job has written so far into its log. */
+void joblog_drain(job_log * log)
+{
+    char chunk[65536];
+    ssize_t n;
+
+    while ((n = read(log->fd, chunk, sizeof(chunk))) > 0)
+    {
+        joblog_append(log, chunk, n);
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EINTR))
+    {
+        close(log->fd);
+        log->fd = -1;
+    }
+}
+
+/* Find a job log by %id, or by the PGID of its job.  Return NULL if there is none. */
+job_log * joblog_find(const char * spec)
+{
+    long number = atol(spec[0] == '%' ? spec + 1 : spec);
+
+    for (job_log * log = job_logs; log; log = log->next)
+    {
+        if (spec[0] == '%' ? log->id == number : log->pgid == number)
+        {
+            return log;
+        }
+    }
+    return NULL;
+}
+
+/* Free a job log and remove its spill file. */
+void joblog_free(job_log * log)
+{
+    if (log->fd >= 0)
+    {
+        close(log->fd);
+    }
+    if (log->spill_fd >= 0)
+    {
+        close(log->spill_fd);
+        unlink(log->spill_path);
+    }
+    free(log->spill_path);
+    free(log->command);
+    free(log->data);
+    free(log);
+}
+
+/* List the job logs, or show the output of one, optionally following it until the job */
+/* finishes or Enter is pressed. */
+void joblog_func(char ** cmd_args)
+{
+    job_log * log;
+    int follow = cmd_args[1] && cmd_args[2] && !strcmp(cmd_args[2], "-f");
+    unsigned long long printed;
+
+    if (!cmd_args[1])
+    {
+        for (log = job_logs; log; log = log->next)
+        {
+            if (log->fd >= 0)
+            {
+                joblog_drain(log);
+            }
+            printf("%%%d %ld (%s): %llu bytes  %s\n", log->id, (long)log->pgid,
+                log->running ? "running" : "done", log->total, log->command);
+        }
+        return;
+    }
+    if (!(log = joblog_find(cmd_args[1])))
+    {
+        puts("Unable to find a job log with matching %id or PGID.");
+        return;
+    }
+
+    if (log->fd >= 0)
+    {
+        joblog_drain(log);
+    }
+    if (log->spill_fd < 0 && log->total > log->length)
+    {
+        fprintf(stderr, "joblog: the first %llu bytes of output were dropped\n", log->total - log->length);
+    }
+    joblog_print(log, 0);
+    printed = log->total;
+    while (follow && log->fd >= 0)
+    {
+        int events = event_wait(STDIN_FILENO, NULL, 0, -1);
+
+        if (events & EVENT_CHILD)
+        {
+            update_status();
+        }
+        if (events & EVENT_OUTPUT)
+        {
+            joblog_print(log, printed);
+            printed = log->total;
+        }
+        if (events & EVENT_INPUT)
+        {
+            char discard[256];
+            read(STDIN_FILENO, discard, sizeof(discard));
+            break;
+        }
+    }
+}
+
+/* Give a background job a log instead of the terminal if CSHELL_JOBLOG is set to the */
+/* size of the ring buffer.  If CSHELL_JOBLOG_DIR is set, output that no longer fits in */
+/* the ring buffer is kept in a file there. */
+void joblog_open(job * j)
+{
+    const char * size = var_get("CSHELL_JOBLOG");
+    const char * dir = var_get("CSHELL_JOBLOG_DIR");
+    unsigned long long bytes;
+    job_log * log;
+    int fds[2];
+
+    if (!size || parse_size(size, &bytes) < 0 || bytes == 0 || j->stdout != STDOUT_FILENO
+        || j->stderr != STDERR_FILENO || pipe2(fds, O_CLOEXEC) < 0)
+    {
+        return;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    sigchld_init();
+
+    log = (job_log *)calloc(1, sizeof(job_log));
+    log->id = job_log_next_id++;
+    log->command = strdup(j->command);
+    log->running = 1;
+    log->fd = fds[0];
+    log->size = bytes;
+    log->data = (char *)malloc(bytes);
+    log->spill_fd = -1;
+    if (dir && *dir)
+    {
+        asprintf(&log->spill_path, "%s/cshell-%ld-%d.log", dir, (long)getpid(), log->id);
+        log->spill_fd = open(log->spill_path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+        if (log->spill_fd < 0)
+        {
+            perror(log->spill_path);
+        }
+    }
+    log->next = job_logs;
+    job_logs = log;
+
+    j->log = log;
+    j->stdout = fds[1];
+    j->stderr = fcntl(fds[1], F_DUPFD_CLOEXEC, 0);
+}
+
+/* Write the output in a job log from the given offset to stdout, reading from the spill */
+/* file what no longer fits in the ring buffer. */
+void joblog_print(job_log * log, unsigned long long from)
+{
+    unsigned long long oldest = log->total - log->length;
+    size_t offset;
+
+    fflush(stdout);
+    if (from < oldest && log->spill_fd >= 0)
+    {
+        char chunk[65536];
+        ssize_t n;
+
+        while (from < oldest && (n = pread(log->spill_fd, chunk,
+            oldest - from < sizeof(chunk) ? oldest - from : sizeof(chunk), from)) > 0)
+        {
+            write(STDOUT_FILENO, chunk, n);
+            from += n;
+        }
+    }
+    if (from < oldest)
+    {
+        from = oldest;
+    }
+    offset = (log->start + (from - oldest)) % log->size;
+    for (size_t left = log->total - from; left;)
+    {
+        size_t chunk = log->size - offset < left ? log->size - offset : left;
+        write(STDOUT_FILENO, log->data + offset, chunk);
+        offset = (offset + chunk) % log->size;
+        left -= chunk;
+    }
+}
+
+/* Wait for background jobs to finish.  Usage: wait [-n] [-t duration] [PGID | %N ...] */
+/* With no jobs given, waits for every job that is not stopped.  Each process is watched */
+/* through a pidfd and reaped on its own, so other children are left for the shell to */
+/* report and any number of jobs can be waited for at once with a timeout.  With -n, */
+/* returns as soon as any one of the jobs has finished.  $? is the exit status of the */
+/* last job given, or of the one that finished with -n, or 124 if the timeout expired. */
+void wait_func(char ** cmd_args)
+{
+    int any = 0;
+    double timeout = -1;
+    struct timespec start, now;
+    job ** jobs;
+    size_t job_count = 0;
+    process ** procs;
+    struct pollfd * fds;
+    size_t count = 0;
+    job * finished = NULL;
+    int index = 1;
+
+    for (; cmd_args[index] && cmd_args[index][0] == '-'; index++)
+    {
+        if (!strcmp(cmd_args[index], "-n"))
+        {
+            any = 1;
+        }
+        else if (!strcmp(cmd_args[index], "-t") && cmd_args[index + 1]
+            && parse_duration(cmd_args[index + 1], &timeout) == 0)
+        {
+            index++;
+        }
+        else
+        {
+            puts("Usage: wait [-n] [-t duration] [PGID | %N ...]");
+            last_status = 2;
+            return;
+        }
+    }
+
+    //Collect the jobs to wait for, by PGID or by the number of their job log.
+    count = 1;
+    for (job * j = job_list; j; j = j->next)
+    {
+        count++;
+    }
+    for (int i = index; cmd_args[i]; i++)
+    {
+        count++;
+    }
+    jobs = (job **)malloc(sizeof(job *) * count);
+    if (!cmd_args[index])
+    {
+        for (job * j = job_list; j; j = j->next)
+        {
+            if (!job_is_stopped(j) || job_is_completed(j))
+            {
+                jobs[job_count++] = j;
+            }
+        }
+    }
+    for (; cmd_args[index]; index++)
+    {
+        job * j = NULL;
+
+        if (cmd_args[index][0] == '%')
+        {
+            for (j = job_list; j && !(j->log && j->log->id == atoi(cmd_args[index] + 1)); j = j->next);
+        }
+        else
+        {
+            j = find_job((pid_t)atoi(cmd_args[index]));
+        }
+        if (!j)
+        {
+            printf("Unable to find job with matching PGID or %%N: %s\n", cmd_args[index]);
+            last_status = 127;
+            free(jobs);
+            return;
+        }
+        jobs[job_count++] = j;
+    }
+
+    //Open a pidfd for each process that has not been reaped.  A process that cannot have
+    //one, e.g. when out of descriptors, is checked with waitpid whenever SIGCHLD arrives.
+    for (size_t i = 0; i < job_count; i++)
+    {
+        for (process * p = jobs[i]->first_process; p; p = p->next)
+        {
+            count += !p->completed;
+        }
+    }
+    procs = (process **)malloc(sizeof(process *) * (count + 1));
+    fds = (struct pollfd *)malloc(sizeof(struct pollfd) * (count + 1));
+    count = 0;
+    for (size_t i = 0; i < job_count; i++)
+    {
+        for (process * p = jobs[i]->first_process; p; p = p->next)
+        {
+            if (!p->completed)
+            {
+                procs[count] = p;
+                fds[count].fd = (int)syscall(SYS_pidfd_open, p->pid, 0);
+                fds[count++].events = POLLIN;
+            }
+        }
+    }
+    sigchld_init();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (1)
+    {
+        size_t done = 0;
+        int ms = -1;
+        int events;
+
+        for (size_t i = 0; i < job_count; i++)
+        {
+            if (job_is_completed(jobs[i]))
+            {
+                done++;
+                if (!finished)
+                {
+                    finished = jobs[i];
+                }
+            }
+        }
+        if (done == job_count || (any && done))
+        {
+            break;
+        }
+        if (timeout >= 0)
+        {
+            double left;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left = timeout - (now.tv_sec - start.tv_sec) - (now.tv_nsec - start.tv_nsec) / 1e9;
+            if (left <= 0)
+            {
+                break;
+            }
+            ms = (int)(left * 1000) + 1;
+        }
+
+        events = event_wait(-1, fds, count, ms);
+        for (size_t i = 0; i < count; i++)
+        {
+            if ((fds[i].fd >= 0 && fds[i].revents) || (fds[i].fd < 0 && events & EVENT_CHILD))
+            {
+                wait_reap(procs[i], fds[i].fd);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (fds[i].fd >= 0)
+        {
+            close(fds[i].fd);
+        }
+    }
+    if (job_count && !(any ? finished != NULL : job_is_completed(jobs[job_count - 1])))
+    {
+        last_status = 124;
+    }
+    else if (job_count)
+    {
+        last_status = job_exit_status(any ? finished : jobs[job_count - 1]);
+    }
+    free(procs);
+    free(fds);
+    free(jobs);
+}
+
+/* Reap a process that may have exited, through its pidfd if it has one or its pid if not, */
+/* and record its status.  Return 0 if it was reaped, -1 if it has not exited. */
+int wait_reap(process * p, int pidfd)
+{
+    siginfo_t info;
+    int status;
+
+    if (p->completed)
+    {
+        return 0;
+    }
+    memset(&info, 0, sizeof(info));
+    //The system call, unlike the C library's waitid, also returns the resource usage.
+    if (syscall(SYS_waitid, pidfd >= 0 ? P_PIDFD : P_PID, pidfd >= 0 ? pidfd : p->pid, &info,
+        WEXITED|WNOHANG, &child_usage) < 0 || info.si_pid == 0)
+    {
+        return -1;
+    }
+    if (info.si_code == CLD_EXITED)
+    {
+        status = (info.si_status & 0xff) << 8;
+    }
+    else
+    {
+        status = info.si_status | (info.si_code == CLD_DUMPED ? 0x80 : 0);
+    }
+    return mark_process_status(info.si_pid, status);
+}
+
+/* Turn the offsets in a list of AST nodes mapped from a script cache file back into */
+/* pointers into the mapping at base, checking that each lies within its length bytes. */
+/* The first node is stored in list.  Return 0 on success, -1 if the file is corrupt. */
+int ast_load(char * base, size_t length, size_t offset, ast_node ** list)
+{
+    ast_node ** link = list;
+
+    *list = NULL;
+    while (offset)
+    {
+        ast_node * node;
+
+        if (offset % 8 || offset + sizeof(ast_node) > length)
+        {
+            return -1;
+        }
+        node = (ast_node *)(base + offset);
+        *link = node;
+        if (node->name)
+        {
+            if ((size_t)node->name >= length)
+            {
+                return -1;
+            }
+            node->name = base + (size_t)node->name;
+        }
+        if (node->words)
+        {
+            size_t words = (size_t)node->words;
+
+            if (words % 8 || words >= length)
+            {
+                return -1;
+            }
+            node->words = (char **)(base + words);
+            for (size_t i = 0; ; i++)
+            {
+                if (words + (i + 1) * sizeof(char *) > length || (size_t)node->words[i] >= length)
+                {
+                    return -1;
+                }
+                if (!node->words[i])
+                {
+                    break;
+                }
+                node->words[i] = base + (size_t)node->words[i];
+            }
+        }
+        if (ast_load(base, length, (size_t)node->cond, &node->cond) < 0
+         || ast_load(base, length, (size_t)node->body, &node->body) < 0
+         || ast_load(base, length, (size_t)node->orelse, &node->orelse) < 0)
+        {
+            return -1;
+        }
+        offset = (size_t)node->next;
+        link = &node->next;
+    }
+    return 0;
+}
+
+/* Append a list of AST nodes to a script cache image, with every pointer replaced by its */
+/* offset from the start of the image.  Return the offset of the first node, or 0 for an */
+/* empty list. */
+size_t ast_save(buffer * image, ast_node * list)
+{
+    static const char padding[8];
+    size_t first = 0;
+    size_t previous = 0;
+
+    for (ast_node * node = list; node; node = node->next)
+    {
+        ast_node copy = *node;
+        size_t offset;
+
+        copy.next = NULL;
+        copy.cond = (ast_node *)ast_save(image, node->cond);
+        copy.body = (ast_node *)ast_save(image, node->body);
+        copy.orelse = (ast_node *)ast_save(image, node->orelse);
+        if (node->name)
+        {
+            copy.name = (char *)image->length;
+            buffer_append(image, node->name, strlen(node->name) + 1);
+        }
+        if (node->words)
+        {
+            size_t count = 0;
+            size_t * words;
+
+            while (node->words[count])
+            {
+                count++;
+            }
+            words = (size_t *)calloc(count + 1, sizeof(size_t));
+            for (size_t i = 0; i < count; i++)
+            {
+                words[i] = image->length;
+                buffer_append(image, node->words[i], strlen(node->words[i]) + 1);
+            }
+            buffer_append(image, padding, (8 - image->length % 8) % 8);
+            copy.words = (char **)image->length;
+            buffer_append(image, (char *)words, (count + 1) * sizeof(size_t));
+            free(words);
+        }
+        buffer_append(image, padding, (8 - image->length % 8) % 8);
+        offset = image->length;
+        buffer_append(image, (char *)&copy, sizeof(copy));
+        if (previous)
+        {
+            ((ast_node *)(image->data + previous))->next = (ast_node *)offset;
+        }
+        else
+        {
+            first = offset;
+        }
+        previous = offset;
+    }
+    return first;
+}
+
+/* Return the path of the cache file for the script with the given status, or NULL if */
+/* scripts are not to be cached.  The path is to be freed by the caller. */
+char * script_cache_path(struct stat * st)
+{
+    char * dir;
+    char * path = NULL;
+    unsigned long long hash = 14695981039346656037ULL;
+    unsigned long long id;
+
+    if (!S_ISREG(st->st_mode) || (var_get("CSHELL_SCRIPT_CACHE") && !strcmp(var_get("CSHELL_SCRIPT_CACHE"), "0"))
+     || !(dir = cache_dir()))
+    {
+        return NULL;
+    }
+    id = st->st_dev;
+    hash = hash_bytes(&id, sizeof(id), hash);
+    id = st->st_ino;
+    hash = hash_bytes(&id, sizeof(id), hash);
+    asprintf(&path, "%s/scripts", dir);
+    mkdir(path, 0700);
+    free(path);
+    asprintf(&path, "%s/scripts/%016llx", dir, hash);
+    free(dir);
+    return path;
+}
+
+/* Map the cache file at path and, if it was made from the script with the given status, */
+/* store its AST in list and the mapping in image and size.  Return 0 on success, -1 if */
+/* there is no usable cache. */
+int script_cache_load(const char * path, struct stat * st, ast_node ** list, char ** image, size_t * size)
+{
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    struct stat cache_st;
+    ast_cache_header * header;
+    char * base;
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (fstat(fd, &cache_st) < 0 || (size_t)cache_st.st_size < sizeof(ast_cache_header))
+    {
+        close(fd);
+        return -1;
+    }
+    //The mapping is private, so pointers are relocated in place without touching the file.
+    base = (char *)mmap(NULL, cache_st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        return -1;
+    }
+    header = (ast_cache_header *)base;
+    if (memcmp(header->magic, AST_CACHE_MAGIC, sizeof(header->magic))
+     || header->node_size != sizeof(ast_node)
+     || header->dev != (unsigned long long)st->st_dev
+     || header->ino != (unsigned long long)st->st_ino
+     || header->size != (unsigned long long)st->st_size
+     || header->mtime_sec != (long long)st->st_mtim.tv_sec
+     || header->mtime_nsec != (long long)st->st_mtim.tv_nsec
+     || header->length != (unsigned long long)cache_st.st_size
+     || base[cache_st.st_size - 1] != '\0'
+     || ast_load(base, cache_st.st_size, header->root, list) < 0)
+    {
+        munmap(base, cache_st.st_size);
+        return -1;
+    }
+    *image = base;
+    *size = cache_st.st_size;
+    return 0;
+}
+
+/* Write the AST of the script with the given status to the cache file at path.  The file */
+/* is written under another name and renamed, so a shell reading it never sees part of it. */
+void script_cache_save(const char * path, struct stat * st, ast_node * list)
+{
+    buffer image = {NULL, 0, 0};
+    ast_cache_header header;
+    char * temp_path = NULL;
+    int fd;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, AST_CACHE_MAGIC, sizeof(header.magic));
+    header.node_size = sizeof(ast_node);
+    header.dev = st->st_dev;
+    header.ino = st->st_ino;
+    header.size = st->st_size;
+    header.mtime_sec = st->st_mtim.tv_sec;
+    header.mtime_nsec = st->st_mtim.tv_nsec;
+    buffer_append(&image, (char *)&header, sizeof(header));
+    header.root = ast_save(&image, list);
+    //Every string offset then reaches a NUL before the end of the file.
+    buffer_append(&image, "", 1);
+    header.length = image.length;
+    memcpy(image.data, &header, sizeof(header));
+
+    asprintf(&temp_path, "%s.%ld", path, (long)getpid());
+    fd = open(temp_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+    if (fd >= 0)
+    {
+        if (write(fd, image.data, image.length) == (ssize_t)image.length && close(fd) == 0)
+        {
+            rename(temp_path, path);
+        }
+        else
+        {
+            close(fd);
+            unlink(temp_path);
+        }
+    }
+    free(temp_path);
+    free(image.data);
+}
+
+/* Run cShell without a terminal, called from main() when it is given a script to run or */
+/* its input is not a terminal.  The script's arguments are $0, $1 and so on, and */
+/* commands on standard input are read to the end before any are run.  Return the exit */
+/* status of the last command. */
+int script_main(int argc, char ** argv)
+{
+    char * shell_path = realpath(argv[0], NULL);
+
+    if (shell_path)
+    {
+        var_set("SHELL", shell_path, 1);
+        free(shell_path);
+    }
+    shell_terminal = STDIN_FILENO;
+    shell_is_interactive = 0;
+    shell_pgid = getpgrp();
+    jobserver_init();
+    //Keep the output of builtins in order with that of the jobs they are run between.
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if (argc > 1)
+    {
+        return script_run(argv[1], argv + 1);
+    }
+    else
+    {
+        buffer text = {NULL, 0, 0};
+        arena_block * arena = NULL;
+        ast_node * list = NULL;
+        char data[65536];
+        ssize_t n;
+        int result;
+
+        while ((n = read(STDIN_FILENO, data, sizeof(data))) > 0)
+        {
+            buffer_append(&text, data, n);
+        }
+        buffer_append(&text, "", 0);
+        result = script_parse(text.data, &arena, &list);
+        free(text.data);
+        if (result < 0)
+        {
+            arena_free(arena);
+            return 2;
+        }
+        ast_run(list);
+        if (!ast_keep_arena)
+        {
+            arena_free(arena);
+        }
+        return last_status;
+    }
+}
+
+/* Parse the text of a script into a list of commands, where the end of a line ends a */
+/* command as ";" does, a word starting with "#" starts a comment running to the end of */
+/* the line and here-documents run to their delimiters.  Return 0 on success or -1 after */
+/* reporting a syntax error, including a compound command left unfinished at the end of */
+/* the text.  A here-document left unfinished runs to the end of the text. */
+int script_parse(const char * text, arena_block ** arena, ast_node ** list)
+{
+    buffer gathered = {NULL, 0, 0};
+    char ** tokens;
+    int result;
+
+    heredoc_gather(text, &gathered, 1);
+    tokens = tokenize_line(gathered.data);
+    result = ast_parse(tokens, arena, list);
+    free(tokens);
+    free(gathered.data);
+    if (result > 0)
+    {
+        puts("Syntax error: unexpected end of file.");
+        result = -1;
+    }
+    return result;
+}
+
+/* Run the script at path with the given arguments as $0, $1 and so on, or none if args */
+/* is NULL.  The script's AST is taken from its cache file if it has not changed since the */
+/* cache was written, and is otherwise parsed and cached.  Return the exit status of the */
+/* last command, 2 after a syntax error or 127 if the script cannot be read. */
+int script_run(const char * path, char ** args)
+{
+    char ** saved_args = positional_args;
+    int saved_count = positional_count;
+    int saved_keep = ast_keep_arena;
+    arena_block * arena = NULL;
+    ast_node * list = NULL;
+    char * image = NULL;
+    size_t image_size = 0;
+    char * cache_path;
+    struct stat st;
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        fprintf(stderr, "cShell: %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return last_status = 127;
+    }
+    cache_path = script_cache_path(&st);
+    if (!cache_path || script_cache_load(cache_path, &st, &list, &image, &image_size) < 0)
+    {
+        buffer text = {NULL, 0, 0};
+        char data[65536];
+        ssize_t n;
+        int result;
+
+        while ((n = read(fd, data, sizeof(data))) > 0)
+        {
+            buffer_append(&text, data, n);
+        }
+        buffer_append(&text, "", 0);
+        result = script_parse(text.data, &arena, &list);
+        free(text.data);
+        if (result < 0)
+        {
+            arena_free(arena);
+            free(cache_path);
+            close(fd);
+            return last_status = 2;
+        }
+        if (cache_path)
+        {
+            script_cache_save(cache_path, &st, list);
+        }
+    }
+    free(cache_path);
+    close(fd);
+
+    if (args)
+    {
+        positional_args = args;
+        for (positional_count = 0; args[positional_count]; positional_count++);
+    }
+    ast_keep_arena = 0;
+    ast_interrupted = 0;
+    last_status = 0;
+    ast_run(list);
+    positional_args = saved_args;
+    positional_count = saved_count;
+
+    //Functions defined by the script refer to its nodes, so keep them if there are any.
+    if (!ast_keep_arena)
+    {
+        arena_free(arena);
+        if (image)
+        {
+            munmap(image, image_size);
+        }
+    }
+    ast_keep_arena = saved_keep;
+    return last_status;
+}
+
+/* Run the startup file, CSHELL_RC or ~/.cshellrc by default, if it exists. */
+void script_run_rc(void)
+{
+    char * path = NULL;
+
+    if (var_get("CSHELL_RC"))
+    {
+        path = strdup(var_get("CSHELL_RC"));
+    }
+    else if (var_get("HOME"))
+    {
+        asprintf(&path, "%s/.cshellrc", var_get("HOME"));
+    }
+    if (path && access(path, F_OK) == 0)
+    {
+        script_run(path, NULL);
+    }
+    free(path);
+}
+
+/* Write the queued job notifications, and a summary of the jobs completed since the */
+/* last time with CSHELL_NOTIFY=summary, with a single writev over the line being edited. */
+void notify_flush(void)
+{
+    struct iovec iov[2];
+    char summary[96];
+    int count = 0;
+
+    if (notify_queue.length)
+    {
+        iov[count].iov_base = notify_queue.data;
+        iov[count++].iov_len = notify_queue.length;
+    }
+    //A single job is reported as usual, as there is nothing to summarise.
+    if (notify_single)
+    {
+        iov[count].iov_base = notify_single;
+        iov[count++].iov_len = strlen(notify_single);
+    }
+    else if (notify_completed)
+    {
+        iov[count].iov_base = summary;
+        iov[count++].iov_len = snprintf(summary, sizeof(summary), "%d jobs completed (%d failed)\n",
+            notify_completed, notify_failed);
+    }
+    if (!count)
+    {
+        return;
+    }
+    editor_interrupt();
+    fflush(stderr);
+    //A signal can cut a long write short, so carry on from where it stopped.
+    for (struct iovec * next = iov; count > 0;)
+    {
+        ssize_t written = writev(STDERR_FILENO, next, count);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            break;
+        }
+        while (count > 0 && (size_t)written >= next->iov_len)
+        {
+            written -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0)
+        {
+            next->iov_base = (char *)next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+    notify_queue.length = 0;
+    free(notify_single);
+    notify_single = NULL;
+    notify_completed = notify_failed = 0;
+}
+
+/* Return the level of job notifications set by CSHELL_NOTIFY: "all", the default, */
+/* reports every job launched, completed or stopped; "summary" does not report jobs */
+/* launched and sums up those completed; "failures" only reports jobs that failed, timed */
+/* out or stopped, without CSHELL_DEADLINE_WARN warnings; and "none" reports nothing. */
+int notify_level(void)
+{
+    char * value = var_get("CSHELL_NOTIFY");
+
+    if (!value || !*value || !strcmp(value, "all"))
+    {
+        return NOTIFY_ALL;
+    }
+    if (!strcmp(value, "summary"))
+    {
+        return NOTIFY_SUMMARY;
+    }
+    if (!strcmp(value, "failures"))
+    {
+        return NOTIFY_FAILURES;
+    }
+    if (!strcmp(value, "none"))
+    {
+        return NOTIFY_NONE;
+    }
+    return NOTIFY_ALL;
+}
 
 /*** END OF ADDITIONAL FUNCTIONS ***/
 /*** END OF CODE; DO NOT ADD MATERIAL BEYOND THIS POINT ***/